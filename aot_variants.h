@@ -0,0 +1,289 @@
+// The ahead-of-time compiled variants of MyPipeline, emitted by
+// halide_test_generator at build time, and helpers to pick one for
+// this machine and run it.
+//
+// Only the runtime linked in from halide_test_runtime is used here,
+// so this header doesn't need Halide.h or libHalide.
+
+#ifndef AOT_VARIANTS_H
+#define AOT_VARIANTS_H
+
+#include "HalideRuntime.h"
+#include "HalideRuntimeCuda.h"
+#include "HalideRuntimeOpenCL.h"
+#include "device_pool.h"
+
+#include "halide_test_cpu.h"
+#include "halide_test_opencl.h"
+#include "halide_test_cuda.h"
+#include "halide_test_batch_cpu.h"
+#include "halide_test_batch_opencl.h"
+#include "halide_test_batch_cuda.h"
+#include "halide_test_interleaved_cpu.h"
+#include "halide_test_interleaved_opencl.h"
+#include "halide_test_interleaved_cuda.h"
+#include "halide_test_gray_cpu.h"
+#include "halide_test_gray_opencl.h"
+#include "halide_test_gray_cuda.h"
+#include "halide_test_rgba_cpu.h"
+#include "halide_test_rgba_opencl.h"
+#include "halide_test_rgba_cuda.h"
+#include "halide_test_gray16_cpu.h"
+#include "halide_test_gray16_opencl.h"
+#include "halide_test_gray16_cuda.h"
+#include "halide_test_rgb16_cpu.h"
+#include "halide_test_rgb16_opencl.h"
+#include "halide_test_rgb16_cuda.h"
+#include "halide_test_rgba16_cpu.h"
+#include "halide_test_rgba16_opencl.h"
+#include "halide_test_rgba16_cuda.h"
+
+#include <stdio.h>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+// The signature shared by all of the ahead-of-time variants.
+typedef int (*AotPipeline)(buffer_t *input, buffer_t *output);
+
+// An ahead-of-time compiled variant of MyPipeline. pipeline takes a
+// single three-dimensional image; batch_pipeline takes a
+// four-dimensional batch of same-sized images; interleaved_pipeline
+// takes a single image with interleaved channels. GPU variants also
+// say which device interface they run on, for copying buffers to the
+// device ahead of time.
+//
+// formats holds single-image pipelines compiled for each pixel format:
+// formats[0] for 8-bit values and formats[1] for 16-bit, indexed by the
+// number of channels (1, 3 or 4). formats[0][3] is pipeline itself.
+// Entries for other channel counts are NULL. Each one has its channels
+// unrolled and its LUT sized for its values; format_pipeline() picks
+// the one for a buffer.
+struct AotVariant {
+	const char *name;
+	AotPipeline pipeline;
+	AotPipeline batch_pipeline;
+	AotPipeline interleaved_pipeline;
+	bool on_gpu;
+	const struct halide_device_interface *(*device_interface)();
+	AotPipeline formats[2][5];
+};
+
+// Which GPU API to run on, and which runtime features to turn on.
+// Set with --target or the HALIDE_TEST_TARGET environment variable to
+// a comma-separated list such as "cuda" or "opencl,debug":
+//
+//   auto     the first of CUDA, Metal (on OS X) and OpenCL that's
+//            installed, or the CPU if none are (the default)
+//   cuda, opencl, metal, cpu
+//            that API, or the CPU if it isn't installed
+//   debug    log every runtime and GPU API call
+//   profile  report where the time goes at exit
+//
+// debug and profile change the generated code, so they only apply to
+// pipelines compiled with --jit.
+struct TargetConfig {
+	std::string api = "auto";
+	bool debug = false;
+	bool profile = false;
+
+	bool parse(const std::string &spec) {
+		size_t start = 0;
+		while (start <= spec.size()) {
+			size_t end = spec.find(',', start);
+			if (end == std::string::npos) {
+				end = spec.size();
+			}
+			std::string item = spec.substr(start, end - start);
+			if (item == "auto" || item == "cuda" || item == "opencl" ||
+			    item == "metal" || item == "cpu") {
+				api = item;
+			}
+			else if (item == "debug") {
+				debug = true;
+			}
+			else if (item == "profile") {
+				profile = true;
+			}
+			else if (!item.empty()) {
+				printf("Unknown target option %s\n", item.c_str());
+				return false;
+			}
+			start = end + 1;
+		}
+		return true;
+	}
+};
+
+// Helper functions to check whether each GPU runtime's library can be
+// loaded on this machine. Halide's runtimes load the same libraries
+// the first time they're used.
+inline bool have_opencl() {
+#ifdef _WIN32
+	static bool found = LoadLibraryA("OpenCL.dll") != NULL;
+#elif __APPLE__
+	static bool found = dlopen("/System/Library/Frameworks/OpenCL.framework/Versions/Current/OpenCL", RTLD_LAZY) != NULL;
+#else
+	static bool found = dlopen("libOpenCL.so", RTLD_LAZY) != NULL ||
+	                    dlopen("libOpenCL.so.1", RTLD_LAZY) != NULL;
+#endif
+	return found;
+}
+
+inline bool have_metal() {
+#ifdef __APPLE__
+	static bool found = dlopen("/System/Library/Frameworks/Metal.framework/Versions/Current/Metal", RTLD_LAZY) != NULL;
+	return found;
+#else
+	return false;
+#endif
+}
+
+inline bool have_cuda() {
+#ifdef _WIN32
+	static bool found = LoadLibraryA("nvcuda.dll") != NULL;
+#elif __APPLE__
+	static bool found = dlopen("/Library/Frameworks/CUDA.framework/CUDA", RTLD_LAZY) != NULL;
+#else
+	static bool found = dlopen("libcuda.so", RTLD_LAZY) != NULL ||
+	                    dlopen("libcuda.so.1", RTLD_LAZY) != NULL;
+#endif
+	return found;
+}
+
+// The API config asks for, narrowed down to one that's installed:
+// "cuda", "opencl", "metal" or "cpu".
+inline std::string resolve_gpu_api(const TargetConfig &config) {
+	if (config.api == "auto") {
+		if (have_cuda()) {
+			return "cuda";
+		}
+		if (have_metal()) {
+			return "metal";
+		}
+		if (have_opencl()) {
+			return "opencl";
+		}
+		return "cpu";
+	}
+	bool found = config.api == "cuda" ? have_cuda() :
+	             config.api == "opencl" ? have_opencl() :
+	             config.api == "metal" ? have_metal() : true;
+	if (!found) {
+		printf("Can't find the %s library, so using the CPU\n", config.api.c_str());
+		return "cpu";
+	}
+	return config.api;
+}
+
+// Pick the variant to run for config. There's only one CPU entry point
+// because halide_test_cpu is a multitarget library; it picks between
+// its AVX2, AVX, SSE4.1 and SSE2 builds itself, based on the same host
+// features get_host_target() reports. There are no Metal variants, so
+// Metal runs on OpenCL instead.
+inline AotVariant select_aot_variant(const TargetConfig &config = TargetConfig()) {
+	std::string api = resolve_gpu_api(config);
+	if (api == "metal" && have_opencl()) {
+		api = "opencl";
+	}
+	if (api == "cuda") {
+		return { "CUDA", halide_test_cuda, halide_test_batch_cuda, halide_test_interleaved_cuda, true, halide_cuda_device_interface,
+			{ { NULL, halide_test_gray_cuda, NULL, halide_test_cuda, halide_test_rgba_cuda },
+			  { NULL, halide_test_gray16_cuda, NULL, halide_test_rgb16_cuda, halide_test_rgba16_cuda } } };
+	}
+	if (api == "opencl") {
+		return { "OpenCL", halide_test_opencl, halide_test_batch_opencl, halide_test_interleaved_opencl, true, halide_opencl_device_interface,
+			{ { NULL, halide_test_gray_opencl, NULL, halide_test_opencl, halide_test_rgba_opencl },
+			  { NULL, halide_test_gray16_opencl, NULL, halide_test_rgb16_opencl, halide_test_rgba16_opencl } } };
+	}
+	return { "CPU", halide_test_cpu, halide_test_batch_cpu, halide_test_interleaved_cpu, false, NULL,
+		{ { NULL, halide_test_gray_cpu, NULL, halide_test_cpu, halide_test_rgba_cpu },
+		  { NULL, halide_test_gray16_cpu, NULL, halide_test_rgb16_cpu, halide_test_rgba16_cpu } } };
+}
+
+// The variant's single-image pipeline for buf's format: its number of
+// channels (a two-dimensional buffer is gray) and the size of its
+// values. NULL if there's no pipeline for that format.
+inline AotPipeline format_pipeline(const AotVariant &variant, const buffer_t *buf) {
+	int channels = buf->extent[2] ? buf->extent[2] : 1;
+	if (channels > 4 || (buf->elem_size != 1 && buf->elem_size != 2)) {
+		return NULL;
+	}
+	return variant.formats[buf->elem_size - 1][channels];
+}
+
+// Run one realization of a variant, and make sure the result is in
+// host memory. For GPU variants, buffers that don't have device memory
+// yet get it from the DevicePool, and give it back afterwards.
+inline int run_variant(const AotVariant &variant, AotPipeline pipeline,
+                       buffer_t *input, buffer_t *output) {
+	if (!variant.on_gpu) {
+		return pipeline(input, output);
+	}
+
+	// Buffers that come with their own device memory keep it; the
+	// rest borrow some from the pool for the call.
+	bool borrow_input = input->dev == 0, borrow_output = output->dev == 0;
+	DevicePool &pool = DevicePool::instance();
+	const halide_device_interface *device = variant.device_interface();
+	if (borrow_input && pool.acquire(input, device)) {
+		// Recycled device memory holds some earlier image.
+		input->host_dirty = true;
+	}
+	if (borrow_output) {
+		pool.acquire(output, device);
+	}
+
+	int result = pipeline(input, output);
+	if (result == 0) {
+		result = halide_copy_to_host(NULL, output);
+	}
+
+	if (borrow_input) {
+		pool.release(input);
+	}
+	if (borrow_output) {
+		pool.release(output);
+	}
+	return result;
+}
+
+// Single images go to the pipeline for their format; batches must be
+// 8-bit RGB.
+inline int run_variant(const AotVariant &variant, buffer_t *input, buffer_t *output,
+                       bool batch = false) {
+	AotPipeline pipeline = batch ? variant.batch_pipeline : format_pipeline(variant, input);
+	if (!pipeline) {
+		printf("The %s variant has no pipeline for %d-bit images with %d channels\n",
+			variant.name, 8 * input->elem_size, input->extent[2] ? input->extent[2] : 1);
+		return -1;
+	}
+	return run_variant(variant, pipeline, input, output);
+}
+
+// The part of buf from begin to begin + extent along dim, sharing its
+// memory, with coordinates that match the whole buffer's. It has no
+// device allocation of its own yet, so run_variant gives it one. This
+// is how a frame or batch is divided between devices: MyPipeline
+// clamps to the edges of the input buffer it's given, wherever it
+// starts, so a band of rows with a row of halo on each side comes out
+// as it would in the whole frame.
+inline buffer_t crop_buffer(const buffer_t &buf, int dim, int begin, int extent) {
+	buffer_t c = buf;
+	c.host += (size_t)begin * buf.stride[dim] * buf.elem_size;
+	c.min[dim] = buf.min[dim] + begin;
+	c.extent[dim] = extent;
+	c.dev = 0;
+	c.host_dirty = false;
+	c.dev_dirty = false;
+	return c;
+}
+
+#endif
@@ -0,0 +1,209 @@
+// Per-thread arenas for the scratch buffers Halide allocates.
+//
+// With the strip-parallel CPU schedule, every parallel task allocates
+// its own scratch for padded (and sharpen, when it isn't inlined) and
+// frees it at the end of the task, so a realization makes a couple of
+// heap allocations per strip, from every worker thread at once. Once
+// installed with install_arena(), halide_malloc and halide_free go
+// through here instead: each thread keeps its freed blocks in free
+// lists by power-of-two size class and hands them straight back out,
+// so after the first realization of a given size nothing reaches the
+// heap, and the hot path never takes a lock.
+//
+// A block freed on a different thread from the one that allocated it
+// goes back to its owner through a locked list, which the owner only
+// looks at when its own free list is empty. Halide frees a task's
+// scratch on the thread that ran the task, so that's rare.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "HalideRuntime.h"
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+struct ArenaStats {
+	// Calls to halide_malloc, how many of them were served from a free
+	// list, and how many went to the heap.
+	long long allocations = 0, reused = 0, heap_allocations = 0;
+	// Bytes obtained from the heap.
+	long long heap_bytes = 0;
+};
+
+class Arena {
+public:
+	// The calling thread's arena.
+	static Arena &local() {
+		static thread_local Arena *arena = create();
+		return *arena;
+	}
+
+	void *allocate(size_t size) {
+		int c = size_class(size);
+		allocations++;
+		Block *b = free_list[c];
+		if (!b && has_remote.load(std::memory_order_acquire)) {
+			take_remote();
+			b = free_list[c];
+		}
+		if (b) {
+			free_list[c] = b->next;
+			reused++;
+		}
+		else {
+			b = new_block(c);
+			if (!b) {
+				return NULL;
+			}
+		}
+		return b->data();
+	}
+
+	static void release(void *ptr) {
+		if (!ptr) {
+			return;
+		}
+		Block *b = Block::of(ptr);
+		Arena &self = local();
+		if (b->owner == &self) {
+			b->next = self.free_list[b->size_class];
+			self.free_list[b->size_class] = b;
+		}
+		else {
+			std::lock_guard<std::mutex> lock(b->owner->remote_mutex);
+			b->next = b->owner->remote;
+			b->owner->remote = b;
+			b->owner->has_remote.store(true, std::memory_order_release);
+		}
+	}
+
+	// Totals over every thread's arena.
+	static ArenaStats stats() {
+		ArenaStats s;
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		for (Arena *a : registry()) {
+			s.allocations += a->allocations;
+			s.reused += a->reused;
+			s.heap_allocations += a->heap_allocations;
+			s.heap_bytes += a->heap_bytes;
+		}
+		return s;
+	}
+
+private:
+	// Halide needs 32-byte aligned memory it can read a little past
+	// either end of. Blocks are 64-byte aligned, with a header before
+	// them and at least that much slack after.
+	static const size_t alignment = 64;
+	static const int num_classes = 48;
+
+	struct Block {
+		void *raw;
+		Arena *owner;
+		int size_class;
+		Block *next;
+
+		uint8_t *data() { return (uint8_t *)this + alignment; }
+		static Block *of(void *data) { return (Block *)((uint8_t *)data - alignment); }
+	};
+
+	Block *free_list[num_classes] = {};
+	std::mutex remote_mutex;
+	Block *remote = NULL;
+	std::atomic<bool> has_remote{ false };
+
+	// Only the owning thread writes these, so there's no contention;
+	// they're atomic so stats() can read them from another thread.
+	std::atomic<long long> allocations{ 0 }, reused{ 0 }, heap_allocations{ 0 }, heap_bytes{ 0 };
+
+	// Arenas are never destroyed: Halide's worker threads live as long
+	// as the process, and a block may outlive the thread that made it.
+	static Arena *create() {
+		Arena *a = new Arena;
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		registry().push_back(a);
+		return a;
+	}
+
+	static std::vector<Arena *> &registry() {
+		static std::vector<Arena *> arenas;
+		return arenas;
+	}
+
+	static std::mutex &registry_mutex() {
+		static std::mutex m;
+		return m;
+	}
+
+	static int size_class(size_t size) {
+		int c = 0;
+		while (((size_t)alignment << c) < size + 8) {
+			c++;
+		}
+		return c;
+	}
+
+	Block *new_block(int c) {
+		size_t bytes = (size_t)alignment << c;
+		size_t total = bytes + 3 * alignment;
+		void *raw = malloc(total);
+		if (!raw) {
+			return NULL;
+		}
+		heap_allocations++;
+		heap_bytes += total;
+		uintptr_t aligned = ((uintptr_t)raw + alignment - 1) / alignment * alignment;
+		Block *b = (Block *)aligned;
+		b->raw = raw;
+		b->owner = this;
+		b->size_class = c;
+		return b;
+	}
+
+	// Move blocks other threads have freed onto our own free lists.
+	void take_remote() {
+		Block *list;
+		{
+			std::lock_guard<std::mutex> lock(remote_mutex);
+			list = remote;
+			remote = NULL;
+			has_remote.store(false, std::memory_order_relaxed);
+		}
+		while (list) {
+			Block *next = list->next;
+			list->next = free_list[list->size_class];
+			free_list[list->size_class] = list;
+			list = next;
+		}
+	}
+};
+
+inline void *arena_malloc(void *, size_t size) {
+	return Arena::local().allocate(size);
+}
+
+inline void arena_free(void *, void *ptr) {
+	Arena::release(ptr);
+}
+
+// Route the AOT runtime's halide_malloc and halide_free through the
+// arenas. JIT-compiled pipelines take the same functions through
+// Func::set_custom_allocator.
+inline void install_arena() {
+	halide_set_custom_malloc(arena_malloc);
+	halide_set_custom_free(arena_free);
+}
+
+inline void print_arena_stats() {
+	ArenaStats s = Arena::stats();
+	printf("Arena: %lld allocations, %lld reused (%1.1f%%), %lld from the heap (%1.1f MB)\n",
+		s.allocations, s.reused, s.allocations ? 100.0 * s.reused / s.allocations : 0.0,
+		s.heap_allocations, s.heap_bytes / 1e6);
+}
+
+#endif
@@ -0,0 +1,226 @@
+// An autotuner for the schedules in my_pipeline.h.
+//
+// The search is a coordinate descent over the fields of CpuSchedule
+// or GpuSchedule: starting from the hand-picked defaults, each field
+// is tried with every value in its range while the others stay fixed,
+// keeping any value that beats the best time so far, until a full
+// pass makes no improvement. Each candidate is JIT-compiled and timed
+// with the benchmark harness.
+//
+// Winning schedules are kept in a ScheduleDatabase, keyed by the
+// target, the LutMode (which changes the algorithm, and whether the
+// CPU schedule vectorizes) and the size bucket of the image they were
+// tuned on, and saved as plain text so later runs can pick them up at
+// startup.
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "Halide.h"
+#include "bench.h"
+#include "my_pipeline.h"
+
+#include <functional>
+#include <limits>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Images are bucketed by the power of two nearest to their pixel
+// count, so e.g. 1920x1080 and 2048x1024 share a schedule.
+inline std::string size_bucket(int width, int height) {
+	int bucket = (int)floor(log((double)width * height) / log(2.0) + 0.5);
+	return "2^" + std::to_string(bucket);
+}
+
+class ScheduleDatabase {
+public:
+	// Read entries from filename. A missing file is treated as an
+	// empty database. Lines without a LutMode, from before it was part
+	// of the key, are skipped.
+	bool load(const std::string &filename) {
+		FILE *f = fopen(filename.c_str(), "r");
+		if (!f) {
+			return false;
+		}
+		char line[1024];
+		while (fgets(line, sizeof(line), f)) {
+			char kind[64], target[256], lut[64], bucket[64];
+			int consumed = 0;
+			LutMode lut_mode;
+			if (line[0] == '#' ||
+			    sscanf(line, "%63s %255s %63s %63s %n", kind, target, lut, bucket, &consumed) != 4 ||
+			    !parse_lut_mode(lut, &lut_mode)) {
+				continue;
+			}
+			std::string schedule = line + consumed;
+			while (!schedule.empty() && (schedule.back() == '\n' || schedule.back() == '\r')) {
+				schedule.pop_back();
+			}
+			entries[key(kind, target, lut_mode, bucket)] = schedule;
+		}
+		fclose(f);
+		return true;
+	}
+
+	bool save(const std::string &filename) const {
+		FILE *f = fopen(filename.c_str(), "w");
+		if (!f) {
+			return false;
+		}
+		fprintf(f, "# kind target lut_mode size_bucket schedule\n");
+		for (const auto &e : entries) {
+			fprintf(f, "%s %s\n", e.first.c_str(), e.second.c_str());
+		}
+		return fclose(f) == 0;
+	}
+
+	// kind is "cpu" or "gpu".
+	bool lookup(const std::string &kind, const Halide::Target &target, LutMode lut_mode,
+	            const std::string &bucket, std::string *schedule) const {
+		auto it = entries.find(key(kind, target.to_string(), lut_mode, bucket));
+		if (it == entries.end()) {
+			return false;
+		}
+		*schedule = it->second;
+		return true;
+	}
+
+	void store(const std::string &kind, const Halide::Target &target, LutMode lut_mode,
+	           const std::string &bucket, const std::string &schedule) {
+		entries[key(kind, target.to_string(), lut_mode, bucket)] = schedule;
+	}
+
+private:
+	std::map<std::string, std::string> entries;
+
+	static std::string key(const std::string &kind, const std::string &target, LutMode lut_mode,
+	                       const std::string &bucket) {
+		return kind + " " + target + " " + lut_mode_name(lut_mode) + " " + bucket;
+	}
+};
+
+// Try every value of one field of best, keeping the fastest. Returns
+// true if best changed.
+template<typename Schedule, typename T>
+bool tune_field(Schedule &best, double &best_ms, T Schedule::*field,
+                const std::vector<T> &values,
+                const std::function<double(const Schedule &)> &time) {
+	bool improved = false;
+	T start = best.*field;
+	for (T v : values) {
+		if (v == start) {
+			continue;
+		}
+		Schedule candidate = best;
+		candidate.*field = v;
+		double ms = time(candidate);
+		printf("  %s: %1.4f ms\n", candidate.to_string().c_str(), ms);
+		if (ms < best_ms) {
+			best = candidate;
+			best_ms = ms;
+			improved = true;
+		}
+	}
+	return improved;
+}
+
+// How the pipelines being tuned are built, so the tuner times the same
+// algorithm the tuned schedule will later run with: the LutMode, and
+// whether the gamma table is an input (see MyPipeline).
+struct TuneOptions {
+	LutMode lut_mode = GatherLut;
+	bool gamma_param = false;
+};
+
+// JIT-compile MyPipeline with the given schedule and return the
+// median time of one realization over input, in milliseconds.
+inline double time_schedule(Halide::Image<uint8_t> input, const Halide::Target &target,
+                            const TuneOptions &options,
+                            const std::function<void(MyPipeline &)> &schedule) {
+	using namespace Halide;
+
+	ImageParam param(UInt(8), 3, "input");
+	MyPipeline p(param, false, options.lut_mode, options.gamma_param);
+	schedule(p);
+	p.curved.compile_jit(target);
+	p.input.set(input);
+
+	Buffer output(UInt(8), input.width(), input.height(), input.channels());
+
+	// The tuner runs a lot of candidates, so take fewer, shorter
+	// samples than a regular benchmark.
+	BenchmarkConfig config;
+	config.samples = 7;
+	config.warmup_ms = 20;
+	config.min_sample_ms = 5;
+	BenchmarkResult result = run_benchmark("candidate", input.width() * input.height() / 1e6,
+		[&]() { p.curved.realize(output); },
+		[&]() { output.copy_to_host(); },
+		config);
+	return result.median_ms;
+}
+
+inline CpuSchedule autotune_cpu(Halide::Image<uint8_t> input, const Halide::Target &target,
+                                const TuneOptions &options = TuneOptions()) {
+	std::function<double(const CpuSchedule &)> time = [&](const CpuSchedule &s) {
+		return time_schedule(input, target, options, [&](MyPipeline &p) { p.schedule_for_cpu(s); });
+	};
+
+	CpuSchedule best;
+	double best_ms = time(best);
+	printf("  %s: %1.4f ms\n", best.to_string().c_str(), best_ms);
+
+	// The single-pass schedule changes several fields at once, which
+	// the search below wouldn't find one field at a time, so start
+	// from it if it's faster.
+	CpuSchedule sliding = CpuSchedule::sliding_window();
+	double sliding_ms = time(sliding);
+	printf("  %s: %1.4f ms\n", sliding.to_string().c_str(), sliding_ms);
+	if (sliding_ms < best_ms) {
+		best = sliding;
+		best_ms = sliding_ms;
+	}
+
+	bool improved = true;
+	while (improved) {
+		improved = false;
+		improved |= tune_field(best, best_ms, &CpuSchedule::strip_height, { 4, 8, 16, 32, 64 }, time);
+		improved |= tune_field(best, best_ms, &CpuSchedule::sharpen_vector_width, { 8, 16, 32 }, time);
+		improved |= tune_field(best, best_ms, &CpuSchedule::padded_vector_width, { 16, 32, 64 }, time);
+		improved |= tune_field(best, best_ms, &CpuSchedule::lut_at, { Inline, Root, Strip }, time);
+		improved |= tune_field(best, best_ms, &CpuSchedule::sharpen_at, { Scanline, Inline }, time);
+		improved |= tune_field(best, best_ms, &CpuSchedule::padded_at, { Strip, Scanline, Inline }, time);
+		improved |= tune_field(best, best_ms, &CpuSchedule::padded16_at, { Inline, Strip }, time);
+	}
+	return best;
+}
+
+inline GpuSchedule autotune_gpu(Halide::Image<uint8_t> input, const Halide::Target &target,
+                                const TuneOptions &options = TuneOptions()) {
+	std::function<double(const GpuSchedule &)> time = [&](const GpuSchedule &s) {
+		// Keep to a block size every OpenCL and CUDA device supports.
+		if (s.tile_x * s.tile_y > 256) {
+			return std::numeric_limits<double>::infinity();
+		}
+		return time_schedule(input, target, options, [&](MyPipeline &p) { p.schedule_for_gpu(s); });
+	};
+
+	GpuSchedule best;
+	double best_ms = time(best);
+	printf("  %s: %1.4f ms\n", best.to_string().c_str(), best_ms);
+
+	bool improved = true;
+	while (improved) {
+		improved = false;
+		improved |= tune_field(best, best_ms, &GpuSchedule::tile_x, { 8, 16, 32, 64 }, time);
+		improved |= tune_field(best, best_ms, &GpuSchedule::tile_y, { 4, 8, 16 }, time);
+		improved |= tune_field(best, best_ms, &GpuSchedule::lut_at, { Inline, Root }, time);
+		improved |= tune_field(best, best_ms, &GpuSchedule::padded_at, { Block, Inline }, time);
+	}
+	return best;
+}
+
+#endif
@@ -0,0 +1,217 @@
+// Batch mode: run many images through the ahead-of-time compiled
+// pipeline.
+//
+// MyPipeline's input is an ImageParam, so the compiled pipeline reads
+// the size of each image from the buffer it's given at run time, and
+// one compiled pipeline serves every image, whatever its size. Small
+// images pay a noticeable fixed cost per call though (the thread pool
+// wakes up, a GPU kernel is launched), so consecutive images of the
+// same size are stacked into a four dimensional buffer and processed
+// by halide_test_batch in one call. The lut isn't part of that cost:
+// it's the shared GammaLut table, computed once on the host.
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "Halide.h"
+#include "halide_image_io.h"
+#include "image_io.h"
+#include "aot_variants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+inline bool is_image_filename(const std::string &name) {
+	using Halide::Tools::Internal::ends_with_ignore_case;
+	return ends_with_ignore_case(name, ".png") ||
+	       ends_with_ignore_case(name, ".raw") ||
+	       ends_with_ignore_case(name, ".ppm") ||
+	       ends_with_ignore_case(name, ".pgm");
+}
+
+// The images to process. source is either a directory, whose images
+// are processed in name order, a text file listing one image per
+// line, or "-" to read that list from stdin.
+inline std::vector<std::string> list_images(const std::string &source) {
+	std::vector<std::string> files;
+	if (source == "-") {
+		std::string line;
+		while (std::getline(std::cin, line)) {
+			if (!line.empty()) {
+				files.push_back(line);
+			}
+		}
+		return files;
+	}
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA entry;
+	HANDLE find = FindFirstFileA((source + "\\*").c_str(), &entry);
+	if (find != INVALID_HANDLE_VALUE) {
+		do {
+			if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			    is_image_filename(entry.cFileName)) {
+				files.push_back(source + "\\" + entry.cFileName);
+			}
+		} while (FindNextFileA(find, &entry));
+		FindClose(find);
+		std::sort(files.begin(), files.end());
+		return files;
+	}
+#else
+	if (DIR *dir = opendir(source.c_str())) {
+		while (struct dirent *entry = readdir(dir)) {
+			if (is_image_filename(entry->d_name)) {
+				files.push_back(source + "/" + entry->d_name);
+			}
+		}
+		closedir(dir);
+		std::sort(files.begin(), files.end());
+		return files;
+	}
+#endif
+
+	FILE *f = fopen(source.c_str(), "r");
+	if (!f) {
+		printf("Could not open %s\n", source.c_str());
+		return files;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0]) {
+			files.push_back(line);
+		}
+	}
+	fclose(f);
+	return files;
+}
+
+// Where the result for filename goes: the same file name in out_dir.
+inline std::string output_path(const std::string &out_dir, const std::string &filename) {
+	size_t slash = filename.find_last_of("/\\");
+	std::string base = slash == std::string::npos ? filename : filename.substr(slash + 1);
+	return out_dir + "/" + base;
+}
+
+// A view of image n of a four dimensional batch, as a regular three
+// dimensional image. It shares the batch's memory.
+inline Halide::Image<uint8_t> batch_slice(const Halide::Image<uint8_t> &batch, int n) {
+	buffer_t slice = *batch.raw_buffer();
+	slice.host += n * slice.stride[3] * slice.elem_size;
+	slice.extent[3] = 0;
+	slice.stride[3] = 0;
+	slice.dev = 0;
+	return Halide::Image<uint8_t>(&slice);
+}
+
+// Run every image in source through the variant, batch_size images per
+// call where consecutive images share a size, and save the results to
+// out_dir. Images that can't be loaded, or aren't RGB, are skipped.
+// Each call goes through run if it's given, such as MultiGpu::run to
+// share the batch between devices, and run_variant if not.
+inline int process_batch(const AotVariant &variant, const std::string &source,
+                         int batch_size, const std::string &out_dir,
+                         std::function<int(buffer_t *, buffer_t *, bool)> run = nullptr) {
+	using Halide::Image;
+
+	std::vector<std::string> files = list_images(source);
+	printf("Processing %d images from %s, up to %d per batch, with the %s variant\n",
+		(int)files.size(), source.c_str(), batch_size, variant.name);
+
+	int processed = 0, failed = 0;
+	double total_megapixels = 0, compute_ms = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	// Images waiting to go into the next batch. They all have the size
+	// of the first one.
+	std::vector<std::string> pending_names;
+	std::vector<Image<uint8_t>> pending;
+
+	auto flush = [&]() {
+		if (pending.empty()) {
+			return;
+		}
+		int width = pending[0].width(), height = pending[0].height();
+		int count = (int)pending.size();
+
+		Image<uint8_t> input, output;
+		bool batch = count > 1;
+		if (batch) {
+			input = Image<uint8_t>(width, height, 3, count);
+			for (int n = 0; n < count; n++) {
+				memcpy(batch_slice(input, n).data(), pending[n].data(), width * height * 3);
+			}
+			output = Image<uint8_t>(width, height, 3, count);
+		}
+		else {
+			input = pending[0];
+			output = Image<uint8_t>(width, height, 3);
+		}
+
+		auto t0 = std::chrono::steady_clock::now();
+		int result = run ? run(input.raw_buffer(), output.raw_buffer(), batch) :
+		             run_variant(variant, input.raw_buffer(), output.raw_buffer(), batch);
+		compute_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		for (int n = 0; n < count; n++) {
+			if (result != 0) {
+				printf("%s: %s variant failed\n", pending_names[n].c_str(), variant.name);
+				failed++;
+				continue;
+			}
+			Image<uint8_t> im = batch ? batch_slice(output, n) : output;
+			std::string out = output_path(out_dir, pending_names[n]);
+			if (!save_rgb(im, out)) {
+				printf("Could not save %s\n", out.c_str());
+				failed++;
+				continue;
+			}
+			processed++;
+			total_megapixels += width * height / 1e6;
+		}
+		pending.clear();
+		pending_names.clear();
+	};
+
+	for (const std::string &file : files) {
+		Image<uint8_t> im;
+		if (!load_rgb(file, &im) || im.dimensions() != 3 || im.channels() != 3) {
+			printf("Skipping %s: not an RGB image\n", file.c_str());
+			failed++;
+			continue;
+		}
+		if (!pending.empty() &&
+		    (im.width() != pending[0].width() || im.height() != pending[0].height())) {
+			flush();
+		}
+		pending.push_back(im);
+		pending_names.push_back(file);
+		if ((int)pending.size() >= batch_size) {
+			flush();
+		}
+	}
+	flush();
+
+	double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Processed %d images (%1.1f megapixels) in %1.1f ms, %1.1f ms of it computing: "
+	       "%1.1f images/second, %d failed\n",
+	       processed, total_megapixels, total_ms, compute_ms,
+	       processed / (total_ms / 1000.0), failed);
+	if (variant.on_gpu) {
+		DevicePool::instance().print_stats();
+	}
+	return failed ? -1 : 0;
+}
+
+#endif
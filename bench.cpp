@@ -0,0 +1,146 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "benchmark.h"
+
+namespace {
+
+// Time one batch of n realizations followed by a sync, in seconds.
+double time_batch(int n, const std::function<void()> &op, const std::function<void()> &sync) {
+	return benchmark(1, 1, [&]() {
+		for (int i = 0; i < n; i++) {
+			op();
+		}
+		sync();
+	});
+}
+
+// Nearest-rank percentile of sorted values.
+double percentile(const std::vector<double> &sorted, double p) {
+	size_t rank = (size_t)ceil(p * sorted.size());
+	return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+}  // namespace
+
+BenchmarkResult run_benchmark(const std::string &name, double megapixels,
+                              std::function<void()> op,
+                              std::function<void()> sync,
+                              const BenchmarkConfig &config) {
+	// Warm up.
+	double warmup = 0;
+	do {
+		warmup += time_batch(1, op, sync);
+	} while (warmup * 1000 < config.warmup_ms);
+
+	// Calibrate the number of iterations per sample.
+	int iterations = 1;
+	while (time_batch(iterations, op, sync) * 1000 < config.min_sample_ms &&
+	       iterations < (1 << 20)) {
+		iterations *= 2;
+	}
+
+	std::vector<double> times;
+	for (int i = 0; i < config.samples; i++) {
+		times.push_back(time_batch(iterations, op, sync) * 1000 / iterations);
+	}
+	std::sort(times.begin(), times.end());
+
+	BenchmarkResult result;
+	result.name = name;
+	result.iterations = iterations;
+	result.samples = config.samples;
+	result.min_ms = times.front();
+	result.median_ms = percentile(times, 0.5);
+	result.p95_ms = percentile(times, 0.95);
+	result.p99_ms = percentile(times, 0.99);
+	double total = 0;
+	for (double t : times) {
+		total += t;
+	}
+	result.mean_ms = total / times.size();
+	result.megapixels = megapixels;
+	return result;
+}
+
+void print_benchmark(const BenchmarkResult &r) {
+	printf("%s: min %1.4f, median %1.4f, p95 %1.4f, p99 %1.4f milliseconds "
+	       "(%d x %d), %1.1f megapixels/second\n",
+	       r.name.c_str(), r.min_ms, r.median_ms, r.p95_ms, r.p99_ms,
+	       r.samples, r.iterations, r.megapixels_per_second());
+}
+
+bool write_benchmark_json(const std::vector<BenchmarkResult> &results, const std::string &filename) {
+	FILE *f = fopen(filename.c_str(), "w");
+	if (!f) {
+		return false;
+	}
+	fprintf(f, "{\n  \"benchmarks\": [");
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchmarkResult &r = results[i];
+		fprintf(f, "%s\n    {\"name\": \"%s\", \"samples\": %d, \"iterations\": %d, "
+		        "\"min_ms\": %g, \"median_ms\": %g, \"mean_ms\": %g, \"p95_ms\": %g, \"p99_ms\": %g, "
+		        "\"megapixels\": %g, \"megapixels_per_second\": %g}",
+		        i ? "," : "", r.name.c_str(), r.samples, r.iterations,
+		        r.min_ms, r.median_ms, r.mean_ms, r.p95_ms, r.p99_ms,
+		        r.megapixels, r.megapixels_per_second());
+	}
+	fprintf(f, "\n  ]\n}\n");
+	return fclose(f) == 0;
+}
+
+bool write_benchmark_csv(const std::vector<BenchmarkResult> &results, const std::string &filename) {
+	FILE *f = fopen(filename.c_str(), "w");
+	if (!f) {
+		return false;
+	}
+	fprintf(f, "name,samples,iterations,min_ms,median_ms,mean_ms,p95_ms,p99_ms,megapixels,megapixels_per_second\n");
+	for (const BenchmarkResult &r : results) {
+		fprintf(f, "%s,%d,%d,%g,%g,%g,%g,%g,%g,%g\n",
+		        r.name.c_str(), r.samples, r.iterations,
+		        r.min_ms, r.median_ms, r.mean_ms, r.p95_ms, r.p99_ms,
+		        r.megapixels, r.megapixels_per_second());
+	}
+	return fclose(f) == 0;
+}
+
+bool read_benchmark_csv(const std::string &filename, std::vector<BenchmarkResult> *results) {
+	FILE *f = fopen(filename.c_str(), "r");
+	if (!f) {
+		return false;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		BenchmarkResult r;
+		char name[512];
+		double throughput;
+		if (sscanf(line, "%511[^,],%d,%d,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+		           name, &r.samples, &r.iterations,
+		           &r.min_ms, &r.median_ms, &r.mean_ms, &r.p95_ms, &r.p99_ms,
+		           &r.megapixels, &throughput) == 10) {
+			r.name = name;
+			results->push_back(r);
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+int report_regressions(const std::vector<BenchmarkResult> &results,
+                       const std::vector<BenchmarkResult> &baseline, double threshold) {
+	int regressions = 0;
+	for (const BenchmarkResult &r : results) {
+		for (const BenchmarkResult &b : baseline) {
+			if (b.name == r.name && r.median_ms > b.median_ms * (1 + threshold)) {
+				printf("Regression: %s: median %1.4f milliseconds, %1.1f%% slower than the baseline's %1.4f\n",
+				       r.name.c_str(), r.median_ms, 100 * (r.median_ms / b.median_ms - 1), b.median_ms);
+				regressions++;
+			}
+		}
+	}
+	return regressions;
+}
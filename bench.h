@@ -0,0 +1,76 @@
+// A benchmarking harness for the pipelines in halide_test, built on
+// benchmark() from the Halide tools directory.
+//
+// Each measurement warms the pipeline up, calibrates how many
+// realizations to run per timed sample so that a sample is long
+// enough to time reliably, and then reports the distribution of the
+// per-realization time over all samples rather than a single number.
+//
+// The implementation lives in bench.cpp, because benchmark.h can't
+// be included in the same translation unit as windows.h.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+struct BenchmarkConfig {
+	// Number of timed samples to take.
+	int samples = 30;
+
+	// How long to keep running the pipeline before timing anything.
+	// The first run also initializes any GPU runtime state.
+	double warmup_ms = 100;
+
+	// Realizations per sample are doubled until one sample takes at
+	// least this long.
+	double min_sample_ms = 10;
+};
+
+struct BenchmarkResult {
+	std::string name;
+
+	// Realizations per sample, and the number of samples.
+	int iterations, samples;
+
+	// Statistics of the time for one realization, in milliseconds.
+	double min_ms, median_ms, mean_ms, p95_ms, p99_ms;
+
+	// Size of the image processed by one realization.
+	double megapixels;
+
+	// Throughput at the median time.
+	double megapixels_per_second() const {
+		return megapixels / (median_ms / 1000.0);
+	}
+};
+
+// Measure op, which runs the pipeline once. sync is called at the end
+// of every sample, before the clock is stopped, so GPU pipelines can
+// wait for queued work without paying for a copy every iteration.
+BenchmarkResult run_benchmark(const std::string &name, double megapixels,
+                              std::function<void()> op,
+                              std::function<void()> sync,
+                              const BenchmarkConfig &config = BenchmarkConfig());
+
+// Print a one-line summary of a result.
+void print_benchmark(const BenchmarkResult &result);
+
+// Write results in machine-readable form, so runs from different
+// builds can be compared. Return false if the file can't be written.
+bool write_benchmark_json(const std::vector<BenchmarkResult> &results, const std::string &filename);
+bool write_benchmark_csv(const std::vector<BenchmarkResult> &results, const std::string &filename);
+
+// Read results back from a file write_benchmark_csv wrote. Return
+// false if the file can't be read.
+bool read_benchmark_csv(const std::string &filename, std::vector<BenchmarkResult> *results);
+
+// Print every result whose median time is more than threshold (a
+// fraction) slower than the baseline result with the same name, and
+// return how many there are. Results with no baseline are skipped.
+int report_regressions(const std::vector<BenchmarkResult> &results,
+                       const std::vector<BenchmarkResult> &baseline, double threshold);
+
+#endif
@@ -0,0 +1,143 @@
+// Co-execution: one frame split between the CPU and the GPU.
+//
+// Run on a GPU variant, the CPU sits idle while the GPU works. A
+// CoExecutor instead gives the GPU variant the top rows of each frame
+// and the CPU variant the rest, and runs both at once. Each side sees
+// its own crop of the caller's output buffer, a buffer_t pointing into
+// the same memory, so both halves land in the one output with no
+// copies: the CPU writes its rows directly, and the GPU's are copied
+// back from the device straight into place. The GPU is only given its
+// rows of the input, and the row below them for sharpen, so the
+// upload is no bigger than it needs to be. (See crop_buffer.)
+//
+// The split adapts. After each frame the rows per millisecond each side
+// managed, including the GPU's transfers, gives the share that would
+// have made them finish together, and the share moves towards it.
+// Frames of a batch are split the same way, by image instead of by row.
+
+#ifndef COEXEC_H
+#define COEXEC_H
+
+#include "aot_variants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+struct CoExecConfig {
+	// The GPU's share of the first frame.
+	double initial_gpu_share = 0.5;
+
+	// How far the share moves towards the measured balance after each
+	// frame: 1 jumps straight there, smaller values smooth out noise.
+	double smoothing = 0.5;
+
+	// Splits are made on multiples of this many rows, to keep whole
+	// CPU strips and GPU tiles on one side. Each side always gets at
+	// least this much, so both keep being measured.
+	int granularity = 16;
+};
+
+class CoExecutor {
+public:
+	CoExecutor(const AotVariant &cpu, const AotVariant &gpu,
+	           const CoExecConfig &config = CoExecConfig()) :
+		cpu(cpu), gpu(gpu), config(config), share(config.initial_gpu_share) {}
+
+	// Process input into output, as run_variant does. With batch, both
+	// are four-dimensional batches, split by image.
+	int run(buffer_t *input, buffer_t *output, bool batch = false) {
+		int dim = batch ? 3 : 1;
+		int total = output->extent[dim];
+		int unit = batch ? 1 : config.granularity;
+		AotPipeline gpu_pipeline = pipeline_for(gpu, input, batch);
+		AotPipeline cpu_pipeline = pipeline_for(cpu, input, batch);
+		if (!gpu_pipeline || !cpu_pipeline) {
+			return -1;
+		}
+
+		// Rows [0, split) go to the GPU and [split, total) to the CPU.
+		int split;
+		if (total < 2 * unit) {
+			split = share >= 0.5 ? total : 0;
+		}
+		else {
+			split = (int)(total * share / unit + 0.5) * unit;
+			split = std::min(std::max(split, unit), total - unit);
+		}
+
+		buffer_t gpu_in, gpu_out = crop_buffer(*output, dim, 0, split);
+		buffer_t cpu_out = crop_buffer(*output, dim, split, total - split);
+		if (batch) {
+			gpu_in = crop_buffer(*input, dim, 0, split);
+		}
+		else {
+			// The GPU's rows, and the one below for sharpen.
+			gpu_in = crop_buffer(*input, dim, 0, std::min(split + 1, input->extent[1]));
+		}
+		gpu_in.host_dirty = true;
+
+		int gpu_result = 0, cpu_result = 0;
+		double gpu_ms = 0, cpu_ms = 0;
+		std::thread gpu_thread;
+		if (split > 0) {
+			gpu_thread = std::thread([&]() {
+				auto t0 = std::chrono::steady_clock::now();
+				gpu_result = run_variant(gpu, gpu_pipeline, &gpu_in, &gpu_out);
+				gpu_ms = elapsed_ms(t0);
+			});
+		}
+		if (split < total) {
+			auto t0 = std::chrono::steady_clock::now();
+			cpu_result = run_variant(cpu, cpu_pipeline, input, &cpu_out);
+			cpu_ms = elapsed_ms(t0);
+		}
+		if (gpu_thread.joinable()) {
+			gpu_thread.join();
+		}
+		if (gpu_result != 0 || cpu_result != 0) {
+			return gpu_result != 0 ? gpu_result : cpu_result;
+		}
+
+		// Rows per millisecond on each side, and the share that would
+		// have balanced them.
+		if (split > 0 && split < total && gpu_ms > 0 && cpu_ms > 0) {
+			double gpu_rate = split / gpu_ms, cpu_rate = (total - split) / cpu_ms;
+			double balanced = gpu_rate / (gpu_rate + cpu_rate);
+			share += config.smoothing * (balanced - share);
+		}
+		frames++;
+		total_gpu_ms += gpu_ms;
+		total_cpu_ms += cpu_ms;
+		return 0;
+	}
+
+	// The fraction of each frame the GPU will get next.
+	double gpu_share() const { return share; }
+
+	void print_stats() const {
+		printf("Co-execution on %s and %s: the GPU's share is now %1.1f%%; "
+		       "averaging %1.3f ms on the GPU and %1.3f ms on the CPU over %lld frames\n",
+		       gpu.name, cpu.name, 100 * share,
+		       frames ? total_gpu_ms / frames : 0.0, frames ? total_cpu_ms / frames : 0.0, frames);
+	}
+
+private:
+	AotVariant cpu, gpu;
+	CoExecConfig config;
+	double share;
+	long long frames = 0;
+	double total_gpu_ms = 0, total_cpu_ms = 0;
+
+	// The batch pipeline, or the one for input's format.
+	static AotPipeline pipeline_for(const AotVariant &variant, const buffer_t *input, bool batch) {
+		return batch ? variant.batch_pipeline : format_pipeline(variant, input);
+	}
+
+	static double elapsed_ms(std::chrono::steady_clock::time_point t0) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	}
+};
+
+#endif
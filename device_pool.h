@@ -0,0 +1,226 @@
+// A pool of GPU allocations, recycled from one realization to the
+// next.
+//
+// Left to itself, the runtime allocates device memory for the input
+// and output of every call with a fresh buffer, and frees it again
+// when the buffer is freed, so every request pays for a device malloc
+// and free of the whole image. Instead, run_variant() takes device
+// memory from this pool before calling the pipeline and gives it back
+// afterwards. Allocations are kept in size classes, a quarter of a
+// power of two apart, so images of similar sizes share them.
+//
+// Allocations are moved between buffers with the wrap and detach
+// functions in HalideRuntimeOpenCL.h and HalideRuntimeCuda.h, which
+// attach existing device memory to a buffer_t without copying it.
+//
+// With several GPUs (see multi_gpu.h), allocations are also kept apart
+// by the device they're on, which is the calling thread's thread_gpu().
+
+#ifndef DEVICE_POOL_H
+#define DEVICE_POOL_H
+
+#include "HalideRuntime.h"
+#include "HalideRuntimeCuda.h"
+#include "HalideRuntimeOpenCL.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+
+// The GPU the calling thread's pipelines run on, or -1 for the
+// runtime's default: HL_GPU_DEVICE, or else the last device. Only
+// multi_gpu.h's context hooks look at it; set it with ScopedGpu.
+inline int &thread_gpu() {
+	static thread_local int gpu = -1;
+	return gpu;
+}
+
+// Run this thread on gpu until the end of the scope.
+struct ScopedGpu {
+	int previous;
+	explicit ScopedGpu(int gpu) : previous(thread_gpu()) { thread_gpu() = gpu; }
+	~ScopedGpu() { thread_gpu() = previous; }
+};
+
+class DevicePool {
+public:
+	static DevicePool &instance() {
+		static DevicePool pool;
+		return pool;
+	}
+
+	// Give buf device memory on device, from the pool if there's a
+	// free allocation of the right size class. Does nothing if buf
+	// already has device memory. Returns true if it gave buf some, in
+	// which case the caller should release() it when done.
+	bool acquire(buffer_t *buf, const halide_device_interface *device) {
+		if (buf->dev || !is_pooled(device)) {
+			return false;
+		}
+		size_t bytes = size_class(buffer_bytes(buf));
+		Key key = { device, thread_gpu(), bytes };
+
+		std::lock_guard<std::mutex> lock(mutex);
+		requests++;
+		uintptr_t handle = 0;
+		auto it = free_list.find(key);
+		if (it != free_list.end()) {
+			handle = it->second;
+			free_list.erase(it);
+			pooled_bytes -= bytes;
+			hits++;
+		}
+		else {
+			handle = allocate(device, bytes);
+			if (!handle) {
+				return false;
+			}
+		}
+		attach(buf, device, handle);
+		outstanding[buf->dev] = key;
+		return true;
+	}
+
+	// Take buf's device memory back into the pool, leaving buf with
+	// none. Device memory that didn't come from the pool is freed.
+	// Also frees what the pool holds beyond max_pooled_bytes.
+	void release(buffer_t *buf) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = outstanding.find(buf->dev);
+		if (it == outstanding.end()) {
+			halide_device_free(NULL, buf);
+			return;
+		}
+		Key key = it->second;
+		outstanding.erase(it);
+		uintptr_t handle = detach(buf, key.device);
+		free_list.insert(std::make_pair(key, handle));
+		pooled_bytes += key.bytes;
+		peak_pooled_bytes = std::max(peak_pooled_bytes, pooled_bytes);
+		while (pooled_bytes > max_pooled_bytes && !free_list.empty()) {
+			// Free the largest allocations first, on whichever device
+			// and GPU they are. The free list is ordered by device
+			// first, so its last entry isn't necessarily the largest,
+			// but it's short enough to search.
+			auto largest = std::max_element(free_list.begin(), free_list.end(),
+				[](const std::pair<const Key, uintptr_t> &a, const std::pair<const Key, uintptr_t> &b) {
+					return a.first.bytes < b.first.bytes;
+				});
+			free_allocation(largest->first, largest->second);
+			pooled_bytes -= largest->first.bytes;
+			free_list.erase(largest);
+		}
+	}
+
+	// Free everything in the pool. Allocations that are still in use
+	// are freed when they're released.
+	void trim() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &e : free_list) {
+			free_allocation(e.first, e.second);
+		}
+		free_list.clear();
+		pooled_bytes = 0;
+	}
+
+	void print_stats() {
+		std::lock_guard<std::mutex> lock(mutex);
+		printf("Device pool: %d requests, %d hits (%1.1f%%), %1.1f MB pooled at peak\n",
+			requests, hits, requests ? 100.0 * hits / requests : 0.0,
+			peak_pooled_bytes / 1e6);
+	}
+
+	// How much free device memory the pool may hold on to.
+	size_t max_pooled_bytes = 256 << 20;
+
+private:
+	struct Key {
+		const halide_device_interface *device;
+		int gpu;
+		size_t bytes;
+
+		bool operator<(const Key &other) const {
+			if (device != other.device) {
+				return device < other.device;
+			}
+			if (gpu != other.gpu) {
+				return gpu < other.gpu;
+			}
+			return bytes < other.bytes;
+		}
+	};
+
+	std::mutex mutex;
+	std::multimap<Key, uintptr_t> free_list;
+	std::map<uint64_t, Key> outstanding;
+	size_t pooled_bytes = 0, peak_pooled_bytes = 0;
+	int requests = 0, hits = 0;
+
+	static bool is_pooled(const halide_device_interface *device) {
+		return device == halide_opencl_device_interface() ||
+		       device == halide_cuda_device_interface();
+	}
+
+	static size_t buffer_bytes(const buffer_t *buf) {
+		size_t bytes = 1;
+		for (int i = 0; i < 4 && buf->extent[i]; i++) {
+			bytes += (size_t)(buf->extent[i] - 1) * buf->stride[i];
+		}
+		return bytes * buf->elem_size;
+	}
+
+	// Round up to 4, 5, 6 or 7 times a power of two.
+	static size_t size_class(size_t bytes) {
+		size_t step = 1;
+		while (step * 8 <= bytes) {
+			step *= 2;
+		}
+		return (bytes + step - 1) / step * step;
+	}
+
+	static void attach(buffer_t *buf, const halide_device_interface *device, uintptr_t handle) {
+		if (device == halide_opencl_device_interface()) {
+			halide_opencl_wrap_cl_mem(NULL, buf, handle);
+		}
+		else {
+			halide_cuda_wrap_device_ptr(NULL, buf, handle);
+		}
+	}
+
+	static uintptr_t detach(buffer_t *buf, const halide_device_interface *device) {
+		if (device == halide_opencl_device_interface()) {
+			return halide_opencl_detach_cl_mem(NULL, buf);
+		}
+		return halide_cuda_detach_device_ptr(NULL, buf);
+	}
+
+	// Allocate and free through the runtime, using a one-dimensional
+	// buffer of the size class to hold the allocation meanwhile.
+	static buffer_t bytes_buffer(size_t bytes) {
+		buffer_t buf = {};
+		buf.extent[0] = (int32_t)bytes;
+		buf.stride[0] = 1;
+		buf.elem_size = 1;
+		return buf;
+	}
+
+	static uintptr_t allocate(const halide_device_interface *device, size_t bytes) {
+		buffer_t buf = bytes_buffer(bytes);
+		if (halide_device_malloc(NULL, &buf, device) != 0) {
+			return 0;
+		}
+		return detach(&buf, device);
+	}
+
+	// Freeing has to happen on the GPU the allocation is on.
+	static void free_allocation(const Key &key, uintptr_t handle) {
+		ScopedGpu gpu(key.gpu);
+		buffer_t buf = bytes_buffer(key.bytes);
+		attach(&buf, key.device, handle);
+		halide_device_free(NULL, &buf);
+	}
+};
+
+#endif
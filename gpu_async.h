@@ -0,0 +1,156 @@
+// Asynchronous GPU mode: keep several images in flight on the GPU.
+//
+// The plain GPU path runs each image strictly in order: upload it,
+// run the kernels, wait for them, download the result, and only then
+// start on the next image. Here a ring of buffer slots, depth of them
+// (at least two), is shared by two threads:
+//
+//   submit:  decode image N+1, copy it to the device, launch the kernels
+//   drain:   wait for image N, copy it back to the host, encode it
+//
+// Kernel launches return as soon as the work is queued, so the submit
+// thread can run ahead by up to depth images while earlier ones are
+// still computing or downloading. Each slot keeps its device
+// allocations from one image to the next as long as the size doesn't
+// change, so a steady stream of same-sized images doesn't allocate.
+//
+// The Halide runtime uses one command queue (or CUDA stream) per
+// context, so how far uploads actually overlap kernels is up to the
+// driver; decode, encode and the host side of every transfer overlap
+// the GPU regardless.
+
+#ifndef GPU_ASYNC_H
+#define GPU_ASYNC_H
+
+#include "pipelined.h"
+
+// One image's worth of buffers, reused for image after image.
+struct GpuSlot {
+	std::string filename;
+	Halide::Image<uint8_t> input, output;
+	bool on_device = false;
+};
+
+// Device memory for slots comes from the DevicePool, so a slot that
+// changes size usually picks up an allocation another one gave back.
+inline void acquire_slot(GpuSlot &slot, const halide_device_interface *device) {
+	DevicePool &pool = DevicePool::instance();
+	pool.acquire(slot.input.raw_buffer(), device);
+	pool.acquire(slot.output.raw_buffer(), device);
+	slot.on_device = true;
+}
+
+inline void release_slot(GpuSlot &slot) {
+	if (slot.on_device) {
+		DevicePool &pool = DevicePool::instance();
+		pool.release(slot.input.raw_buffer());
+		pool.release(slot.output.raw_buffer());
+		slot.on_device = false;
+	}
+}
+
+// Run every image in source through the GPU variant with up to depth
+// images in flight, saving the results to out_dir.
+inline int process_gpu_async(const AotVariant &variant, const std::string &source,
+                             const std::string &out_dir, int depth) {
+	using Halide::Image;
+
+	if (!variant.on_gpu) {
+		printf("No GPU found, so there's nothing to run asynchronously\n");
+		return process_pipelined(variant, source, out_dir);
+	}
+	depth = std::max(depth, 2);
+	const halide_device_interface *device = variant.device_interface();
+
+	std::vector<std::string> files = list_images(source);
+	printf("Processing %d images from %s with up to %d in flight on the %s variant\n",
+		(int)files.size(), source.c_str(), depth, variant.name);
+
+	std::vector<GpuSlot> slots(depth);
+	BoundedQueue<int> free_slots(depth), in_flight(depth);
+	for (int i = 0; i < depth; i++) {
+		free_slots.push(i);
+	}
+	std::atomic<int> processed(0), failed(0);
+	std::atomic<long long> total_pixels(0);
+	auto start = std::chrono::steady_clock::now();
+
+	std::thread drain([&]() {
+		int i = 0;
+		while (in_flight.pop(&i)) {
+			GpuSlot &slot = slots[i];
+			std::string out = output_path(out_dir, slot.filename);
+			if (halide_copy_to_host(NULL, slot.output.raw_buffer()) != 0) {
+				printf("%s: %s variant failed\n", slot.filename.c_str(), variant.name);
+				failed++;
+			}
+			else if (!save_rgb(slot.output, out)) {
+				printf("Could not save %s\n", out.c_str());
+				failed++;
+			}
+			else {
+				processed++;
+				total_pixels += (long long)slot.output.width() * slot.output.height();
+			}
+			free_slots.push(i);
+		}
+	});
+
+	for (const std::string &file : files) {
+		Image<uint8_t> im;
+		if (!load_rgb(file, &im) || im.dimensions() != 3 || im.channels() != 3) {
+			printf("Skipping %s: not an RGB image\n", file.c_str());
+			failed++;
+			continue;
+		}
+
+		// Nothing closes free_slots, but if it ever is, there's no slot
+		// left to run the rest in.
+		int i = 0;
+		if (!free_slots.pop(&i)) {
+			break;
+		}
+		GpuSlot &slot = slots[i];
+		slot.filename = file;
+		if (slot.on_device &&
+		    slot.input.width() == im.width() && slot.input.height() == im.height()) {
+			// Reuse the slot's device allocations. Only its host side
+			// changes, and the upload below sends it over.
+			memcpy(slot.input.data(), im.data(), im.width() * im.height() * 3);
+			slot.input.set_host_dirty();
+		}
+		else {
+			release_slot(slot);
+			slot.input = im;
+			slot.output = Image<uint8_t>(im.width(), im.height(), 3);
+			acquire_slot(slot, device);
+			slot.input.set_host_dirty();
+		}
+
+		// Upload first, so the copy is queued ahead of this image's
+		// kernels rather than done inside them.
+		if (halide_copy_to_device(NULL, slot.input.raw_buffer(), device) != 0 ||
+		    variant.pipeline(slot.input.raw_buffer(), slot.output.raw_buffer()) != 0) {
+			printf("%s: %s variant failed\n", file.c_str(), variant.name);
+			failed++;
+			free_slots.push(i);
+			continue;
+		}
+		in_flight.push(i);
+	}
+	in_flight.close();
+	drain.join();
+
+	for (GpuSlot &slot : slots) {
+		release_slot(slot);
+	}
+	DevicePool::instance().print_stats();
+
+	double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Processed %d images (%1.1f megapixels) in %1.1f ms: %1.1f images/second, %d failed\n",
+		(int)processed, total_pixels / 1e6, total_ms,
+		processed / (total_ms / 1000.0), (int)failed);
+	return failed ? -1 : 0;
+}
+
+#endif
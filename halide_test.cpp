@@ -18,295 +18,1574 @@
 
 #include "Halide.h"
 #include <stdio.h>
+#include <string.h>
 using namespace Halide;
 
+// The resident service mode. It's included first because on Windows
+// its winsock2.h has to come before anything includes windows.h.
+#include "service.h"
+
 // Include some support code for loading pngs.
 #include "halide_image_io.h"
 using namespace Halide::Tools;
 
-// Include a clock to do performance testing.
-#include "clock.h"
+// And a faster loader for the RGB pngs we feed MyPipeline.
+#include "image_io.h"
 
-// Define some Vars to use.
-Var x, y, c, i;
+// Include a benchmarking harness to do performance testing.
+#include "bench.h"
 
-// We're going to want to schedule a pipeline in several ways, so we
-// define the pipeline in a class so that we can recreate it several
-// times with different schedules.
-class MyPipeline {
-public:
-	Func lut, padded, padded16, sharpen, curved;
-	Image<uint8_t> input;
+// And a place to keep compiled pipelines between runs.
+#include "jit_cache.h"
+
+// And a way to search for better schedules, and remember them.
+#include "autotune.h"
+
+// And per-thread arenas for Halide's scratch allocations.
+#include "arena.h"
+
+// And a work-stealing thread pool to run the parallel loops on.
+#include "thread_pool.h"
+
+// And a fast way to compare outputs.
+#include "verify.h"
+
+// And a stage-by-stage profiler.
+#include "profiler.h"
+
+// And a suite of benchmarks across sizes, threads and targets.
+#include "scaling.h"
+
+// The pipeline itself lives in my_pipeline.h so that the generator
+// can share it.
+#include "my_pipeline.h"
+
+// The ahead-of-time compiled variants of MyPipeline.
+#include "aot_variants.h"
+
+// And drivers for processing many images with them.
+#include "batch.h"
+#include "pipelined.h"
+#include "gpu_async.h"
+#include "streaming.h"
+#include "coexec.h"
+#include "multi_gpu.h"
+#include "incremental.h"
+#include "sequence.h"
+
+// The GPU API and runtime features to use, from --target or
+// HALIDE_TEST_TARGET.
+TargetConfig target_config;
+
+// How the ahead-of-time variants apply the gamma curve, as the build
+// chose it (LUT_MODE in the Makefile, HALIDE_TEST_LUT_MODE in CMake),
+// and how the JIT-compiled pipelines do. --lut picks the latter.
+#ifndef HALIDE_TEST_LUT_MODE
+#define HALIDE_TEST_LUT_MODE "gather"
+#endif
+LutMode aot_lut_mode = GatherLut;
+LutMode jit_lut_mode = GatherLut;
+
+// The exponent of the gamma curve the ahead-of-time variants were
+// built with (GAMMA in the Makefile, HALIDE_TEST_GAMMA in CMake). The
+// JIT-compiled pipelines start with the same one; --gamma changes it.
+#ifndef HALIDE_TEST_GAMMA
+#define HALIDE_TEST_GAMMA 1.2
+#endif
+
+// Whether the JIT-compiled CPU pipeline uses the single-pass
+// sliding-window schedule, unless a tuned one is found.
+bool jit_sliding_window = false;
+
+// Whether halide_malloc and halide_free go through arena.h. Turned
+// off with --no-arena.
+bool use_arena = true;
+
+// Whether parallel loops run on thread_pool.h's pool rather than
+// Halide's own. Turned on with --work-stealing.
+bool use_thread_pool = false;
+
+// Turn on the runtime features target_config asks for.
+Target with_runtime_features(Target target) {
+	// If you want to see all of the OpenCL, Metal, or CUDA API
+	// calls done by the pipeline, you can also enable the Debug
+	// flag. This is helpful for figuring out which stages are
+	// slow, or when CPU -> GPU copies happen. It hurts
+	// performance though, so it's only on when asked for.
+	if (target_config.debug) {
+		target.set_feature(Target::Debug);
+	}
+	if (target_config.profile) {
+		target.set_feature(Target::Profile);
+	}
+	return target;
+}
+
+// Pick a CPU target suitable for JIT-compiling MyPipeline after
+// schedule_for_cpu().
+Target find_cpu_target() {
+	return with_runtime_features(get_host_target());
+}
+
+// Pick a GPU target suitable for JIT-compiling MyPipeline after
+// schedule_for_gpu(), or return false if there's no GPU to use.
+bool find_gpu_target(Target *target) {
+	// CUDA, OpenCL, or Metal are not enabled by default. We have to
+	// construct a Target object, enable one of them, and then pass
+	// that target object to compile_jit. Otherwise your CPU will very
+	// slowly pretend it's a GPU, and use one thread per output
+	// pixel.
+
+	// Start with a target suitable for the machine you're running
+	// this on.
+	*target = get_host_target();
+
+	// Then enable whichever API was asked for, or the first one
+	// that's installed. OS X doesn't update its OpenCL drivers, so
+	// they tend to be broken, and Metal is preferred there.
+	std::string api = resolve_gpu_api(target_config);
+	if (api == "cuda") {
+		target->set_feature(Target::CUDA);
+	}
+	else if (api == "metal") {
+		target->set_feature(Target::Metal);
+	}
+	else if (api == "opencl") {
+		target->set_feature(Target::OpenCL);
+	}
+	else {
+		return false;
+	}
+
+	*target = with_runtime_features(*target);
+	return true;
+}
+
+// Results of every test_performance call, for --bench-json and
+// --bench-csv.
+std::vector<BenchmarkResult> benchmark_results;
+
+double megapixels(Image<uint8_t> im) {
+	return im.width() * im.height() / 1e6;
+}
+
+// Returns the output of the last realization, on the host, for
+// test_correctness.
+Buffer test_performance(const char *name, MyPipeline &p, Image<uint8_t> input) {
+	// Test the performance of the scheduled MyPipeline.
+	p.input.set(input);
+
+	// If we realize curved into a Halide::Image, that will
+	// unfairly penalize GPU performance by including a GPU->CPU
+	// copy in every run. Halide::Image objects always exist on
+	// the CPU.
+
+	// Halide::Buffer, however, represents a buffer that may
+	// exist on either CPU or GPU or both.
+	Buffer output(UInt(8), input.width(), input.height(), input.channels());
+
+	// Force any GPU code to finish at the end of each sample by
+	// copying the buffer back to the CPU.
+	BenchmarkResult result = run_benchmark(name, megapixels(input),
+		[&]() { p.curved.realize(output); },
+		[&]() { output.copy_to_host(); });
+	print_benchmark(result);
+	benchmark_results.push_back(result);
+	return output;
+}
+
+// The same measurement for an ahead-of-time compiled variant. There
+// is no Halide::Buffer here, so the GPU variants are synchronized
+// and cleaned up through the runtime linked in from the static
+// libraries.
+void test_performance(const char *name, AotPipeline pipeline, bool on_gpu,
+                      buffer_t *in, buffer_t *out) {
+	double megapixels = in->extent[0] * in->extent[1] / 1e6;
+	BenchmarkResult result = run_benchmark(name, megapixels,
+		[&]() { pipeline(in, out); },
+		[&]() {
+			if (on_gpu) {
+				halide_copy_to_host(NULL, out);
+			}
+		});
+
+	if (on_gpu) {
+		// Release the device allocations while the runtime that made
+		// them is still the one that owns them.
+		halide_device_free(NULL, in);
+		halide_device_free(NULL, out);
+	}
+
+	print_benchmark(result);
+	benchmark_results.push_back(result);
+}
+
+// Comparisons that failed, so main can report them in its exit code.
+int correctness_failures = 0;
+
+// Check output against the reference output, allowing each value to be
+// off by tolerance (see lut_tolerance). Either may be planar or
+// interleaved. A mismatch is reported, with how many values differ and
+// where, rather than stopping the run.
+bool test_correctness(const char *name, const buffer_t *output, const buffer_t *reference_output, int tolerance = 0) {
+	VerifyConfig config;
+	config.tolerance = tolerance;
+	VerifyResult result = compare_buffers(output, reference_output, config);
+	if (!result.ok()) {
+		print_verify_result(name, result, tolerance);
+		correctness_failures++;
+	}
+	return result.ok();
+}
+
+// Benchmark MyPipeline by JIT-compiling it on the spot. This is what
+// the tutorial does; it's useful when experimenting with schedules,
+// but every run pays for LLVM code generation, unless a JitCache is
+// given, in which case only the first run with a given pipeline,
+// schedule and target does. Schedules found by --autotune for this
+// target and image size are used in place of the defaults.
+int test_jit(Image<uint8_t> input, JitCache *cache, const ScheduleDatabase &schedules) {
+	// Allocated an image that will store the correct output
+	Image<uint8_t> reference_output(input.width(), input.height(), input.channels());
+
+	ImageParam input_param(UInt(8), 3, "input");
+	std::vector<Argument> args = { input_param };
+	std::string bucket = size_bucket(input.width(), input.height());
+	std::string tuned;
 
-	MyPipeline(Image<uint8_t> in) : input(in) {
-		// For this lesson, we'll use a two-stage pipeline that sharpens
-		// and then applies a look-up-table (LUT).
-
-		// First we'll define the LUT. It will be a gamma curve.
-
-		lut(i) = cast<uint8_t>(clamp(pow(i / 255.0f, 1.2f) * 255.0f, 0, 255));
-
-		// Augment the input with a boundary condition.
-		padded(x, y, c) = input(clamp(x, 0, input.width() - 1),
-			clamp(y, 0, input.height() - 1), c);
-
-		// Cast it to 16-bit to do the math.
-		padded16(x, y, c) = cast<uint16_t>(padded(x, y, c));
-
-		// Next we sharpen it with a five-tap filter.
-		sharpen(x, y, c) = (padded16(x, y, c) * 2 -
-			(padded16(x - 1, y, c) +
-				padded16(x, y - 1, c) +
-				padded16(x + 1, y, c) +
-				padded16(x, y + 1, c)) / 4);
-
-		// Then apply the LUT.
-		curved(x, y, c) = lut(sharpen(x, y, c));
-	}
-
-	// Now we define methods that give our pipeline several different
-	// schedules.
-	void schedule_for_cpu() {
-		// Compute the look-up-table ahead of time.
-		lut.compute_root();
-
-		// Compute color channels innermost. Promise that there will
-		// be three of them and unroll across them.
-		curved.reorder(c, x, y)
-			.bound(c, 0, 3)
-			.unroll(c);
-
-		// Look-up-tables don't vectorize well, so just parallelize
-		// curved in slices of 16 scanlines.
-		Var yo, yi;
-		curved.split(y, yo, yi, 16)
-			.parallel(yo);
-
-		// Compute sharpen as needed per scanline of curved.
-		sharpen.compute_at(curved, yi);
-
-		// Vectorize the sharpen. It's 16-bit so we'll vectorize it 8-wide.
-		sharpen.vectorize(x, 8);
-
-		// Compute the padded input as needed per scanline of curved,
-		// reusing previous values computed within the same strip of
-		// 16 scanlines.
-		padded.store_at(curved, yo)
-			.compute_at(curved, yi);
-
-		// Also vectorize the padding. It's 8-bit, so we'll vectorize
-		// 16-wide.
-		padded.vectorize(x, 16);
-
-		// JIT-compile the pipeline for the CPU.
-		curved.compile_jit();
-	}
-
-	// Now a schedule that uses CUDA or OpenCL.
-	void schedule_for_gpu() {
-		// We make the decision about whether to use the GPU for each
-		// Func independently. If you have one Func computed on the
-		// CPU, and the next computed on the GPU, Halide will do the
-		// copy-to-gpu under the hood. For this pipeline, there's no
-		// reason to use the CPU for any of the stages. Halide will
-		// copy the input image to the GPU the first time we run the
-		// pipeline, and leave it there to reuse on subsequent runs.
-
-		// As before, we'll compute the LUT once at the start of the
-		// pipeline.
-		lut.compute_root();
-
-		// Let's compute the look-up-table using the GPU in 16-wide
-		// one-dimensional thread blocks. First we split the index
-		// into blocks of size 16:
-		Var block, thread;
-		lut.split(i, block, thread, 16);
-		// Then we tell cuda that our Vars 'block' and 'thread'
-		// correspond to CUDA's notions of blocks and threads, or
-		// OpenCL's notions of thread groups and threads.
-		lut.gpu_blocks(block)
-			.gpu_threads(thread);
-
-		// This is a very common scheduling pattern on the GPU, so
-		// there's a shorthand for it:
-
-		// lut.gpu_tile(i, 16);
-
-		// Func::gpu_tile method is similar to Func::tile, except that
-		// it also specifies that the tile coordinates correspond to
-		// GPU blocks, and the coordinates within each tile correspond
-		// to GPU threads.
-
-		// Compute color channels innermost. Promise that there will
-		// be three of them and unroll across them.
-		curved.reorder(c, x, y)
-			.bound(c, 0, 3)
-			.unroll(c);
-
-		// Compute curved in 2D 8x8 tiles using the GPU.
-		curved.gpu_tile(x, y, 8, 8);
-
-		// This is equivalent to:
-		// curved.tile(x, y, xo, yo, xi, yi, 8, 8)
-		//       .gpu_blocks(xo, yo)
-		//       .gpu_threads(xi, yi);
-
-		// We'll leave sharpen as inlined into curved.
-
-		// Compute the padded input as needed per GPU block, storing the
-		// intermediate result in shared memory. Var::gpu_blocks, and
-		// Var::gpu_threads exist to help you schedule producers within
-		// GPU threads and blocks.
-		padded.compute_at(curved, Var::gpu_blocks());
-
-		// Use the GPU threads for the x and y coordinates of the
-		// padded input.
-		padded.gpu_threads(x, y);
-
-		// JIT-compile the pipeline for the GPU. CUDA, OpenCL, or
-		// Metal are not enabled by default. We have to construct a
-		// Target object, enable one of them, and then pass that
-		// target object to compile_jit. Otherwise your CPU will very
-		// slowly pretend it's a GPU, and use one thread per output
-		// pixel.
-
-		// Start with a target suitable for the machine you're running
-		// this on.
-		Target target = get_host_target();
-
-		// Then enable OpenCL or Metal, depending on which platform
-		// we're on. OS X doesn't update its OpenCL drivers, so they
-		// tend to be broken. CUDA would also be a fine choice on
-		// machines with NVidia GPUs.
-		if (target.os == Target::OSX) {
-			target.set_feature(Target::Metal);
+	printf("Testing performance on CPU:\n");
+	Target cpu_target = find_cpu_target();
+	CpuSchedule cpu_schedule = jit_sliding_window ? CpuSchedule::sliding_window() : CpuSchedule();
+	if (schedules.lookup("cpu", cpu_target, jit_lut_mode, bucket, &tuned) && cpu_schedule.from_string(tuned)) {
+		printf("Using tuned schedule %s\n", tuned.c_str());
+	}
+	// Without a cache, the pipelines take the gamma table as an input,
+	// so they share the one copy. The cache's libraries only take the
+	// image, so they embed the table, and the exponent is part of what
+	// they're cached under.
+	bool gamma_param = cache == NULL;
+	std::string gamma_key = " gamma=" + std::to_string(GammaLut::gamma());
+	MyPipeline p1(input_param, false, jit_lut_mode, gamma_param);
+	p1.schedule_for_cpu(cpu_schedule);
+	if (use_arena) {
+		p1.curved.set_custom_allocator(arena_malloc, arena_free);
+	}
+	if (use_thread_pool) {
+		p1.curved.set_custom_do_par_for(work_stealing_do_par_for);
+	}
+	AotPipeline cached = cache ? cache->get(p1.curved, args, "cpu" + gamma_key, cpu_target) : NULL;
+	if (cached) {
+		test_performance("jit_cache_cpu", cached, false, input.raw_buffer(), reference_output.raw_buffer());
+	}
+	else {
+		p1.curved.compile_jit(cpu_target);
+		test_performance("jit_cpu", p1, input);
+		p1.curved.realize(reference_output);
+	}
+
+	Target target;
+	if (find_gpu_target(&target)) {
+		printf("Testing performance on GPU (%s):\n", target.to_string().c_str());
+		GpuSchedule gpu_schedule;
+		if (schedules.lookup("gpu", target, jit_lut_mode, bucket, &tuned) && gpu_schedule.from_string(tuned)) {
+			printf("Using tuned schedule %s\n", tuned.c_str());
+		}
+		MyPipeline p2(input_param, false, jit_lut_mode, gamma_param);
+		p2.schedule_for_gpu(gpu_schedule);
+		cached = cache ? cache->get(p2.curved, args, "gpu" + gamma_key, target) : NULL;
+		if (cached) {
+			Image<uint8_t> output(input.width(), input.height(), input.channels());
+			test_performance("jit_cache_gpu", cached, true, input.raw_buffer(), output.raw_buffer());
+			test_correctness("jit_cache_gpu", output.raw_buffer(), reference_output.raw_buffer(),
+				lut_tolerance(jit_lut_mode));
 		}
 		else {
-			target.set_feature(Target::OpenCL);
+			p2.curved.compile_jit(target);
+			Buffer output = test_performance("jit_gpu", p2, input);
+			test_correctness("jit_gpu", output.raw_buffer(), reference_output.raw_buffer(),
+				lut_tolerance(jit_lut_mode));
+
+			// The GPU schedule gets no clamp-free interior out of
+			// likely() (see schedule_for_gpu), only the staging loop
+			// of padded with the hint in it. Check that it costs
+			// nothing against the same pipeline without it.
+			double with_likely = benchmark_results.back().median_ms;
+			MyPipeline p3(input_param, false, jit_lut_mode, gamma_param, 3, false);
+			p3.schedule_for_gpu(gpu_schedule);
+			p3.curved.compile_jit(target);
+			output = test_performance("jit_gpu_no_likely", p3, input);
+			test_correctness("jit_gpu_no_likely", output.raw_buffer(), reference_output.raw_buffer(),
+				lut_tolerance(jit_lut_mode));
+			printf("likely() on the GPU: %1.4f ms with, %1.4f ms without (%+1.1f%%)\n",
+				with_likely, benchmark_results.back().median_ms,
+				100 * (with_likely / benchmark_results.back().median_ms - 1));
 		}
+	}
+	else {
+		printf("Not testing performance on GPU, "
+			"because I can't find a GPU library\n");
+	}
 
-		// Uncomment the next line and comment out the lines above to
-		// try CUDA instead.
-		// target.set_feature(Target::CUDA);
-
-		// If you want to see all of the OpenCL, Metal, or CUDA API
-		// calls done by the pipeline, you can also enable the Debug
-		// flag. This is helpful for figuring out which stages are
-		// slow, or when CPU -> GPU copies happen. It hurts
-		// performance though, so we'll leave it commented out.
-		target.set_feature(Target::Debug);
+	return correctness_failures ? -1 : 0;
+}
 
-		curved.compile_jit(target);
+// Profile MyPipeline stage by stage, for --profile: JIT-compile it
+// with Target::Profile, so Halide's sampling profiler reports on it
+// too, and with every Func traced through profiler.h, then print where
+// the time went and write the spans to trace_file as a Chrome trace.
+// On the GPU the kernels can't be traced, so the upload, kernel and
+// download times are measured from the host instead.
+int profile_jit(Image<uint8_t> input, const char *trace_file, bool trace_stores,
+                const ScheduleDatabase &schedules) {
+	const int runs = 10;
+	ImageParam input_param(UInt(8), 3, "input");
+	std::string bucket = size_bucket(input.width(), input.height());
+	std::string tuned;
+	PipelineTracer &tracer = PipelineTracer::instance();
+
+	Target cpu_target = find_cpu_target().with_feature(Target::Profile);
+	CpuSchedule cpu_schedule = jit_sliding_window ? CpuSchedule::sliding_window() : CpuSchedule();
+	if (schedules.lookup("cpu", find_cpu_target(), jit_lut_mode, bucket, &tuned) && cpu_schedule.from_string(tuned)) {
+		printf("Using tuned schedule %s\n", tuned.c_str());
+	}
+	MyPipeline p1(input_param, false, jit_lut_mode, true);
+	p1.schedule_for_cpu(cpu_schedule);
+
+	// Funcs that the schedule inlines have no realizations, so tracing
+	// them does nothing.
+	for (Func f : { p1.lut, p1.padded, p1.padded16, p1.sharpen, p1.curved }) {
+		f.trace_realizations();
+		if (trace_stores) {
+			f.trace_stores();
+		}
+	}
+	p1.curved.set_custom_trace(PipelineTracer::trace);
+	p1.curved.set_custom_do_par_for(PipelineTracer::do_par_for);
+	if (use_thread_pool) {
+		tracer.next_do_par_for = work_stealing_do_par_for;
+	}
+	if (use_arena) {
+		p1.curved.set_custom_allocator(arena_malloc, arena_free);
+	}
+	p1.curved.compile_jit(cpu_target);
+
+	p1.input.set(input);
+	Image<uint8_t> output(input.width(), input.height(), input.channels());
+	p1.curved.realize(output);
+	tracer.reset(p1.curved.name());
+	for (int i = 0; i < runs; i++) {
+		p1.curved.realize(output);
 	}
 
-	void test_performance() {
-		// Test the performance of the scheduled MyPipeline.
+	Target target;
+	if (find_gpu_target(&target)) {
+		GpuSchedule gpu_schedule;
+		if (schedules.lookup("gpu", target, jit_lut_mode, bucket, &tuned) && gpu_schedule.from_string(tuned)) {
+			printf("Using tuned schedule %s\n", tuned.c_str());
+		}
+		MyPipeline p2(input_param, false, jit_lut_mode, true);
+		p2.schedule_for_gpu(gpu_schedule);
+		p2.curved.compile_jit(target.with_feature(Target::Profile));
+
+		// Marking the input dirty makes the next realization upload
+		// it again; without that, it's already on the device, and
+		// only the kernels run. The difference is the upload.
+		Buffer gpu_input(UInt(8), input.width(), input.height(), input.channels());
+		memcpy(gpu_input.host_ptr(), input.data(), (size_t)input.width() * input.height() * input.channels());
+		Buffer gpu_output(UInt(8), input.width(), input.height(), input.channels());
+		p2.input.set(gpu_input);
+		p2.curved.realize(gpu_output);
+		gpu_output.copy_to_host();
+		std::string track = "GPU (" + target.to_string() + ")";
+		for (int i = 0; i < runs; i++) {
+			gpu_input.set_host_dirty();
+			auto t0 = std::chrono::steady_clock::now();
+			p2.curved.realize(gpu_output);
+			gpu_output.device_sync();
+			auto t1 = std::chrono::steady_clock::now();
+			p2.curved.realize(gpu_output);
+			gpu_output.device_sync();
+			auto t2 = std::chrono::steady_clock::now();
+			gpu_output.copy_to_host();
+			auto t3 = std::chrono::steady_clock::now();
+			tracer.add_span("upload + kernels", track, t0, t1);
+			tracer.add_span("kernels", track, t1, t2);
+			tracer.add_span("download", track, t2, t3);
+		}
+	}
 
-		// If we realize curved into a Halide::Image, that will
-		// unfairly penalize GPU performance by including a GPU->CPU
-		// copy in every run. Halide::Image objects always exist on
-		// the CPU.
+	tracer.print_summary();
+	if (!tracer.write_chrome_trace(trace_file)) {
+		printf("Could not write %s\n", trace_file);
+		return -1;
+	}
+	printf("Wrote a Chrome trace to %s\n", trace_file);
+	return 0;
+}
 
-		// Halide::Buffer, however, represents a buffer that may
-		// exist on either CPU or GPU or both.
-		Buffer output(UInt(8), input.width(), input.height(), input.channels());
+// Search for the fastest CPU and GPU schedules for images the size
+// of input, and record them in schedules_file for test_jit to use.
+// The candidates are built as test_jit will build them: with
+// jit_lut_mode, and with the gamma table as an input unless the
+// schedules are for pipelines from a JitCache.
+int autotune(Image<uint8_t> input, const char *schedules_file, bool cached) {
+	TuneOptions options;
+	options.lut_mode = jit_lut_mode;
+	options.gamma_param = !cached;
+	ScheduleDatabase schedules;
+	schedules.load(schedules_file);
+	std::string bucket = size_bucket(input.width(), input.height());
+
+	printf("Tuning the CPU schedule for %s pixels:\n", bucket.c_str());
+	Target cpu_target = find_cpu_target();
+	CpuSchedule cpu_schedule = autotune_cpu(input, cpu_target, options);
+	printf("Best CPU schedule: %s\n", cpu_schedule.to_string().c_str());
+	schedules.store("cpu", cpu_target, jit_lut_mode, bucket, cpu_schedule.to_string());
+
+	Target gpu_target;
+	if (find_gpu_target(&gpu_target)) {
+		printf("Tuning the GPU schedule for %s pixels:\n", bucket.c_str());
+		GpuSchedule gpu_schedule = autotune_gpu(input, gpu_target, options);
+		printf("Best GPU schedule: %s\n", gpu_schedule.to_string().c_str());
+		schedules.store("gpu", gpu_target, jit_lut_mode, bucket, gpu_schedule.to_string());
+	}
 
-		// Run the filter once to initialize any GPU runtime state.
-		curved.realize(output);
+	if (!schedules.save(schedules_file)) {
+		printf("Could not write %s\n", schedules_file);
+		return -1;
+	}
+	return 0;
+}
 
-		// Now take the best of 3 runs for timing.
-		double best_time;
-		for (int i = 0; i < 3; i++) {
+// Benchmark the ahead-of-time compiled variants of MyPipeline. No
+// code generation happens at runtime, so this starts immediately.
+// MyPipeline on a 16-bit image, computed directly on the host, to
+// check the 16-bit variants against. The curve is the one the variants
+// were built with, whatever --gamma says.
+Image<uint16_t> reference16(Image<uint16_t> input) {
+	int width = input.width(), height = input.height(), channels = input.channels();
+	std::vector<uint16_t> table(65536);
+	for (int i = 0; i < 65536; i++) {
+		float v = powf(i / 65535.0f, (float)HALIDE_TEST_GAMMA) * 65535.0f;
+		table[i] = (uint16_t)std::min(std::max(v, 0.0f), 65535.0f);
+	}
+	Image<uint16_t> output(width, height, channels);
+	for (int c = 0; c < channels; c++) {
+		auto at = [&](int x, int y) {
+			return (int)input(std::min(std::max(x, 0), width - 1), std::min(std::max(y, 0), height - 1), c);
+		};
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				int s = 2 * at(x, y) - (at(x - 1, y) + at(x, y - 1) + at(x + 1, y) + at(x, y + 1)) / 4;
+				output(x, y, c) = channels == 4 && c == 3 ? at(x, y) : table[std::min(std::max(s, 0), 65535)];
+			}
+		}
+	}
+	return output;
+}
 
-			double t1 = current_time();
+// "aot_cpu", "aot_cuda" or "aot_opencl", to name a variant's results.
+std::string aot_name(const AotVariant &variant) {
+	std::string name = std::string("aot_") + variant.name;
+	std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+	return name;
+}
 
-			// Run the filter 100 times.
-			for (int j = 0; j < 1000; j++) {
-				curved.realize(output);
+// Benchmark and check the variant's pipelines for the other pixel
+// formats, on images made from input: its first channel as a gray
+// image, and input with an alpha channel, in 8 and 16 bits. The
+// channels are independent, so the 8-bit outputs should match
+// reference, the RGB output, with alpha unchanged. The 16-bit ones
+// are checked against reference16, with the equivalent of
+// lut_tolerance in the top 8 bits.
+void test_formats(const AotVariant &variant, Image<uint8_t> input, Image<uint8_t> reference) {
+	int width = input.width(), height = input.height();
+	for (int bits : { 8, 16 }) {
+		for (int channels : { 1, 3, 4 }) {
+			if (bits == 8 && channels == 3) {
+				continue;
+			}
+			std::string name = aot_name(variant) +
+				(channels == 1 ? "_gray" : channels == 3 ? "_rgb" : "_rgba") + (bits == 16 ? "16" : "8");
+			AotPipeline pipeline = variant.formats[bits / 16][channels];
+
+			// The input, and for 8 bits the expected output.
+			Image<uint8_t> in(width, height, channels), expected(width, height, channels);
+			for (int c = 0; c < channels; c++) {
+				for (int y = 0; y < height; y++) {
+					for (int x = 0; x < width; x++) {
+						bool alpha = c == 3;
+						in(x, y, c) = alpha ? (uint8_t)(x + y) : input(x, y, c);
+						expected(x, y, c) = alpha ? in(x, y, c) : reference(x, y, c);
+					}
+				}
 			}
 
-			// Force any GPU code to finish by copying the buffer back to the CPU.
-			output.copy_to_host();
+			if (bits == 8) {
+				Image<uint8_t> output(width, height, channels);
+				test_performance(name.c_str(), pipeline, variant.on_gpu, in.raw_buffer(), output.raw_buffer());
+				test_correctness(name.c_str(), output.raw_buffer(), expected.raw_buffer(),
+					lut_tolerance(aot_lut_mode));
+				continue;
+			}
+			Image<uint16_t> in16(width, height, channels), output(width, height, channels);
+			for (int c = 0; c < channels; c++) {
+				for (int y = 0; y < height; y++) {
+					for (int x = 0; x < width; x++) {
+						in16(x, y, c) = in(x, y, c) * 257;
+					}
+				}
+			}
+			test_performance(name.c_str(), pipeline, variant.on_gpu, in16.raw_buffer(), output.raw_buffer());
+			test_correctness(name.c_str(), output.raw_buffer(), reference16(in16).raw_buffer(),
+				lut_tolerance(aot_lut_mode) * 256);
+		}
+	}
+}
 
-			double t2 = current_time();
+// Time bringing the output up to date after a brush stroke, a row of
+// overlapping dabs across the image, with an IncrementalPipeline, and
+// check the result matches the output of the whole edited image.
+void test_incremental(const AotVariant &variant, Image<uint8_t> input) {
+	int width = input.width(), height = input.height(), channels = input.channels();
+	Image<uint8_t> edited(width, height, channels), output(width, height, channels);
+	memcpy(edited.data(), input.data(), (size_t)width * height * channels);
+	if (run_variant(variant, edited.raw_buffer(), output.raw_buffer()) != 0) {
+		printf("%s variant failed\n", variant.name);
+		return;
+	}
 
-			double elapsed = (t2 - t1) / 100;
-			if (i == 0 || elapsed < best_time) {
-				best_time = elapsed;
+	std::vector<DirtyRect> stroke;
+	const int dab = 24;
+	for (int i = 0; i < 8; i++) {
+		DirtyRect r = { width / 4 + i * dab / 2, height / 4 + i * dab / 4, dab, dab };
+		r.width = std::max(0, std::min(r.width, width - r.x));
+		r.height = std::max(0, std::min(r.height, height - r.y));
+		for (int c = 0; c < channels; c++) {
+			for (int y = r.y; y < r.bottom(); y++) {
+				for (int x = r.x; x < r.right(); x++) {
+					edited(x, y, c) = 255 - edited(x, y, c);
+				}
 			}
 		}
+		stroke.push_back(r);
+	}
 
-		printf("%1.4f milliseconds\n", best_time);
+	IncrementalPipeline incremental(variant);
+	double megapixels = 0;
+	for (const DirtyRect &r : coalesce_dirty_rects(stroke, width, height)) {
+		megapixels += r.area() / 1e6;
 	}
+	std::string name = aot_name(variant) + "_incremental";
+	BenchmarkResult result = run_benchmark(name, megapixels,
+		[&]() { incremental.update(edited.raw_buffer(), output.raw_buffer(), stroke); },
+		[]() {});
+	print_benchmark(result);
+	benchmark_results.push_back(result);
+	incremental.print_stats();
+
+	Image<uint8_t> full(width, height, channels);
+	run_variant(variant, edited.raw_buffer(), full.raw_buffer());
+	test_correctness(name.c_str(), output.raw_buffer(), full.raw_buffer());
+}
 
-	void test_correctness(Image<uint8_t> reference_output) {
-		Image<uint8_t> output =
-			curved.realize(input.width(), input.height(), input.channels());
+// Run a short video through a FrameSequence: a band of inverted rows
+// moving down the image, each frame shown twice, so half of them are
+// repeats. Check the last output matches a plain run of the last frame.
+void test_sequence(const AotVariant &variant, Image<uint8_t> input) {
+	int width = input.width(), height = input.height(), channels = input.channels();
+	size_t bytes = (size_t)width * height * channels;
+	const int frames = 32, band = 16;
+	// Frame n, written into frame.
+	auto make_frame = [&](Image<uint8_t> &frame, int n) {
+		memcpy(frame.data(), input.data(), bytes);
+		int y0 = (n / 2 * band) % height;
+		for (int c = 0; c < channels; c++) {
+			for (int y = y0; y < std::min(y0 + band, height); y++) {
+				for (int x = 0; x < width; x++) {
+					frame(x, y, c) = 255 - frame(x, y, c);
+				}
+			}
+		}
+	};
+	FrameSequence sequence(variant, width, height, channels);
+	Image<uint8_t> output;
+	for (int n = 0; n < frames; n++) {
+		make_frame(sequence.next_input(), n);
+		if (sequence.process(&output) != 0) {
+			printf("%s variant failed\n", variant.name);
+			return;
+		}
+	}
+	sequence.print_stats();
 
-		// Check against the reference output.
-		for (int c = 0; c < input.channels(); c++) {
-			for (int y = 0; y < input.height(); y++) {
-				for (int x = 0; x < input.width(); x++) {
-					if (output(x, y, c) != reference_output(x, y, c)) {
-						printf("Mismatch between output (%d) and "
-							"reference output (%d) at %d, %d, %d\n",
-							output(x, y, c),
-							reference_output(x, y, c),
-							x, y, c);
-						exit(-1);
-					}
+	Image<uint8_t> last(width, height, channels), expected(width, height, channels);
+	make_frame(last, frames - 1);
+	run_variant(variant, last.raw_buffer(), expected.raw_buffer());
+	test_correctness((aot_name(variant) + "_sequence").c_str(), output.raw_buffer(), expected.raw_buffer());
+}
+
+// Send a PipelineService two gray and then two RGBA requests at once,
+// from two clients, with a batch window long enough that they'd be
+// batched together if they could be. The batch pipeline is RGB only,
+// so they have to run one at a time instead, and match plain runs.
+void test_service(const AotVariant &variant, Image<uint8_t> input) {
+	int width = input.width(), height = input.height();
+	ServiceConfig config;
+	config.batch_window_us = 100000;
+	PipelineService service(config);
+	service.add_worker(variant.name, [variant](buffer_t *in, buffer_t *out, bool batch) {
+		return run_variant(variant, in, out, batch);
+	});
+	for (int channels : { 1, 4 }) {
+		std::string name = aot_name(variant) + (channels == 1 ? "_service_gray" : "_service_rgba");
+		Image<uint8_t> in(width, height, channels), expected(width, height, channels);
+		for (int c = 0; c < channels; c++) {
+			for (int y = 0; y < height; y++) {
+				for (int x = 0; x < width; x++) {
+					in(x, y, c) = c == 3 ? (uint8_t)(x + y) : input(x, y, c);
 				}
 			}
 		}
+		run_variant(variant, in.raw_buffer(), expected.raw_buffer());
+
+		Image<uint8_t> outputs[2] = { Image<uint8_t>(width, height, channels),
+		                              Image<uint8_t>(width, height, channels) };
+		int results[2];
+		std::vector<std::thread> clients;
+		for (int i = 0; i < 2; i++) {
+			clients.emplace_back([&, i]() {
+				results[i] = service.submit(in.raw_buffer(), outputs[i].raw_buffer()).get();
+			});
+		}
+		for (std::thread &t : clients) {
+			t.join();
+		}
+		for (int i = 0; i < 2; i++) {
+			if (results[i] != 0) {
+				printf("%s: request %d failed\n", name.c_str(), i);
+				correctness_failures++;
+				continue;
+			}
+			test_correctness(name.c_str(), outputs[i].raw_buffer(), expected.raw_buffer());
+		}
+	}
+	service.stop();
+	service.print_stats();
+}
+
+int test_aot(Image<uint8_t> input) {
+	Image<uint8_t> reference_output(input.width(), input.height(), input.channels());
+
+	printf("Testing performance on CPU:\n");
+	test_performance("aot_cpu", halide_test_cpu, false, input.raw_buffer(), reference_output.raw_buffer());
+
+	// By now the arenas have everything the pipeline needs, so another
+	// realization shouldn't touch the heap at all.
+	if (use_arena) {
+		long long before = Arena::stats().heap_allocations;
+		halide_test_cpu(input.raw_buffer(), reference_output.raw_buffer());
+		printf("Heap allocations in a steady-state realization: %lld\n",
+			Arena::stats().heap_allocations - before);
+	}
+
+	// The same pipeline on interleaved buffers. The conversion is done
+	// up front, as a loader would; only the pipeline is timed.
+	InterleavedImage interleaved_input = interleave(input);
+	{
+		InterleavedImage output(input.width(), input.height());
+		test_performance("aot_cpu_interleaved", halide_test_interleaved_cpu, false,
+			interleaved_input.raw_buffer(), output.raw_buffer());
+		test_correctness("aot_cpu_interleaved", output.raw_buffer(), reference_output.raw_buffer(),
+			lut_tolerance(aot_lut_mode));
+	}
+
+	bool any_api = target_config.api == "auto";
+	if ((any_api || target_config.api == "opencl") && have_opencl()) {
+		printf("Testing performance on GPU (OpenCL):\n");
+		Image<uint8_t> output(input.width(), input.height(), input.channels());
+		test_performance("aot_opencl", halide_test_opencl, true, input.raw_buffer(), output.raw_buffer());
+		test_correctness("aot_opencl", output.raw_buffer(), reference_output.raw_buffer(),
+			lut_tolerance(aot_lut_mode));
+
+		InterleavedImage interleaved_output(input.width(), input.height());
+		test_performance("aot_opencl_interleaved", halide_test_interleaved_opencl, true,
+			interleaved_input.raw_buffer(), interleaved_output.raw_buffer());
+		test_correctness("aot_opencl_interleaved", interleaved_output.raw_buffer(), reference_output.raw_buffer(),
+			lut_tolerance(aot_lut_mode));
+	}
+	else {
+		printf("Not testing performance on OpenCL, "
+			"because it wasn't selected or I can't find the opencl library\n");
+	}
+
+	// Both at once, the frame split between them.
+	AotVariant gpu = select_aot_variant(target_config);
+	if (gpu.on_gpu) {
+		printf("Testing performance on the CPU and GPU (%s) together:\n", gpu.name);
+		TargetConfig cpu_config;
+		cpu_config.api = "cpu";
+		CoExecutor coexec(select_aot_variant(cpu_config), gpu);
+		Image<uint8_t> output(input.width(), input.height(), input.channels());
+		BenchmarkResult result = run_benchmark("aot_coexec", megapixels(input),
+			[&]() { coexec.run(input.raw_buffer(), output.raw_buffer()); },
+			[]() {});
+		print_benchmark(result);
+		benchmark_results.push_back(result);
+		coexec.print_stats();
+		test_correctness("aot_coexec", output.raw_buffer(), reference_output.raw_buffer(),
+			lut_tolerance(aot_lut_mode));
+	}
+
+	// Every GPU at once, on frames split into bands, and on batches
+	// split by image, which should scale with the number of devices.
+	if (gpu.on_gpu && GpuDevices::count(GpuDevices::api(gpu)) > 1) {
+		MultiGpu all(gpu);
+		printf("Testing performance on %d %s devices:\n", all.devices(), gpu.name);
+		Image<uint8_t> output(input.width(), input.height(), input.channels());
+		BenchmarkResult result = run_benchmark("aot_multi_gpu", megapixels(input),
+			[&]() { all.run(input.raw_buffer(), output.raw_buffer()); },
+			[]() {});
+		print_benchmark(result);
+		benchmark_results.push_back(result);
+		test_correctness("aot_multi_gpu", output.raw_buffer(), reference_output.raw_buffer(),
+			lut_tolerance(aot_lut_mode));
+
+		int count = 2 * all.devices();
+		Image<uint8_t> batch_input(input.width(), input.height(), input.channels(), count);
+		Image<uint8_t> batch_output(input.width(), input.height(), input.channels(), count);
+		for (int n = 0; n < count; n++) {
+			memcpy(batch_slice(batch_input, n).data(), input.data(),
+				(size_t)input.width() * input.height() * input.channels());
+		}
+		double one_device = 0;
+		for (int devices : { 1, all.devices() }) {
+			MultiGpu multi(gpu, devices);
+			std::string name = "aot_multi_gpu_batch_" + std::to_string(devices);
+			BenchmarkResult result = run_benchmark(name, count * megapixels(input),
+				[&]() { multi.run(batch_input.raw_buffer(), batch_output.raw_buffer(), true); },
+				[]() {});
+			print_benchmark(result);
+			benchmark_results.push_back(result);
+			if (devices == 1) {
+				one_device = result.megapixels_per_second();
+			}
+			else {
+				printf("%d devices process batches %1.2fx as fast as one\n",
+					devices, result.megapixels_per_second() / one_device);
+				multi.print_stats();
+			}
+		}
+	}
 
+	if ((any_api || target_config.api == "cuda") && have_cuda()) {
+		printf("Testing performance on GPU (CUDA):\n");
+		Image<uint8_t> output(input.width(), input.height(), input.channels());
+		test_performance("aot_cuda", halide_test_cuda, true, input.raw_buffer(), output.raw_buffer());
+		test_correctness("aot_cuda", output.raw_buffer(), reference_output.raw_buffer(),
+			lut_tolerance(aot_lut_mode));
+
+		InterleavedImage interleaved_output(input.width(), input.height());
+		test_performance("aot_cuda_interleaved", halide_test_interleaved_cuda, true,
+			interleaved_input.raw_buffer(), interleaved_output.raw_buffer());
+		test_correctness("aot_cuda_interleaved", interleaved_output.raw_buffer(), reference_output.raw_buffer(),
+			lut_tolerance(aot_lut_mode));
 	}
+	else {
+		printf("Not testing performance on CUDA, "
+			"because it wasn't selected or I can't find the cuda library\n");
+	}
+
+	// Gray, RGBA and 16-bit images, on the CPU and the GPU.
+	TargetConfig cpu_config;
+	cpu_config.api = "cpu";
+	printf("Testing performance on other pixel formats:\n");
+	test_formats(select_aot_variant(cpu_config), input, reference_output);
+	if (gpu.on_gpu) {
+		test_formats(gpu, input, reference_output);
+	}
+
+	// Updating the output after a small edit.
+	printf("Testing incremental updates:\n");
+	test_incremental(select_aot_variant(cpu_config), input);
+	if (gpu.on_gpu) {
+		test_incremental(gpu, input);
+	}
+
+	// A video, through one ring of buffers.
+	printf("Testing frame sequences:\n");
+	test_sequence(select_aot_variant(cpu_config), input);
+	if (gpu.on_gpu) {
+		test_sequence(gpu, input);
+	}
+
+	// Concurrent requests to the service in formats it can't batch.
+	printf("Testing the service with gray and RGBA requests:\n");
+	test_service(select_aot_variant(cpu_config), input);
+	if (gpu.on_gpu) {
+		test_service(gpu, input);
+	}
+
+	return correctness_failures ? -1 : 0;
+}
+
+// One implementation of MyPipeline for the scaling suite. run
+// benchmarks it on input as the point called name, and returns false
+// if it can't run on an image that size.
+struct ScalingImpl {
+	std::string name;
+	bool on_gpu;
+	std::function<bool(Image<uint8_t> input, const std::string &name, BenchmarkResult *result)> run;
 };
 
-bool have_opencl_or_metal();
+// Every ahead-of-time variant this machine can run, and the pipeline
+// JIT-compiled for the CPU and for the GPU.
+std::vector<ScalingImpl> scaling_impls(const ScalingConfig &config) {
+	std::vector<ScalingImpl> impls;
+	for (std::string api : { "cpu", "opencl", "cuda" }) {
+		if ((api == "opencl" && !have_opencl()) || (api == "cuda" && !have_cuda())) {
+			continue;
+		}
+		TargetConfig c;
+		c.api = api;
+		AotVariant variant = select_aot_variant(c);
+		impls.push_back({ "aot_" + api, variant.on_gpu,
+			[variant, config](Image<uint8_t> input, const std::string &name, BenchmarkResult *result) {
+				Image<uint8_t> output(input.width(), input.height(), input.channels());
+				buffer_t *in = input.raw_buffer(), *out = output.raw_buffer();
+				input.set_host_dirty();
+				bool ok = variant.pipeline(in, out) == 0;
+				if (ok) {
+					*result = run_benchmark(name, megapixels(input),
+						[&]() { variant.pipeline(in, out); },
+						[&]() {
+							if (variant.on_gpu) {
+								halide_copy_to_host(NULL, out);
+							}
+						},
+						config.bench);
+				}
+				if (variant.on_gpu) {
+					halide_device_free(NULL, in);
+					halide_device_free(NULL, out);
+				}
+				return ok;
+			} });
+	}
+
+	ImageParam input_param(UInt(8), 3, "input");
+	std::shared_ptr<MyPipeline> cpu = std::make_shared<MyPipeline>(input_param, false, jit_lut_mode);
+	cpu->schedule_for_cpu(jit_sliding_window ? CpuSchedule::sliding_window() : CpuSchedule());
+	if (use_arena) {
+		cpu->curved.set_custom_allocator(arena_malloc, arena_free);
+	}
+	// The JIT runtime has a thread pool of its own, sized once from
+	// HL_NUM_THREADS. Running the parallel loops on the ahead-of-time
+	// runtime's pool instead lets halide_set_num_threads size both.
+	cpu->curved.set_custom_do_par_for(use_thread_pool ? work_stealing_do_par_for : halide_do_par_for);
+	cpu->curved.compile_jit(find_cpu_target());
+
+	Target gpu_target;
+	std::shared_ptr<MyPipeline> gpu;
+	if (find_gpu_target(&gpu_target)) {
+		gpu = std::make_shared<MyPipeline>(input_param, false, jit_lut_mode);
+		gpu->schedule_for_gpu();
+		gpu->curved.compile_jit(gpu_target);
+	}
 
-int main(int argc, char **argv) {
-	// Load an input image.
-	Image<uint8_t> input = load_image("rgb.png");
+	for (std::shared_ptr<MyPipeline> p : { cpu, gpu }) {
+		if (!p) {
+			continue;
+		}
+		bool on_gpu = p == gpu;
+		std::string name = !on_gpu ? "jit_cpu" :
+		                   gpu_target.has_feature(Target::CUDA) ? "jit_cuda" :
+		                   gpu_target.has_feature(Target::Metal) ? "jit_metal" : "jit_opencl";
+		impls.push_back({ name, on_gpu,
+			[p, on_gpu, config](Image<uint8_t> input, const std::string &name, BenchmarkResult *result) {
+				input.set_host_dirty();
+				p->input.set(input);
+				Buffer output(UInt(8), input.width(), input.height(), input.channels());
+				*result = run_benchmark(name, megapixels(input),
+					[&]() { p->curved.realize(output); },
+					[&]() {
+						if (on_gpu) {
+							output.copy_to_host();
+						}
+					},
+					config.bench);
+				return true;
+			} });
+	}
+	return impls;
+}
 
-	// Allocated an image that will store the correct output
-	Image<uint8_t> reference_output(input.width(), input.height(), input.channels());
+// Run every implementation over every size and thread count in
+// config, printing the scaling curves, and then compare the points
+// with the baseline in baseline_file, if there is one. If the file
+// doesn't exist yet, this run is saved there as the baseline. Returns
+// nonzero if any point regressed.
+int scaling_suite(Image<uint8_t> real, const ScalingConfig &config, const char *baseline_file) {
+	double peak = peak_bandwidth_gbps();
+	printf("Peak memory bandwidth: %1.1f GB/s\n", peak);
+
+	std::vector<ScalingImpl> impls = scaling_impls(config);
+	std::vector<int> threads = doubling(1, scaling_max_threads(config));
+	if (use_thread_pool) {
+		threads.assign(1, WorkStealingPool::instance()->num_threads());
+		printf("The work-stealing pool always has %d threads, so the CPU only runs with those\n", threads[0]);
+	}
 
-	printf("Testing performance on CPU:\n");
-	MyPipeline p1(input);
-	p1.schedule_for_cpu();
-	p1.test_performance();
-	p1.curved.realize(reference_output);
-
-	if (have_opencl_or_metal()) {
-		printf("Testing performance on GPU:\n");
-		MyPipeline p2(input);
-		p2.schedule_for_gpu();
-		p2.test_performance();
-		p2.test_correctness(reference_output);
+	for (int size : doubling(config.min_size, config.max_size)) {
+		for (bool synthetic : { true, false }) {
+			Image<uint8_t> input = synthetic ? synthetic_image(size, size) : tiled_image(real, size, size);
+			std::string point = std::string(synthetic ? "synthetic_" : "real_") +
+			                    std::to_string(size) + "x" + std::to_string(size);
+			// An image too big for the device in one API is too big for
+			// the JIT-compiled pipeline too, which can't fail quietly.
+			bool gpu_failed = false;
+			for (const ScalingImpl &impl : impls) {
+				BenchmarkResult r;
+				if (impl.on_gpu) {
+					std::string name = impl.name + "_" + point;
+					if ((impl.name.compare(0, 4, "jit_") == 0 && gpu_failed) || !impl.run(input, name, &r)) {
+						printf("%s: too big for the device\n", name.c_str());
+						gpu_failed = true;
+						continue;
+					}
+					print_benchmark(r);
+					benchmark_results.push_back(r);
+					printf("  %1.1f GB/s, %1.1f%% of peak\n", achieved_gbps(r), 100 * achieved_gbps(r) / peak);
+					continue;
+				}
+
+				std::vector<BenchmarkResult> curve;
+				for (int t : threads) {
+					halide_set_num_threads(t);
+					std::string name = impl.name + "_" + point + "_t" + std::to_string(t);
+					if (!impl.run(input, name, &r)) {
+						printf("%s failed\n", name.c_str());
+						break;
+					}
+					print_benchmark(r);
+					benchmark_results.push_back(r);
+					curve.push_back(r);
+				}
+				print_scaling("Strong", impl.name + "_" + point, threads, curve, false, peak);
+			}
+		}
+	}
+
+	// The same share of the image per thread, however many threads.
+	for (const ScalingImpl &impl : impls) {
+		if (impl.on_gpu) {
+			continue;
+		}
+		std::vector<BenchmarkResult> curve;
+		for (int t : threads) {
+			halide_set_num_threads(t);
+			Image<uint8_t> input = synthetic_image(config.weak_size * t, config.weak_size);
+			std::string name = impl.name + "_weak_" + std::to_string(input.width()) + "x" +
+			                   std::to_string(input.height()) + "_t" + std::to_string(t);
+			BenchmarkResult r;
+			if (!impl.run(input, name, &r)) {
+				printf("%s failed\n", name.c_str());
+				break;
+			}
+			print_benchmark(r);
+			benchmark_results.push_back(r);
+			curve.push_back(r);
+		}
+		print_scaling("Weak", impl.name, threads, curve, true, peak);
+	}
+
+	if (!baseline_file) {
+		return 0;
+	}
+	std::vector<BenchmarkResult> baseline;
+	if (!read_benchmark_csv(baseline_file, &baseline)) {
+		printf("No baseline in %s yet, so saving this run as the baseline\n", baseline_file);
+		if (!write_benchmark_csv(benchmark_results, baseline_file)) {
+			printf("Could not write %s\n", baseline_file);
+			return -1;
+		}
+		return 0;
+	}
+	int regressions = report_regressions(benchmark_results, baseline, config.regression_threshold);
+	printf("%d of %d points are more than %1.0f%% slower than the baseline in %s\n",
+		regressions, (int)benchmark_results.size(), 100 * config.regression_threshold, baseline_file);
+	return regressions ? -1 : 0;
+}
+
+// Run input through the best variant for this machine and save the
+// result. The variant's pipeline for the image's format is picked
+// from its channels and the size of T, uint8_t or uint16_t. With
+// coexec, the GPU variant shares the frame with the CPU.
+template<typename T>
+int process_aot(Image<T> input, const char *output_filename, bool coexec = false) {
+	AotVariant variant = select_aot_variant(target_config);
+	coexec = coexec && variant.on_gpu;
+	printf("Host target %s, using the %s variant for %d-bit images with %d channels%s\n",
+		get_host_target().to_string().c_str(), variant.name, 8 * (int)sizeof(T), input.channels(),
+		coexec ? ", and the CPU" : "");
+
+	Image<T> output(input.width(), input.height(), input.channels());
+	int result;
+	if (coexec) {
+		TargetConfig cpu_config;
+		cpu_config.api = "cpu";
+		result = CoExecutor(select_aot_variant(cpu_config), variant).run(input.raw_buffer(), output.raw_buffer());
 	}
 	else {
-		printf("Not testing performance on GPU, "
-			"because I can't find the opencl library\n");
+		result = run_variant(variant, input.raw_buffer(), output.raw_buffer());
+	}
+	if (result != 0) {
+		printf("%s variant failed\n", variant.name);
+		return -1;
 	}
 
+	if (!save_rgb(output, output_filename)) {
+		printf("Could not save %s\n", output_filename);
+		return -1;
+	}
 	return 0;
 }
 
+// The same, using the interleaved variant, with the image loaded and
+// saved in interleaved form so it's never converted to planes.
+int process_aot_interleaved(const char *input_filename, const char *output_filename) {
+	AotVariant variant = select_aot_variant(target_config);
+	printf("Host target %s, using the interleaved %s variant\n",
+		get_host_target().to_string().c_str(), variant.name);
 
-// A helper function to check if OpenCL seems to exist on this machine.
+	InterleavedImage input;
+	if (!load_interleaved(input_filename, &input)) {
+		return -1;
+	}
+	InterleavedImage output(input.width(), input.height());
+	if (run_variant(variant, variant.interleaved_pipeline, input.raw_buffer(), output.raw_buffer()) != 0) {
+		printf("%s variant failed\n", variant.name);
+		return -1;
+	}
 
-#ifdef _WIN32
-#include <windows.h>
-#else
-#include <dlfcn.h>
-#endif
+	if (!save_interleaved(output, output_filename)) {
+		printf("Could not save %s\n", output_filename);
+		return -1;
+	}
+	return 0;
+}
 
-bool have_opencl_or_metal() {
-#ifdef _WIN32
-	return true;//return LoadLibrary("OpenCL.dll") != NULL;
-#elif __APPLE__
-	return dlopen("/System/Library/Frameworks/Metal.framework/Versions/Current/Metal", RTLD_LAZY) != NULL;
-#else
-	return dlopen("libOpenCL.so", RTLD_LAZY) != NULL;
-#endif
+// The same for a raw frame, which is mapped rather than loaded, so the
+// pipeline reads it straight from the file. If the output is a raw
+// frame too, the pipeline writes straight into that, in the input's
+// layout; the interleaved variant runs on interleaved frames.
+int process_aot_raw(const char *input_filename, const char *output_filename) {
+	AotVariant variant = select_aot_variant(target_config);
+	RawFrame input;
+	if (!open_raw_rgb(input_filename, &input)) {
+		return -1;
+	}
+	if (input.channels() != 3) {
+		printf("%s is not an RGB image\n", input_filename);
+		return -1;
+	}
+	bool interleaved = input.is_interleaved();
+	AotPipeline pipeline = interleaved ? variant.interleaved_pipeline : variant.pipeline;
+	printf("Host target %s, using the %s%s variant on a mapped frame\n",
+		get_host_target().to_string().c_str(), interleaved ? "interleaved " : "", variant.name);
+
+	int width = input.width(), height = input.height();
+	bool saved;
+	if (is_raw_filename(output_filename)) {
+		RawFrame output;
+		if (!output.create(output_filename, width, height, 3, interleaved)) {
+			return -1;
+		}
+		if (run_variant(variant, pipeline, input.raw_buffer(), output.raw_buffer()) != 0) {
+			printf("%s variant failed\n", variant.name);
+			return -1;
+		}
+		saved = output.flush();
+	}
+	else if (interleaved) {
+		InterleavedImage output(width, height);
+		if (run_variant(variant, pipeline, input.raw_buffer(), output.raw_buffer()) != 0) {
+			printf("%s variant failed\n", variant.name);
+			return -1;
+		}
+		saved = save_interleaved(output, output_filename);
+	}
+	else {
+		Image<uint8_t> output(width, height, 3);
+		if (run_variant(variant, pipeline, input.raw_buffer(), output.raw_buffer()) != 0) {
+			printf("%s variant failed\n", variant.name);
+			return -1;
+		}
+		saved = save_rgb(output, output_filename);
+	}
+	if (!saved) {
+		printf("Could not save %s\n", output_filename);
+		return -1;
+	}
+	return 0;
+}
+
+// Run as a resident service, for --serve: keep the CPU variant, and
+// the GPU one if there is one, warm, and process requests from
+// clients on port until killed. With bench_clients, instead start that
+// many clients in this process, each sending input through submit()
+// again and again, and report the latency and batching they saw. The
+// GPU variant gets a worker on each of the first gpus devices, or on
+// all of them if gpus is 0.
+int serve(Image<uint8_t> input, int port, int bench_clients, const ServiceConfig &config,
+          int gpus = 1) {
+	// Each worker's variant, and the device it runs on (-1 for the CPU,
+	// or the default device).
+	std::vector<std::pair<AotVariant, int> > workers;
+	TargetConfig cpu_config = target_config;
+	cpu_config.api = "cpu";
+	workers.push_back(std::make_pair(select_aot_variant(cpu_config), -1));
+	AotVariant gpu = select_aot_variant(target_config);
+	if (gpu.on_gpu && gpus == 1) {
+		workers.push_back(std::make_pair(gpu, -1));
+	}
+	else if (gpu.on_gpu) {
+		for (int d = 0; d < MultiGpu(gpu, gpus).devices(); d++) {
+			workers.push_back(std::make_pair(gpu, d));
+		}
+	}
+
+	PipelineService service(config);
+	Image<uint8_t> batch_input(input.width(), input.height(), input.channels(), 1);
+	memcpy(batch_input.data(), input.data(), (size_t)input.width() * input.height() * input.channels());
+	for (const auto &w : workers) {
+		// The first realization starts the thread pool, or creates the
+		// GPU context and fills the DevicePool, so no request pays for
+		// that. The devices warm up one at a time, so they don't add
+		// their kernels to the runtime's list at once (see MultiGpu), and
+		// warm up for batches too.
+		AotVariant v = w.first;
+		int device = w.second;
+		ScopedGpu scope(device);
+		Image<uint8_t> output(input.width(), input.height(), input.channels());
+		Image<uint8_t> batch_output(input.width(), input.height(), input.channels(), 1);
+		if (run_variant(v, input.raw_buffer(), output.raw_buffer()) != 0 ||
+		    run_variant(v, batch_input.raw_buffer(), batch_output.raw_buffer(), true) != 0) {
+			printf("%s variant failed\n", v.name);
+			return -1;
+		}
+		std::string name = device < 0 ? std::string(v.name) : std::string(v.name) + " " + std::to_string(device);
+		service.add_worker(name, [v, device](buffer_t *in, buffer_t *out, bool batch) {
+			ScopedGpu scope(device);
+			return run_variant(v, in, out, batch);
+		});
+	}
+	printf("Service running on %d workers, up to %d requests per batch, waiting up to %d us\n",
+		(int)workers.size(), config.max_batch, config.batch_window_us);
+
+	if (!bench_clients) {
+		if (!serve_socket(service, port)) {
+			printf("Could not listen on port %d\n", port);
+			return -1;
+		}
+		return 0;
+	}
+
+	const int requests_per_client = 100;
+	std::atomic<int> failed(0);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> clients;
+	for (int i = 0; i < bench_clients; i++) {
+		clients.emplace_back([&]() {
+			Image<uint8_t> output(input.width(), input.height(), input.channels());
+			for (int r = 0; r < requests_per_client; r++) {
+				if (service.submit(input.raw_buffer(), output.raw_buffer()).get() != 0) {
+					failed++;
+				}
+			}
+		});
+	}
+	for (std::thread &t : clients) {
+		t.join();
+	}
+	double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("%d clients sent %d requests in %1.1f ms: %1.1f requests/second, %d failed\n",
+		bench_clients, bench_clients * requests_per_client, total_ms,
+		bench_clients * requests_per_client / (total_ms / 1000.0), (int)failed);
+	service.stop();
+	service.print_stats();
+	return failed ? -1 : 0;
+}
+
+// Compare two images, for --compare, as a nightly check of the
+// outputs of different variants. Raw frames are mapped, so even very
+// large ones are compared without being loaded.
+int compare_images(const char *output_filename, const char *reference_filename, int tolerance) {
+	RawFrame output_frame, reference_frame;
+	Image<uint8_t> output_image, reference_image;
+	const buffer_t *output, *reference;
+	if (is_raw_filename(output_filename)) {
+		if (!open_raw_rgb(output_filename, &output_frame)) {
+			return -1;
+		}
+		output = output_frame.raw_buffer();
+	}
+	else {
+		if (!load_rgb(output_filename, &output_image)) {
+			return -1;
+		}
+		output = output_image.raw_buffer();
+	}
+	if (is_raw_filename(reference_filename)) {
+		if (!open_raw_rgb(reference_filename, &reference_frame)) {
+			return -1;
+		}
+		reference = reference_frame.raw_buffer();
+	}
+	else {
+		if (!load_rgb(reference_filename, &reference_image)) {
+			return -1;
+		}
+		reference = reference_image.raw_buffer();
+	}
+
+	VerifyConfig config;
+	config.tolerance = tolerance;
+	VerifyResult result = compare_buffers(output, reference, config);
+	print_verify_result(output_filename, result, tolerance);
+	return result.ok() ? 0 : -1;
+}
+
+// Usage: halide_test [--jit [--jit-cache dir]] [--autotune]
+//                    [--profile trace.json [--trace-stores]]
+//                    [--compare output reference [--tolerance n]]
+//                    [--serve port | --serve-bench clients]
+//                    [--max-batch n] [--batch-window us]
+//                    [--gpus n]
+//                    [--sequence source [--fps n]]
+//                    [--scaling [--scaling-max-size n] [--scaling-threads n]
+//                     [--baseline file [--regression-threshold pct]]]
+//                    [--schedules file] [-o output.png]
+//                    [--bench-json file] [--bench-csv file] [input.png]
+int main(int argc, char **argv) {
+	bool jit = false, tune = false;
+	const char *cache_dir = NULL;
+	const char *schedules_file = "schedules.txt";
+	const char *input_filename = "rgb.png";
+	const char *output_filename = NULL;
+	const char *bench_json = NULL, *bench_csv = NULL;
+	const char *batch_source = NULL, *batch_out = ".";
+	int batch_size = 8;
+	bool pipelined = false, interleaved = false, stream = false;
+	int band_height = 256;
+	int gpu_async_depth = 0;
+	const char *sequence_source = NULL;
+	SequenceConfig sequence_config;
+	bool scaling = false;
+	ScalingConfig scaling_config;
+	const char *baseline_file = NULL;
+	int gpus = 1;
+	bool arena_stats = false;
+	bool coexec = false;
+	const char *profile_file = NULL;
+	const char *compare_output = NULL, *compare_reference = NULL;
+	int compare_tolerance = 0;
+	int serve_port = 0, serve_bench_clients = 0;
+	ServiceConfig service_config;
+	bool profile_stores = false;
+	ThreadPoolConfig thread_pool_config;
+	PipelinedConfig pipelined_config;
+	parse_lut_mode(HALIDE_TEST_LUT_MODE, &aot_lut_mode);
+	jit_lut_mode = aot_lut_mode;
+	GammaLut::set_gamma((float)HALIDE_TEST_GAMMA);
+	if (const char *env = getenv("HALIDE_TEST_TARGET")) {
+		if (!target_config.parse(env)) {
+			return -1;
+		}
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--jit") == 0) {
+			jit = true;
+		}
+		else if (strcmp(argv[i], "--jit-cache") == 0 && i + 1 < argc) {
+			cache_dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "--autotune") == 0) {
+			tune = true;
+		}
+		else if (strcmp(argv[i], "--schedules") == 0 && i + 1 < argc) {
+			schedules_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc) {
+			bench_json = argv[++i];
+		}
+		else if (strcmp(argv[i], "--bench-csv") == 0 && i + 1 < argc) {
+			bench_csv = argv[++i];
+		}
+		else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_source = argv[++i];
+		}
+		else if (strcmp(argv[i], "--batch-size") == 0 && i + 1 < argc) {
+			batch_size = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--batch-out") == 0 && i + 1 < argc) {
+			batch_out = argv[++i];
+		}
+		else if (strcmp(argv[i], "--pipelined") == 0) {
+			pipelined = true;
+		}
+		else if (strcmp(argv[i], "--decode-threads") == 0 && i + 1 < argc) {
+			pipelined_config.decode_threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--encode-threads") == 0 && i + 1 < argc) {
+			pipelined_config.encode_threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--target") == 0 && i + 1 < argc) {
+			if (!target_config.parse(argv[++i])) {
+				return -1;
+			}
+		}
+		else if (strcmp(argv[i], "--no-arena") == 0) {
+			use_arena = false;
+		}
+		else if (strcmp(argv[i], "--arena-stats") == 0) {
+			arena_stats = true;
+		}
+		else if (strcmp(argv[i], "--lut") == 0 && i + 1 < argc) {
+			if (!parse_lut_mode(argv[++i], &jit_lut_mode)) {
+				printf("Unknown --lut mode %s: expected table, gather or polynomial\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp(argv[i], "--gamma") == 0 && i + 1 < argc) {
+			GammaLut::set_gamma((float)atof(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--sliding-window") == 0) {
+			jit_sliding_window = true;
+		}
+		else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc) {
+			png_encode_config().level = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--png-filter") == 0 && i + 1 < argc) {
+			if (!parse_png_filter(argv[++i], &png_encode_config().filter)) {
+				printf("Unknown --png-filter %s: expected none, sub, up, average, paeth or adaptive\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp(argv[i], "--png-strategy") == 0 && i + 1 < argc) {
+			if (!parse_zlib_strategy(argv[++i], &png_encode_config().strategy)) {
+				printf("Unknown --png-strategy %s: expected default, filtered, rle or huffman\n", argv[i]);
+				return -1;
+			}
+		}
+		else if (strcmp(argv[i], "--png-threads") == 0 && i + 1 < argc) {
+			png_encode_config().threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--work-stealing") == 0) {
+			use_thread_pool = true;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			thread_pool_config.threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--pin-threads") == 0) {
+			thread_pool_config.pin = true;
+		}
+		else if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc) {
+			compare_output = argv[++i];
+			compare_reference = argv[++i];
+		}
+		else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+			compare_tolerance = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			serve_port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--serve-bench") == 0 && i + 1 < argc) {
+			serve_bench_clients = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--max-batch") == 0 && i + 1 < argc) {
+			service_config.max_batch = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--batch-window") == 0 && i + 1 < argc) {
+			service_config.batch_window_us = std::max(0, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--gpus") == 0 && i + 1 < argc) {
+			gpus = std::max(0, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--coexec") == 0) {
+			coexec = true;
+		}
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			profile_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "--trace-stores") == 0) {
+			profile_stores = true;
+		}
+		else if (strcmp(argv[i], "--gpu-async") == 0 && i + 1 < argc) {
+			gpu_async_depth = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--sequence") == 0 && i + 1 < argc) {
+			sequence_source = argv[++i];
+		}
+		else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+			sequence_config.fps = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--scaling") == 0) {
+			scaling = true;
+		}
+		else if (strcmp(argv[i], "--scaling-max-size") == 0 && i + 1 < argc) {
+			scaling_config.max_size = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--scaling-threads") == 0 && i + 1 < argc) {
+			scaling_config.max_threads = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+			baseline_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "--regression-threshold") == 0 && i + 1 < argc) {
+			scaling_config.regression_threshold = atof(argv[++i]) / 100;
+		}
+		else if (strcmp(argv[i], "--stream") == 0) {
+			stream = true;
+		}
+		else if (strcmp(argv[i], "--band-height") == 0 && i + 1 < argc) {
+			band_height = std::max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--interleaved") == 0) {
+			interleaved = true;
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output_filename = argv[++i];
+		}
+		else {
+			input_filename = argv[i];
+		}
+	}
+
+	if (use_arena) {
+		install_arena();
+		if (arena_stats) {
+			atexit(print_arena_stats);
+		}
+	}
+
+	if (use_thread_pool) {
+		install_thread_pool(thread_pool_config);
+		atexit([]() { WorkStealingPool::instance()->print_stats(); });
+	}
+	else if (thread_pool_config.threads > 0) {
+		// Halide's own pool takes the thread count too.
+		halide_set_num_threads(thread_pool_config.threads);
+	}
+	if (thread_pool_config.pin && !use_thread_pool) {
+		printf("--pin-threads only applies to --work-stealing\n");
+	}
+
+	if (!jit && (target_config.debug || target_config.profile)) {
+		printf("debug and profile only apply to --jit; the ahead-of-time variants are built without them\n");
+	}
+
+	if (compare_output) {
+		return compare_images(compare_output, compare_reference, compare_tolerance);
+	}
+
+	if (sequence_source) {
+		return process_sequence(select_aot_variant(target_config), sequence_source,
+			batch_out, sequence_config);
+	}
+	if (batch_source && gpu_async_depth) {
+		return process_gpu_async(select_aot_variant(target_config), batch_source, batch_out, gpu_async_depth);
+	}
+	if (batch_source && pipelined) {
+		return process_pipelined(select_aot_variant(target_config), batch_source, batch_out, pipelined_config);
+	}
+	if (batch_source) {
+		AotVariant variant = select_aot_variant(target_config);
+		if (variant.on_gpu && gpus != 1) {
+			MultiGpu multi(variant, gpus);
+			printf("Sharding batches across %d %s devices\n", multi.devices(), variant.name);
+			int result = process_batch(variant, batch_source, batch_size, batch_out,
+				[&](buffer_t *in, buffer_t *out, bool batch) { return multi.run(in, out, batch); });
+			multi.print_stats();
+			return result;
+		}
+		return process_batch(variant, batch_source, batch_size, batch_out);
+	}
+
+	if (output_filename && stream) {
+		return process_streaming(select_aot_variant(target_config), input_filename, output_filename, band_height);
+	}
+	if (output_filename && is_raw_filename(input_filename)) {
+		return process_aot_raw(input_filename, output_filename);
+	}
+	if (output_filename && interleaved) {
+		return process_aot_interleaved(input_filename, output_filename);
+	}
+
+	// 16-bit PNGs keep their 16 bits, with the 16-bit variants.
+	if (output_filename && png_bit_depth(input_filename) == 16) {
+		Image<uint16_t> input16;
+		if (!load_image16(input_filename, &input16)) {
+			return -1;
+		}
+		return process_aot(input16, output_filename, coexec);
+	}
+
+	// Load an input image.
+	Image<uint8_t> input;
+	if (!load_rgb(input_filename, &input)) {
+		return -1;
+	}
+
+	if (output_filename) {
+		return process_aot(input, output_filename, coexec);
+	}
+	if (tune) {
+		return autotune(input, schedules_file, cache_dir != NULL);
+	}
+	if (serve_port || serve_bench_clients) {
+		return serve(input, serve_port, serve_bench_clients, service_config, gpus);
+	}
+	if (profile_file) {
+		ScheduleDatabase schedules;
+		schedules.load(schedules_file);
+		return profile_jit(input, profile_file, profile_stores, schedules);
+	}
+
+	int result;
+	if (scaling) {
+		result = scaling_suite(input, scaling_config, baseline_file);
+	}
+	else if (!jit) {
+		result = test_aot(input);
+	}
+	else {
+		ScheduleDatabase schedules;
+		schedules.load(schedules_file);
+		if (cache_dir) {
+			JitCache cache(cache_dir);
+			// The cached libraries each have their own runtime, which
+			// install_arena() and install_thread_pool() don't reach.
+			if (use_arena) {
+				cache.set_custom_allocator(arena_malloc, arena_free);
+			}
+			if (use_thread_pool) {
+				cache.set_custom_do_par_for(work_stealing_do_par_for);
+			}
+			result = test_jit(input, &cache, schedules);
+		}
+		else {
+			result = test_jit(input, NULL, schedules);
+		}
+	}
+
+	if (bench_json && !write_benchmark_json(benchmark_results, bench_json)) {
+		printf("Could not write %s\n", bench_json);
+		return -1;
+	}
+	if (bench_csv && !write_benchmark_csv(benchmark_results, bench_csv)) {
+		printf("Could not write %s\n", bench_csv);
+		return -1;
+	}
+	return result;
 }
@@ -0,0 +1,63 @@
+// Ahead-of-time build of MyPipeline.
+//
+// This is linked with GenGen.cpp from the Halide tools directory to
+// make a generator executable. The build runs it once per target
+// (see CMakeLists.txt) to emit static libraries and headers for the
+// CPU, OpenCL and CUDA variants of the pipeline, which halide_test
+// then links against instead of JIT-compiling at startup. The
+// halide_test_batch generator is the same pipeline over a batch of
+// images, and halide_test_interleaved the same pipeline over images
+// with interleaved channels. halide_test_16 is the pipeline over
+// 16-bit images. Pass lut_mode=table|gather|polynomial to pick how the
+// gamma curve is applied, gamma=x for its exponent (1.2 by default),
+// sliding_window=true for the single-pass CPU schedule, and
+// channels=1|3|4 for gray, RGB (the default) or RGBA images.
+
+#include "Halide.h"
+#include "my_pipeline.h"
+using namespace Halide;
+
+// dimensions is 3 for a single image, or 4 for a batch of images. T
+// is the type of the values, uint8_t or uint16_t.
+template<int dimensions, bool interleaved = false, typename T = uint8_t>
+class HalideTestGenerator : public Generator<HalideTestGenerator<dimensions, interleaved, T>> {
+public:
+	ImageParam input{ type_of<T>(), dimensions, "input" };
+
+	// The number of channels; see MyPipeline::channels.
+	GeneratorParam<int> channels{ "channels", 3, 1, 4 };
+
+	// How curved applies the gamma curve; see LutMode.
+	GeneratorParam<LutMode> lut_mode{ "lut_mode", GatherLut,
+		{ { "table", TableLut }, { "gather", GatherLut }, { "polynomial", PolynomialLut } } };
+
+	// Use CpuSchedule::sliding_window() rather than the default CPU
+	// schedule.
+	GeneratorParam<bool> sliding_window{ "sliding_window", false };
+
+	// The exponent of the gamma curve. The table for it is embedded in
+	// the library; see GammaLut.
+	GeneratorParam<float> gamma{ "gamma", 1.2f };
+
+	Func build() {
+		GammaLut::set_gamma(gamma);
+		MyPipeline p(input, interleaved, lut_mode, false, channels);
+
+		// Pick the schedule from the target we're being compiled
+		// for, so the same generator serves both the CPU and the
+		// GPU libraries.
+		if (this->get_target().has_gpu_feature()) {
+			p.schedule_for_gpu();
+		}
+		else {
+			p.schedule_for_cpu(sliding_window ? CpuSchedule::sliding_window() : CpuSchedule());
+		}
+
+		return p.curved;
+	}
+};
+
+RegisterGenerator<HalideTestGenerator<3>> register_halide_test{ "halide_test" };
+RegisterGenerator<HalideTestGenerator<4>> register_halide_test_batch{ "halide_test_batch" };
+RegisterGenerator<HalideTestGenerator<3, true>> register_halide_test_interleaved{ "halide_test_interleaved" };
+RegisterGenerator<HalideTestGenerator<3, false, uint16_t>> register_halide_test_16{ "halide_test_16" };
@@ -0,0 +1,431 @@
+// Faster image loading for MyPipeline's 8-bit RGB inputs.
+//
+// load_png in halide_image_io.h handles every kind of PNG, but it
+// decodes the whole image into one heap-allocated array per scanline
+// and then converts it to the planar layout of Image pixel by pixel,
+// so it needs twice the memory of the image and touches every byte
+// twice. Here each scanline is decoded into a single scratch row,
+// which is deinterleaved into the image's three planes straight away,
+// 16 pixels at a time if the CPU has SSSE3.
+//
+// Anything that isn't a non-interlaced 8-bit RGB PNG is handed to the
+// general loader instead. That includes gray and RGBA PNGs, which the
+// pipeline has variants for too. 16-bit PNGs would lose their low bits
+// that way, so they're loaded into a 16-bit Image with load_image16.
+//
+// For the interleaved variants of the pipeline there's also an
+// InterleavedImage, which keeps the three channels of each pixel
+// together the way PNG does, so PNG rows are read and written in
+// place with no conversion at all.
+//
+// PNGs are saved with the parallel encoder in png_encoder.h.
+//
+// Raw frames (.raw, see raw_frame.h) are loaded and saved here too,
+// with a single copy and no decoding. Code that can keep a RawFrame
+// around instead of an Image avoids even that.
+
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include "Halide.h"
+#include "halide_image_io.h"
+#include "raw_frame.h"
+#ifndef HALIDE_NOPNG
+#include "png_encoder.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// The build only assumes SSE2, as the SSE2 variant of the pipeline
+// does, so the SSSE3 code is compiled for SSSE3 specifically and only
+// used after checking the CPU supports it.
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define IMAGE_IO_SSSE3
+#define IMAGE_IO_TARGET_SSSE3
+inline bool cpu_has_ssse3() {
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+}
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define IMAGE_IO_SSSE3
+#define IMAGE_IO_TARGET_SSSE3 __attribute__((target("ssse3")))
+inline bool cpu_has_ssse3() {
+	return __builtin_cpu_supports("ssse3");
+}
+#endif
+
+#ifdef IMAGE_IO_SSSE3
+// Deinterleave as many whole groups of 16 pixels as fit in width, and
+// return how many pixels were done.
+IMAGE_IO_TARGET_SSSE3
+inline int deinterleave_rgb_ssse3(const uint8_t *src, int width, uint8_t *r, uint8_t *g, uint8_t *b) {
+	int x = 0;
+	// Byte j of channel ch of a group of 16 pixels is byte 3 * j + ch
+	// of the 48 bytes loaded, which is in register (3 * j + ch) / 16.
+	// Build one shuffle per channel and register that picks those
+	// bytes out and zeroes the rest; ORing the three shuffles of a
+	// channel together gives its 16 values.
+	alignas(16) uint8_t masks[3][3][16];
+	for (int ch = 0; ch < 3; ch++) {
+		for (int k = 0; k < 3; k++) {
+			for (int j = 0; j < 16; j++) {
+				int s = 3 * j + ch;
+				masks[ch][k][j] = s / 16 == k ? (uint8_t)(s % 16) : 0x80;
+			}
+		}
+	}
+	uint8_t *planes[3] = { r, g, b };
+	for (; x + 16 <= width; x += 16) {
+		__m128i v[3];
+		for (int k = 0; k < 3; k++) {
+			v[k] = _mm_loadu_si128((const __m128i *)(src + 3 * x + 16 * k));
+		}
+		for (int ch = 0; ch < 3; ch++) {
+			__m128i out = _mm_setzero_si128();
+			for (int k = 0; k < 3; k++) {
+				out = _mm_or_si128(out, _mm_shuffle_epi8(v[k], _mm_load_si128((const __m128i *)masks[ch][k])));
+			}
+			_mm_storeu_si128((__m128i *)(planes[ch] + x), out);
+		}
+	}
+	return x;
+}
+#endif
+
+// Split a row of width interleaved RGB pixels into three planes.
+inline void deinterleave_rgb(const uint8_t *src, int width, uint8_t *r, uint8_t *g, uint8_t *b) {
+	int x = 0;
+#ifdef IMAGE_IO_SSSE3
+	static const bool ssse3 = cpu_has_ssse3();
+	if (ssse3) {
+		x = deinterleave_rgb_ssse3(src, width, r, g, b);
+	}
+#endif
+	for (; x < width; x++) {
+		r[x] = src[3 * x + 0];
+		g[x] = src[3 * x + 1];
+		b[x] = src[3 * x + 2];
+	}
+}
+
+inline bool is_raw_filename(const std::string &filename) {
+	return Halide::Tools::Internal::ends_with_ignore_case(filename, ".raw");
+}
+
+// Map a raw frame of 8-bit pixels.
+inline bool open_raw_rgb(const std::string &filename, RawFrame *frame) {
+	if (!frame->open(filename)) {
+		return false;
+	}
+	if (!frame->is_uint8() || frame->dimensions() != 3) {
+		printf("%s is not an 8-bit image\n", filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Load an RGB image for MyPipeline. PNGs are decoded a row at a time
+// as described above, and raw frames copied out of the mapped file;
+// anything else goes through Halide::Tools::load. Returns false, after
+// printing why, if the file can't be loaded.
+inline bool load_rgb(const std::string &filename, Halide::Image<uint8_t> *im) {
+	using Halide::Tools::Internal::ends_with_ignore_case;
+	if (is_raw_filename(filename)) {
+		RawFrame frame;
+		if (!open_raw_rgb(filename, &frame)) {
+			return false;
+		}
+		*im = Halide::Image<uint8_t>(frame.width(), frame.height(), frame.channels());
+		copy_pixels(frame.raw_buffer(), im->raw_buffer());
+		return true;
+	}
+	if (!ends_with_ignore_case(filename, ".png")) {
+		return Halide::Tools::load(filename, im);
+	}
+
+#ifdef HALIDE_NOPNG
+	return false;
+#else
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (!f) {
+		printf("File %s could not be opened for reading\n", filename.c_str());
+		return false;
+	}
+	png_byte header[8];
+	if (fread(header, 1, 8, f) != 8 || png_sig_cmp(header, 0, 8)) {
+		printf("File %s is not recognized as a PNG file\n", filename.c_str());
+		fclose(f);
+		return false;
+	}
+
+	png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	if (!info_ptr) {
+		png_destroy_read_struct(&png_ptr, NULL, NULL);
+		fclose(f);
+		return false;
+	}
+
+	auto fail = [&]() {
+		printf("Error reading %s\n", filename.c_str());
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(f);
+		return false;
+	};
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		return fail();
+	}
+
+	png_init_io(png_ptr, f);
+	png_set_sig_bytes(png_ptr, 8);
+	png_read_info(png_ptr, info_ptr);
+
+	int width = png_get_image_width(png_ptr, info_ptr);
+	int height = png_get_image_height(png_ptr, info_ptr);
+	if (png_get_color_type(png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB ||
+	    png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+	    png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(f);
+		return Halide::Tools::load(filename, im);
+	}
+
+	*im = Halide::Image<uint8_t>(width, height, 3);
+	std::vector<uint8_t> row(png_get_rowbytes(png_ptr, info_ptr));
+
+	// Set the error handler again, now that nothing it can see will
+	// change before libpng jumps to it.
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		return fail();
+	}
+
+	uint8_t *data = im->data();
+	int plane = im->stride(2);
+	for (int y = 0; y < height; y++) {
+		png_read_row(png_ptr, row.data(), NULL);
+		uint8_t *dst = data + y * im->stride(1);
+		deinterleave_rgb(row.data(), width, dst, dst + plane, dst + 2 * plane);
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(f);
+	im->set_host_dirty();
+	return true;
+#endif
+}
+
+// The bit depth of the values in a PNG, read from its header: 8 or 16,
+// or less for palette and low-depth gray images. 0 if it isn't a PNG.
+inline int png_bit_depth(const std::string &filename) {
+	uint8_t header[26];
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (!f) {
+		return 0;
+	}
+	bool ok = fread(header, 1, sizeof(header), f) == sizeof(header) &&
+	          memcmp(header, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(header + 12, "IHDR", 4) == 0;
+	fclose(f);
+	return ok ? header[24] : 0;
+}
+
+// Load an image keeping 16-bit values, for the 16-bit variants.
+// 8-bit images are scaled up to 16 bits.
+inline bool load_image16(const std::string &filename, Halide::Image<uint16_t> *im) {
+	return Halide::Tools::load(filename, im);
+}
+
+// Save an image as Halide::Tools::save does, except that PNGs go
+// through the parallel encoder in png_encoder.h, with the settings in
+// png_encode_config(), and raw frames are supported too.
+inline bool save_rgb(Halide::Image<uint8_t> im, const std::string &filename) {
+	if (is_raw_filename(filename)) {
+		return save_raw_frame(im.raw_buffer(), filename);
+	}
+#ifndef HALIDE_NOPNG
+	if (Halide::Tools::Internal::ends_with_ignore_case(filename, ".png")) {
+		return save_png_parallel(im.raw_buffer(), filename);
+	}
+#endif
+	return Halide::Tools::save(im, filename);
+}
+
+// 16-bit images are saved as 16-bit PNGs by Halide::Tools::save.
+inline bool save_rgb(Halide::Image<uint16_t> im, const std::string &filename) {
+	return Halide::Tools::save(im, filename);
+}
+
+// An RGB image with the channels of each pixel next to each other in
+// memory, for the halide_test_interleaved variants. raw_buffer()
+// describes it to Halide as an ordinary x, y, c image that happens to
+// have a stride of 3 in x and 1 in c. Copies share the same pixels.
+class InterleavedImage {
+public:
+	InterleavedImage() : buf() {}
+
+	InterleavedImage(int width, int height) : storage(3, width, height), buf() {
+		buf.host = storage.data();
+		buf.extent[0] = width;
+		buf.extent[1] = height;
+		buf.extent[2] = 3;
+		buf.stride[0] = 3;
+		buf.stride[1] = 3 * width;
+		buf.stride[2] = 1;
+		buf.elem_size = 1;
+		buf.host_dirty = true;
+	}
+
+	int width() const { return buf.extent[0]; }
+	int height() const { return buf.extent[1]; }
+	int channels() const { return buf.extent[2]; }
+
+	uint8_t *data() { return buf.host; }
+	uint8_t *row(int y) { return buf.host + y * buf.stride[1]; }
+	buffer_t *raw_buffer() { return &buf; }
+
+	uint8_t &operator()(int x, int y, int c) {
+		return buf.host[x * 3 + y * buf.stride[1] + c];
+	}
+
+private:
+	Halide::Image<uint8_t> storage;
+	buffer_t buf;
+};
+
+// Convert between the two layouts.
+inline InterleavedImage interleave(Halide::Image<uint8_t> planar) {
+	InterleavedImage im(planar.width(), planar.height());
+	for (int y = 0; y < im.height(); y++) {
+		uint8_t *dst = im.row(y);
+		for (int x = 0; x < im.width(); x++) {
+			for (int c = 0; c < 3; c++) {
+				*dst++ = planar(x, y, c);
+			}
+		}
+	}
+	return im;
+}
+
+inline Halide::Image<uint8_t> deinterleave(InterleavedImage im) {
+	Halide::Image<uint8_t> planar(im.width(), im.height(), 3);
+	int plane = planar.stride(2);
+	for (int y = 0; y < im.height(); y++) {
+		uint8_t *dst = planar.data() + y * planar.stride(1);
+		deinterleave_rgb(im.row(y), im.width(), dst, dst + plane, dst + 2 * plane);
+	}
+	return planar;
+}
+
+// Load an RGB image straight into interleaved form. For 8-bit RGB PNGs
+// libpng writes each row directly into the image.
+inline bool load_interleaved(const std::string &filename, InterleavedImage *im) {
+	using Halide::Tools::Internal::ends_with_ignore_case;
+	auto load_planar = [&]() {
+		Halide::Image<uint8_t> planar;
+		if (!Halide::Tools::load(filename, &planar)) {
+			return false;
+		}
+		if (planar.dimensions() != 3 || planar.channels() != 3) {
+			printf("%s is not an RGB image\n", filename.c_str());
+			return false;
+		}
+		*im = interleave(planar);
+		return true;
+	};
+	if (is_raw_filename(filename)) {
+		RawFrame frame;
+		if (!open_raw_rgb(filename, &frame)) {
+			return false;
+		}
+		if (frame.channels() != 3) {
+			printf("%s is not an RGB image\n", filename.c_str());
+			return false;
+		}
+		*im = InterleavedImage(frame.width(), frame.height());
+		copy_pixels(frame.raw_buffer(), im->raw_buffer());
+		return true;
+	}
+	if (!ends_with_ignore_case(filename, ".png")) {
+		return load_planar();
+	}
+
+#ifdef HALIDE_NOPNG
+	return false;
+#else
+	FILE *f = fopen(filename.c_str(), "rb");
+	if (!f) {
+		printf("File %s could not be opened for reading\n", filename.c_str());
+		return false;
+	}
+	png_byte header[8];
+	if (fread(header, 1, 8, f) != 8 || png_sig_cmp(header, 0, 8)) {
+		printf("File %s is not recognized as a PNG file\n", filename.c_str());
+		fclose(f);
+		return false;
+	}
+
+	png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	if (!info_ptr) {
+		png_destroy_read_struct(&png_ptr, NULL, NULL);
+		fclose(f);
+		return false;
+	}
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		printf("Error reading %s\n", filename.c_str());
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(f);
+		return false;
+	}
+
+	png_init_io(png_ptr, f);
+	png_set_sig_bytes(png_ptr, 8);
+	png_read_info(png_ptr, info_ptr);
+
+	int width = png_get_image_width(png_ptr, info_ptr);
+	int height = png_get_image_height(png_ptr, info_ptr);
+	if (png_get_color_type(png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB ||
+	    png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+	    png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(f);
+		return load_planar();
+	}
+
+	// Nothing the error handler looks at changes from here on, so it
+	// doesn't need to be set again.
+	*im = InterleavedImage(width, height);
+	for (int y = 0; y < height; y++) {
+		png_read_row(png_ptr, im->row(y), NULL);
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(f);
+	return true;
+#endif
+}
+
+// Save an interleaved image. PNGs go through the parallel encoder,
+// which takes the rows as they are, raw frames are written
+// interleaved, and other formats go through Halide::Tools::save.
+inline bool save_interleaved(InterleavedImage im, const std::string &filename) {
+	using Halide::Tools::Internal::ends_with_ignore_case;
+	if (is_raw_filename(filename)) {
+		return save_raw_frame(im.raw_buffer(), filename);
+	}
+#ifndef HALIDE_NOPNG
+	if (ends_with_ignore_case(filename, ".png")) {
+		return save_png_parallel(im.raw_buffer(), filename);
+	}
+#endif
+	Halide::Image<uint8_t> planar = deinterleave(im);
+	return Halide::Tools::save(planar, filename);
+}
+
+#endif
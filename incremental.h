@@ -0,0 +1,173 @@
+// Incremental updates of an edited image.
+//
+// An editor that re-runs the pipeline over the whole frame after every
+// brush stroke pays for the whole frame each time, however small the
+// stroke. Each output pixel of MyPipeline only depends on the input
+// pixel under it and its four neighbours, so when part of the input
+// changes, only the output within one pixel of the change needs to be
+// recomputed. IncrementalPipeline takes the rectangles of the input
+// that changed, grows each by that one-pixel halo, and runs the
+// pipeline over just those regions, each one a crop of the existing
+// output buffer (see crop_buffer), so everything else in the output is
+// left as it was.
+//
+// Every region is a separate call, with its own fixed cost (waking the
+// thread pool, or a kernel launch and two copies on the GPU), so a
+// stroke's many small rectangles are first coalesced: rectangles that
+// overlap or nearly touch are replaced by their bounding box. Once the
+// regions would cover most of the frame, it's cheaper to recompute the
+// whole of it in one call.
+
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "aot_variants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <vector>
+
+// A rectangle of pixels, in the image's coordinates.
+struct DirtyRect {
+	int x, y, width, height;
+
+	int right() const { return x + width; }
+	int bottom() const { return y + height; }
+	long long area() const { return (long long)width * height; }
+};
+
+struct IncrementalConfig {
+	// Rectangles no more than this many pixels apart, in both x and y,
+	// are merged into one.
+	int merge_distance = 8;
+
+	// Once the regions cover this fraction of the frame, the whole
+	// frame is recomputed instead.
+	double full_frame_fraction = 0.5;
+
+	// The smallest region. The schedules split x and y into vectors,
+	// strips and tiles, of up to 16 by default, and Halide needs the
+	// output to be at least as big as each split, so smaller regions
+	// are grown to this size.
+	int min_width = 16, min_height = 16;
+};
+
+// Grow [*begin, *begin + *extent) to at least min, within [0, size).
+inline void grow_range(int *begin, int *extent, int min, int size) {
+	if (*extent >= min) {
+		return;
+	}
+	int grown = std::min(min, size);
+	*begin = std::max(0, std::min(*begin - (grown - *extent) / 2, size - grown));
+	*extent = grown;
+}
+
+// The regions of a width x height output to recompute after the input
+// changed within dirty: each rectangle grown by the halo (and to the
+// smallest region) and clipped to the image, with nearby ones merged.
+// Empty if nothing changed.
+inline std::vector<DirtyRect> coalesce_dirty_rects(const std::vector<DirtyRect> &dirty, int width, int height,
+                                                   const IncrementalConfig &config = IncrementalConfig()) {
+	std::vector<DirtyRect> rects;
+	for (const DirtyRect &d : dirty) {
+		int x0 = std::max(d.x - 1, 0), y0 = std::max(d.y - 1, 0);
+		int x1 = std::min(d.right() + 1, width), y1 = std::min(d.bottom() + 1, height);
+		if (x0 < x1 && y0 < y1) {
+			DirtyRect r = { x0, y0, x1 - x0, y1 - y0 };
+			grow_range(&r.x, &r.width, config.min_width, width);
+			grow_range(&r.y, &r.height, config.min_height, height);
+			rects.push_back(r);
+		}
+	}
+
+	// Merge pairs until no two are close. Each merge leaves one fewer
+	// rectangle, and a stroke only has a handful, so the quadratic
+	// search is cheap.
+	bool merged = true;
+	while (merged) {
+		merged = false;
+		for (size_t i = 0; i < rects.size() && !merged; i++) {
+			for (size_t j = i + 1; j < rects.size() && !merged; j++) {
+				const DirtyRect &a = rects[i], &b = rects[j];
+				int gap_x = std::max(a.x - b.right(), b.x - a.right());
+				int gap_y = std::max(a.y - b.bottom(), b.y - a.bottom());
+				if (gap_x <= config.merge_distance && gap_y <= config.merge_distance) {
+					int x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+					int x1 = std::max(a.right(), b.right()), y1 = std::max(a.bottom(), b.bottom());
+					rects[i] = { x0, y0, x1 - x0, y1 - y0 };
+					rects.erase(rects.begin() + j);
+					merged = true;
+				}
+			}
+		}
+	}
+
+	long long area = 0;
+	for (const DirtyRect &r : rects) {
+		area += r.area();
+	}
+	if (!rects.empty() && area >= config.full_frame_fraction * width * height) {
+		rects.assign(1, { 0, 0, width, height });
+	}
+	return rects;
+}
+
+class IncrementalPipeline {
+public:
+	// Runs the pipeline over all of output, from input, as run_variant
+	// does.
+	typedef std::function<int(buffer_t *input, buffer_t *output)> Runner;
+
+	IncrementalPipeline(Runner run, const IncrementalConfig &config = IncrementalConfig()) :
+		run(run), config(config) {}
+
+	// An incremental pipeline for an ahead-of-time variant.
+	IncrementalPipeline(const AotVariant &variant, const IncrementalConfig &config = IncrementalConfig()) :
+		run([variant](buffer_t *in, buffer_t *out) { return run_variant(variant, in, out); }), config(config) {}
+
+	// Bring output, the result of an earlier run, up to date with
+	// input, which has since changed within dirty. Both are whole
+	// images of the same size.
+	int update(buffer_t *input, buffer_t *output, const std::vector<DirtyRect> &dirty) {
+		auto t0 = std::chrono::steady_clock::now();
+		int width = output->extent[0], height = output->extent[1];
+		std::vector<DirtyRect> regions = coalesce_dirty_rects(dirty, width, height, config);
+		for (const DirtyRect &r : regions) {
+			// The region of output, and the input under it with the
+			// halo, where there is one. At the edges of the image the
+			// crop ends where the image does, so the pipeline clamps
+			// there just as it would for the whole frame.
+			buffer_t out = crop_buffer(crop_buffer(*output, 0, r.x, r.width), 1, r.y, r.height);
+			int x0 = std::max(r.x - 1, 0), y0 = std::max(r.y - 1, 0);
+			int x1 = std::min(r.right() + 1, width), y1 = std::min(r.bottom() + 1, height);
+			buffer_t in = crop_buffer(crop_buffer(*input, 0, x0, x1 - x0), 1, y0, y1 - y0);
+			in.host_dirty = true;
+			int result = run(&in, &out);
+			if (result != 0) {
+				return result;
+			}
+			pixels += r.area();
+		}
+		updates++;
+		calls += regions.size();
+		frame_pixels += (long long)width * height;
+		ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		return 0;
+	}
+
+	void print_stats() const {
+		printf("Incremental updates: %lld, %1.1f regions and %1.3f ms each, recomputing %1.2f%% of the frame\n",
+			updates, updates ? (double)calls / updates : 0.0, updates ? ms / updates : 0.0,
+			frame_pixels ? 100.0 * pixels / frame_pixels : 0.0);
+	}
+
+private:
+	Runner run;
+	IncrementalConfig config;
+	long long updates = 0, calls = 0, pixels = 0, frame_pixels = 0;
+	double ms = 0;
+};
+
+#endif
@@ -0,0 +1,236 @@
+// A persistent on-disk cache of compiled pipelines, for the modes
+// where we'd otherwise call compile_jit on every run.
+//
+// JIT-compiled code can't be saved, so instead the pipeline is
+// compiled to an object file for the same target (with its own copy
+// of the runtime), linked into a shared library in the cache
+// directory, and loaded from there. The library is named after a
+// hash of the lowered pipeline, which covers both the algorithm and
+// its schedule, of the schedule's name, and of the target string, so
+// any change to one of them compiles a fresh copy and the next run
+// with the same pipeline just loads it.
+//
+// Each library has a runtime of its own, separate from the one the
+// ahead-of-time variants link, so hooks installed there (arena.h's
+// allocator, thread_pool.h's parallel loops) don't reach it, and
+// Func::set_custom_allocator and set_custom_do_par_for only apply to
+// compile_jit. Hooks given to the cache with its own
+// set_custom_allocator and set_custom_do_par_for are installed into
+// every library it loads, through the runtime's own setters for them,
+// which the default link commands export.
+//
+// The shared library is linked by running the command in
+// HL_JIT_CACHE_LINK if it is set (with %o replaced by the output
+// library and %i by the input object), or the platform's default
+// linker otherwise. On Windows that needs link.exe on the PATH.
+
+#ifndef JIT_CACHE_H
+#define JIT_CACHE_H
+
+#include "Halide.h"
+#include "HalideRuntime.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class JitCache {
+public:
+	typedef int (*Pipeline)(buffer_t *input, buffer_t *output);
+
+	JitCache(const std::string &dir) : dir(dir) {
+#ifdef _WIN32
+		_mkdir(dir.c_str());
+#else
+		mkdir(dir.c_str(), 0755);
+#endif
+	}
+
+	// Have the runtime of every library loaded from now on allocate
+	// with malloc_fn and free_fn.
+	void set_custom_allocator(halide_malloc_t malloc_fn, halide_free_t free_fn) {
+		custom_malloc = malloc_fn;
+		custom_free = free_fn;
+	}
+
+	// Have the parallel loops of every library loaded from now on run
+	// through do_par_for, such as work_stealing_do_par_for.
+	void set_custom_do_par_for(halide_do_par_for_t do_par_for) {
+		custom_do_par_for = do_par_for;
+	}
+
+	// Get f compiled for target, taking args, from the cache,
+	// compiling and caching it first if it isn't there yet. schedule
+	// names the schedule f was given. Returns NULL if the library
+	// could not be built or loaded, in which case the caller should
+	// fall back to compile_jit.
+	Pipeline get(Halide::Func f, const std::vector<Halide::Argument> &args,
+	             const std::string &schedule, Halide::Target target) {
+		// Cached code is loaded like any other library, not run
+		// through the JIT.
+		target.set_feature(Halide::Target::JIT, false);
+
+		// Other processes may be using the same directory, so the
+		// statement goes in a file named for this one, where they
+		// can't overwrite it before it's hashed.
+		std::string stmt = dir + "/pending." + std::to_string(process_id()) + ".stmt";
+		f.compile_to_lowered_stmt(stmt, args, Halide::Text, target);
+		uint64_t h = hash(read_file(stmt));
+		remove(stmt.c_str());
+		h = hash(schedule, h);
+		h = hash(target.to_string(), h);
+
+		char key[32];
+		snprintf(key, sizeof(key), "%016llx", (unsigned long long)h);
+		std::string fn_name = "curved_" + std::string(key);
+		std::string lib = dir + "/" + fn_name + library_suffix();
+
+		void *handle = open_library(lib);
+		if (handle) {
+			printf("Loaded %s from the JIT cache\n", schedule.c_str());
+		}
+		else {
+			std::string obj = dir + "/" + fn_name + object_suffix();
+			f.compile_to_object(obj, args, fn_name, target);
+			int result = system(link_command(lib, obj, fn_name).c_str());
+			remove(obj.c_str());
+			if (result != 0) {
+				printf("Could not link %s\n", lib.c_str());
+				return NULL;
+			}
+			handle = open_library(lib);
+			if (!handle) {
+				printf("Could not load %s\n", lib.c_str());
+				return NULL;
+			}
+			printf("Compiled %s into the JIT cache\n", schedule.c_str());
+		}
+		install_hooks(handle, lib);
+		return (Pipeline)find_symbol(handle, fn_name);
+	}
+
+private:
+	std::string dir;
+	halide_malloc_t custom_malloc = NULL;
+	halide_free_t custom_free = NULL;
+	halide_do_par_for_t custom_do_par_for = NULL;
+
+	// The runtime functions install_hooks calls, which the library has
+	// to export.
+	static std::vector<std::string> runtime_exports() {
+		return { "halide_set_custom_malloc", "halide_set_custom_free", "halide_set_custom_do_par_for" };
+	}
+
+	// Point the library's runtime at this cache's hooks. A library
+	// linked by an HL_JIT_CACHE_LINK command that doesn't export the
+	// setters keeps its own, and says so.
+	void install_hooks(void *handle, const std::string &lib) {
+		if (custom_malloc) {
+			auto set_malloc = (halide_malloc_t (*)(halide_malloc_t))find_symbol(handle, "halide_set_custom_malloc");
+			auto set_free = (halide_free_t (*)(halide_free_t))find_symbol(handle, "halide_set_custom_free");
+			if (set_malloc && set_free) {
+				set_malloc(custom_malloc);
+				set_free(custom_free);
+			}
+			else {
+				printf("%s doesn't export halide_set_custom_malloc, so it won't use the custom allocator\n",
+					lib.c_str());
+			}
+		}
+		if (custom_do_par_for) {
+			auto set_do_par_for = (halide_do_par_for_t (*)(halide_do_par_for_t))find_symbol(
+				handle, "halide_set_custom_do_par_for");
+			if (set_do_par_for) {
+				set_do_par_for(custom_do_par_for);
+			}
+			else {
+				printf("%s doesn't export halide_set_custom_do_par_for, so it runs on its own thread pool\n",
+					lib.c_str());
+			}
+		}
+	}
+
+	// 64-bit FNV-1a, chained through h.
+	static uint64_t hash(const std::string &s, uint64_t h = 14695981039346656037ULL) {
+		for (size_t i = 0; i < s.size(); i++) {
+			h ^= (uint8_t)s[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	static std::string read_file(const std::string &filename) {
+		std::ifstream f(filename.c_str(), std::ios::binary);
+		std::stringstream contents;
+		contents << f.rdbuf();
+		return contents.str();
+	}
+
+	static std::string link_command(const std::string &lib, const std::string &obj,
+	                                const std::string &fn_name) {
+		const char *custom = getenv("HL_JIT_CACHE_LINK");
+		if (custom) {
+			std::string cmd = custom;
+			size_t pos;
+			while ((pos = cmd.find("%o")) != std::string::npos) {
+				cmd.replace(pos, 2, lib);
+			}
+			while ((pos = cmd.find("%i")) != std::string::npos) {
+				cmd.replace(pos, 2, obj);
+			}
+			return cmd;
+		}
+#ifdef _WIN32
+		std::string cmd = "link /nologo /DLL /OUT:\"" + lib + "\" \"" + obj + "\" msvcrt.lib kernel32.lib"
+			" /EXPORT:" + fn_name;
+		for (const std::string &name : runtime_exports()) {
+			cmd += " /EXPORT:" + name;
+		}
+		return cmd;
+#else
+		// Everything in a shared object is exported already.
+		(void)fn_name;
+		return "cc -shared -o \"" + lib + "\" \"" + obj + "\" -ldl -lpthread";
+#endif
+	}
+
+#ifdef _WIN32
+	static const char *library_suffix() { return ".dll"; }
+	static const char *object_suffix() { return ".obj"; }
+	static unsigned long process_id() { return GetCurrentProcessId(); }
+	static void *open_library(const std::string &lib) {
+		return (void *)LoadLibraryA(lib.c_str());
+	}
+	static void *find_symbol(void *handle, const std::string &name) {
+		return (void *)GetProcAddress((HMODULE)handle, name.c_str());
+	}
+#else
+	static const char *library_suffix() { return ".so"; }
+	static const char *object_suffix() { return ".o"; }
+	static unsigned long process_id() { return (unsigned long)getpid(); }
+	static void *open_library(const std::string &lib) {
+		return dlopen(lib.c_str(), RTLD_LAZY | RTLD_LOCAL);
+	}
+	static void *find_symbol(void *handle, const std::string &name) {
+		return dlsym(handle, name.c_str());
+	}
+#endif
+};
+
+#endif
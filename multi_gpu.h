@@ -0,0 +1,491 @@
+// Sharding batches and frames across several GPUs.
+//
+// A GPU variant normally runs on one device. The CUDA and OpenCL
+// runtimes each create a single context, on the device
+// halide_get_gpu_device() names when it's first needed, and hold one
+// lock around every call into it, so two threads only take turns on
+// that one device. Choosing a device per user_context, as the
+// runtime's comments suggest, doesn't help once the context exists.
+//
+// So this header replaces the context hooks themselves, which the
+// runtimes leave weak for applications to override:
+// halide_cuda_acquire_context, halide_acquire_cl_context and their
+// release functions. The replacements keep a context per device, and
+// for OpenCL a command queue per device, and hand the runtime the one
+// for the calling thread's thread_gpu() (see ScopedGpu in
+// device_pool.h). Each device has its own lock, so with a thread per
+// device they all run at once, each on its own stream: the context's
+// default stream in CUDA, or the device's command queue in OpenCL.
+//
+// MultiGpu then runs a variant on every device. A batch is split by
+// image, and a frame into horizontal bands, each band's input with a
+// row of halo above and below (see crop_buffer). It reports each
+// device's throughput and that of the whole.
+//
+// The hooks are definitions, not inline functions, so this header can
+// only be included in one file of a program.
+
+#ifndef MULTI_GPU_H
+#define MULTI_GPU_H
+
+#include "aot_variants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+class GpuDevices {
+public:
+	static const int max_devices = 16;
+
+	// How many devices api ("cuda" or "opencl") has. OpenCL counts the
+	// devices of HL_OCL_DEVICE_TYPE on the platform HL_OCL_PLATFORM_NAME
+	// picks, as the runtime would.
+	static int count(const std::string &api) {
+		if (api == "cuda") {
+			return cuda().device_count();
+		}
+		if (api == "opencl") {
+			return opencl().device_count(NULL);
+		}
+		return 0;
+	}
+
+	// The API a GPU variant runs on.
+	static std::string api(const AotVariant &variant) {
+		return variant.device_interface == halide_cuda_device_interface ? "cuda" : "opencl";
+	}
+
+	// The CUDA driver API functions the hooks need.
+	struct Cuda {
+		typedef int (*cuInit_t)(unsigned int flags);
+		typedef int (*cuDeviceGetCount_t)(int *count);
+		typedef int (*cuDeviceGet_t)(int *device, int ordinal);
+		typedef int (*cuCtxCreate_t)(void **context, unsigned int flags, int device);
+		typedef int (*cuCtxPopCurrent_t)(void **context);
+
+		std::once_flag loaded;
+		int count = 0;
+		cuDeviceGet_t cuDeviceGet = NULL;
+		cuCtxCreate_t cuCtxCreate = NULL;
+		cuCtxPopCurrent_t cuCtxPopCurrent = NULL;
+
+		struct Device {
+			std::recursive_mutex lock;
+			void *context = NULL;
+		} devices[max_devices];
+
+		int device_count() {
+			std::call_once(loaded, [this]() {
+				static const char *const names[] = {
+#ifdef _WIN32
+					"nvcuda.dll",
+#elif __APPLE__
+					"/Library/Frameworks/CUDA.framework/CUDA",
+#else
+					"libcuda.so", "libcuda.so.1",
+#endif
+					NULL
+				};
+				void *lib = load_library(names);
+				if (!lib) {
+					return;
+				}
+				cuInit_t cuInit = (cuInit_t)symbol(lib, "cuInit");
+				cuDeviceGetCount_t cuDeviceGetCount = (cuDeviceGetCount_t)symbol(lib, "cuDeviceGetCount");
+				cuDeviceGet = (cuDeviceGet_t)symbol(lib, "cuDeviceGet");
+				cuCtxCreate = (cuCtxCreate_t)symbol(lib, "cuCtxCreate_v2");
+				cuCtxPopCurrent = (cuCtxPopCurrent_t)symbol(lib, "cuCtxPopCurrent_v2");
+				if (!cuInit || !cuDeviceGetCount || !cuDeviceGet || !cuCtxCreate || !cuCtxPopCurrent ||
+				    cuInit(0) != 0 || cuDeviceGetCount(&count) != 0) {
+					count = 0;
+				}
+				count = std::min(count, (int)max_devices);
+			});
+			return count;
+		}
+
+		// Lock the calling thread's device, and return its context,
+		// creating it the first time if create is set. Otherwise a
+		// device without one gives a null context, as the runtime's
+		// release and cleanup paths expect. cuCtxCreate makes the new
+		// context current; the runtime makes it current itself, so
+		// it's popped.
+		int acquire(void **context, bool create) {
+			int n = device_count();
+			if (n == 0) {
+				held().push_back(NULL);
+				return -1;
+			}
+			Device &d = devices[select(n)];
+			d.lock.lock();
+			if (!d.context && create) {
+				int device;
+				void *previous;
+				int error = cuDeviceGet(&device, select(n));
+				if (error == 0) {
+					error = cuCtxCreate(&d.context, 0, device);
+				}
+				if (error != 0) {
+					printf("Could not create a CUDA context on device %d: error %d\n", select(n), error);
+					d.context = NULL;
+					d.lock.unlock();
+					held().push_back(NULL);
+					return error;
+				}
+				cuCtxPopCurrent(&previous);
+			}
+			*context = d.context;
+			held().push_back(&d.lock);
+			return 0;
+		}
+	};
+
+	// The OpenCL functions the hooks need. The handle types are all
+	// pointers, so they're declared as void *.
+	struct OpenCL {
+		typedef int (*clGetPlatformIDs_t)(unsigned int count, void **platforms, unsigned int *found);
+		typedef int (*clGetPlatformInfo_t)(void *platform, unsigned int param, size_t size, void *value, size_t *size_ret);
+		typedef int (*clGetDeviceIDs_t)(void *platform, uint64_t type, unsigned int count, void **devices, unsigned int *found);
+		typedef void *(*clCreateContext_t)(const intptr_t *properties, unsigned int count, void *const *devices,
+		                                   void *notify, void *user_data, int *error);
+		typedef void *(*clCreateCommandQueue_t)(void *context, void *device, uint64_t properties, int *error);
+
+		enum {
+			CL_PLATFORM_NAME = 0x0902,
+			CL_CONTEXT_PLATFORM = 0x1084
+		};
+
+		std::once_flag loaded;
+		void *platform = NULL;
+		std::vector<void *> ids;
+		clCreateContext_t clCreateContext = NULL;
+		clCreateCommandQueue_t clCreateCommandQueue = NULL;
+
+		struct Device {
+			std::recursive_mutex lock;
+			void *context = NULL, *queue = NULL;
+		} devices[max_devices];
+
+		int device_count(void *user_context) {
+			std::call_once(loaded, [this, user_context]() {
+				static const char *const names[] = {
+#ifdef _WIN32
+					"OpenCL.dll",
+#elif __APPLE__
+					"/System/Library/Frameworks/OpenCL.framework/Versions/Current/OpenCL",
+#else
+					"libOpenCL.so", "libOpenCL.so.1",
+#endif
+					NULL
+				};
+				void *lib = load_library(names);
+				if (!lib) {
+					return;
+				}
+				clGetPlatformIDs_t clGetPlatformIDs = (clGetPlatformIDs_t)symbol(lib, "clGetPlatformIDs");
+				clGetPlatformInfo_t clGetPlatformInfo = (clGetPlatformInfo_t)symbol(lib, "clGetPlatformInfo");
+				clGetDeviceIDs_t clGetDeviceIDs = (clGetDeviceIDs_t)symbol(lib, "clGetDeviceIDs");
+				clCreateContext = (clCreateContext_t)symbol(lib, "clCreateContext");
+				clCreateCommandQueue = (clCreateCommandQueue_t)symbol(lib, "clCreateCommandQueue");
+				if (!clGetPlatformIDs || !clGetPlatformInfo || !clGetDeviceIDs ||
+				    !clCreateContext || !clCreateCommandQueue) {
+					return;
+				}
+
+				// The first platform whose name contains the one asked
+				// for, or the first platform.
+				void *platforms[max_devices];
+				unsigned int platform_count = 0;
+				if (clGetPlatformIDs(max_devices, platforms, &platform_count) != 0 || platform_count == 0) {
+					return;
+				}
+				platform_count = std::min(platform_count, (unsigned int)max_devices);
+				const char *wanted = halide_opencl_get_platform_name(user_context);
+				platform = platforms[0];
+				for (unsigned int i = 0; wanted && *wanted && i < platform_count; i++) {
+					char name[256] = "";
+					clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, sizeof(name) - 1, name, NULL);
+					if (strstr(name, wanted)) {
+						platform = platforms[i];
+						break;
+					}
+				}
+
+				const char *type_name = halide_opencl_get_device_type(user_context);
+				uint64_t type = 0xFFFFFFFF;  // CL_DEVICE_TYPE_ALL
+				if (type_name && strstr(type_name, "cpu")) {
+					type = 1 << 1;
+				}
+				else if (type_name && strstr(type_name, "gpu")) {
+					type = 1 << 2;
+				}
+				else if (type_name && strstr(type_name, "acc")) {
+					type = 1 << 3;
+				}
+				void *found[max_devices];
+				unsigned int device_count = 0;
+				if (clGetDeviceIDs(platform, type, max_devices, found, &device_count) == 0) {
+					ids.assign(found, found + std::min(device_count, (unsigned int)max_devices));
+				}
+			});
+			return (int)ids.size();
+		}
+
+		// Lock the calling thread's device, and return its context and
+		// command queue, creating them the first time if create is set,
+		// and null ones otherwise, as for CUDA.
+		int acquire(void *user_context, void **context, void **queue, bool create) {
+			int n = device_count(user_context);
+			if (n == 0) {
+				held().push_back(NULL);
+				return -1;
+			}
+			Device &d = devices[select(n)];
+			d.lock.lock();
+			if (!d.context && create) {
+				intptr_t properties[] = { CL_CONTEXT_PLATFORM, (intptr_t)platform, 0 };
+				int error = 0;
+				d.context = clCreateContext(properties, 1, &ids[select(n)], NULL, NULL, &error);
+				if (error == 0) {
+					d.queue = clCreateCommandQueue(d.context, ids[select(n)], 0, &error);
+				}
+				if (error != 0) {
+					printf("Could not create an OpenCL context on device %d: error %d\n", select(n), error);
+					d.context = d.queue = NULL;
+					d.lock.unlock();
+					held().push_back(NULL);
+					return error;
+				}
+			}
+			*context = d.context;
+			*queue = d.queue;
+			held().push_back(&d.lock);
+			return 0;
+		}
+	};
+
+	static Cuda &cuda() {
+		static Cuda c;
+		return c;
+	}
+
+	static OpenCL &opencl() {
+		static OpenCL c;
+		return c;
+	}
+
+	// Unlock the device the calling thread last acquired. The runtime
+	// releases after every acquire, even one that failed, so failures
+	// are held as NULL, with nothing to unlock.
+	static void release() {
+		std::vector<std::recursive_mutex *> &locks = held();
+		if (!locks.empty()) {
+			if (locks.back()) {
+				locks.back()->unlock();
+			}
+			locks.pop_back();
+		}
+	}
+
+private:
+	// The device calls from this thread go to, of count: thread_gpu(),
+	// or by default HL_GPU_DEVICE, or else the last device.
+	static int select(int count) {
+		int gpu = thread_gpu();
+		if (gpu < 0) {
+			const char *env = getenv("HL_GPU_DEVICE");
+			gpu = env ? atoi(env) : -1;
+		}
+		return gpu >= 0 && gpu < count ? gpu : count - 1;
+	}
+
+	// The device locks this thread holds, innermost last.
+	static std::vector<std::recursive_mutex *> &held() {
+		static thread_local std::vector<std::recursive_mutex *> locks;
+		return locks;
+	}
+
+	static void *load_library(const char *const *names) {
+		for (; *names; names++) {
+#ifdef _WIN32
+			void *lib = (void *)LoadLibraryA(*names);
+#else
+			void *lib = dlopen(*names, RTLD_LAZY);
+#endif
+			if (lib) {
+				return lib;
+			}
+		}
+		return NULL;
+	}
+
+	static void *symbol(void *lib, const char *name) {
+#ifdef _WIN32
+		return (void *)GetProcAddress((HMODULE)lib, name);
+#else
+		return dlsym(lib, name);
+#endif
+	}
+};
+
+// The runtime's context hooks. Each acquire is followed by a release
+// on the same thread, which unlocks the device again. create is false
+// when the runtime only wants a context that already exists, to free
+// memory or release the context.
+extern "C" int halide_cuda_acquire_context(void *, void **context, bool create) {
+	return GpuDevices::cuda().acquire(context, create);
+}
+
+extern "C" int halide_cuda_release_context(void *) {
+	GpuDevices::release();
+	return 0;
+}
+
+extern "C" int halide_acquire_cl_context(void *user_context, void **context, void **queue, bool create) {
+	return GpuDevices::opencl().acquire(user_context, context, queue, create);
+}
+
+extern "C" int halide_release_cl_context(void *) {
+	GpuDevices::release();
+	return 0;
+}
+
+class MultiGpu {
+public:
+	// Run variant on the first devices of its API, or all of them if
+	// devices is 0.
+	MultiGpu(const AotVariant &variant, int devices = 0) : variant(variant) {
+		int available = variant.on_gpu ? GpuDevices::count(GpuDevices::api(variant)) : 0;
+		count = available ? (devices > 0 ? std::min(devices, available) : available) : 1;
+		stats.resize(count);
+	}
+
+	int devices() const { return count; }
+
+	// Process input into output, as run_variant does, with a share on
+	// each device. With batch, both are four-dimensional batches,
+	// split by image.
+	int run(buffer_t *input, buffer_t *output, bool batch = false) {
+		int dim = batch ? 3 : 1;
+		int total = output->extent[dim];
+		int shards = std::max(1, std::min(count, total));
+		AotPipeline pipeline = batch ? variant.batch_pipeline : format_pipeline(variant, input);
+		if (!pipeline) {
+			return -1;
+		}
+
+		std::vector<Shard> parts(shards);
+		for (int i = 0; i < shards; i++) {
+			Shard &s = parts[i];
+			int begin = (int)((long long)total * i / shards);
+			int end = (int)((long long)total * (i + 1) / shards);
+			s.out = crop_buffer(*output, dim, begin, end - begin);
+			if (batch) {
+				s.in = crop_buffer(*input, dim, begin, end - begin);
+			}
+			else {
+				// The band's rows, and the halo sharpen needs.
+				int top = std::max(begin - 1, 0), bottom = std::min(end + 1, input->extent[1]);
+				s.in = crop_buffer(*input, dim, top, bottom - top);
+			}
+			s.in.host_dirty = true;
+			s.units = end - begin;
+		}
+
+		auto work = [&](int i) {
+			ScopedGpu gpu(i);
+			auto t0 = std::chrono::steady_clock::now();
+			parts[i].result = run_variant(variant, pipeline, &parts[i].in, &parts[i].out);
+			parts[i].ms = elapsed_ms(t0);
+		};
+		auto t0 = std::chrono::steady_clock::now();
+		if (!warmed.count(pipeline)) {
+			// The first call of each pipeline on a device compiles its
+			// kernels there, which adds to a list of them the runtime
+			// shares between devices, so the first round runs one
+			// device at a time.
+			for (int i = 0; i < shards; i++) {
+				work(i);
+			}
+			warmed.insert(pipeline);
+		}
+		else {
+			std::vector<std::thread> threads;
+			for (int i = 1; i < shards; i++) {
+				threads.emplace_back(work, i);
+			}
+			work(0);
+			for (std::thread &t : threads) {
+				t.join();
+			}
+		}
+		double wall = elapsed_ms(t0);
+
+		double pixels_per_unit = (double)output->extent[0] * (batch ? output->extent[1] : 1);
+		for (int i = 0; i < shards; i++) {
+			if (parts[i].result != 0) {
+				return parts[i].result;
+			}
+			stats[i].megapixels += parts[i].units * pixels_per_unit / 1e6;
+			stats[i].ms += parts[i].ms;
+		}
+		calls++;
+		wall_ms += wall;
+		total_megapixels += total * pixels_per_unit / 1e6;
+		return 0;
+	}
+
+	// Each device's throughput while it was busy, and the throughput of
+	// them all together, compared with the mean of one on its own.
+	void print_stats() const {
+		double sum_rate = 0;
+		int busy = 0;
+		for (int i = 0; i < count; i++) {
+			const DeviceStats &s = stats[i];
+			double rate = s.ms > 0 ? s.megapixels / (s.ms / 1000) : 0;
+			printf("  %s device %d: %1.1f megapixels in %1.1f ms, %1.1f megapixels/second\n",
+				variant.name, i, s.megapixels, s.ms, rate);
+			if (rate > 0) {
+				sum_rate += rate;
+				busy++;
+			}
+		}
+		double rate = wall_ms > 0 ? total_megapixels / (wall_ms / 1000) : 0;
+		printf("  %d devices over %lld calls: %1.1f megapixels/second, %1.2fx one device\n",
+			count, calls, rate, busy ? rate / (sum_rate / busy) : 0.0);
+	}
+
+private:
+	struct Shard {
+		buffer_t in, out;
+		int units = 0;
+		int result = 0;
+		double ms = 0;
+	};
+
+	struct DeviceStats {
+		double megapixels = 0, ms = 0;
+	};
+
+	AotVariant variant;
+	int count;
+	std::set<AotPipeline> warmed;
+	std::vector<DeviceStats> stats;
+	long long calls = 0;
+	double wall_ms = 0, total_megapixels = 0;
+
+	static double elapsed_ms(std::chrono::steady_clock::time_point t0) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	}
+};
+
+#endif
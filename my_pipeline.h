@@ -0,0 +1,621 @@
+// The sharpen + LUT pipeline from Halide tutorial lesson 12.
+//
+// The algorithm and its schedules live in this header so that the
+// JIT test harness (halide_test.cpp) and the ahead-of-time generator
+// (halide_test_generator.cpp) share a single definition. Neither
+// schedule compiles the pipeline; the caller either JIT-compiles
+// curved or returns it from a Generator.
+//
+// The input is an ImageParam, so one compiled pipeline processes any
+// number of images of any size. It can be three-dimensional (one
+// image) or four-dimensional (a batch of same-sized images). The
+// number of channels (1, 3 or 4) and the type of the values (uint8 or
+// uint16) are fixed when the pipeline is constructed, so each format
+// gets its own compiled pipeline with the channels unrolled; see
+// AotVariant::formats for the ahead-of-time ones.
+
+#ifndef MY_PIPELINE_H
+#define MY_PIPELINE_H
+
+#include "Halide.h"
+
+#include <algorithm>
+#include <math.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+
+// Where a producer is computed relative to curved. Not every
+// placement makes sense for every Func or every schedule; see
+// schedule_for_cpu() and schedule_for_gpu().
+enum Placement {
+	Inline,    // Computed wherever it's used.
+	Root,      // Computed once, ahead of curved.
+	Strip,     // Per strip of scanlines; padded slides down the strip.
+	Scanline,  // Per scanline of curved.
+	Block      // Per GPU block.
+};
+
+inline const char *placement_name(Placement p) {
+	static const char *names[] = { "inline", "root", "strip", "scanline", "block" };
+	return names[p];
+}
+
+inline bool parse_placement(const std::string &name, Placement *p) {
+	for (int i = Inline; i <= Block; i++) {
+		if (name == placement_name((Placement)i)) {
+			*p = (Placement)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// How curved applies the gamma curve to sharpen. The choice changes
+// the algorithm, not just the schedule, so it's made when MyPipeline
+// is constructed; the generator takes it as its lut_mode parameter.
+enum LutMode {
+	TableLut,       // The tutorial's table over every uint16 sharpen can produce.
+	GatherLut,      // A 256-entry table, looked up a vector of pixels at a time.
+	PolynomialLut   // No table; the curve is evaluated per pixel with fast_pow.
+};
+
+inline const char *lut_mode_name(LutMode m) {
+	static const char *names[] = { "table", "gather", "polynomial" };
+	return names[m];
+}
+
+inline bool parse_lut_mode(const std::string &name, LutMode *m) {
+	for (int i = TableLut; i <= PolynomialLut; i++) {
+		if (name == lut_mode_name((LutMode)i)) {
+			*m = (LutMode)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// PolynomialLut is an approximation, off by one from the table for a
+// few values; the other modes match it exactly.
+inline int lut_tolerance(LutMode m) {
+	return m == PolynomialLut ? 1 : 0;
+}
+
+// The gamma curve as a table, computed once on the host and shared
+// by every MyPipeline, rather than recomputed by every realization of
+// every pipeline (on the GPU, by a kernel launch for 256 values).
+// By default a pipeline embeds the table as a constant when it's
+// compiled, which is what the ahead-of-time variants and the JIT
+// cache's libraries need. A JIT-compiled MyPipeline constructed with
+// gamma_param reads it as an input instead, so changing the exponent
+// takes effect on the next realization without a recompile, and on the
+// GPU the table is copied to the device once and stays there until it
+// changes.
+class GammaLut {
+public:
+	// The table with 256 entries, for GatherLut, or one for every
+	// uint16, for TableLut.
+	static GammaLut &shared(int size) {
+		static GammaLut small(256), full(65536);
+		return size <= 256 ? small : full;
+	}
+
+	static GammaLut &for_mode(LutMode m) {
+		return shared(m == TableLut ? 65536 : 256);
+	}
+
+	// The curve from every uint16 to a uint16, for 16-bit images, in
+	// table16. Every LutMode but PolynomialLut uses it.
+	static GammaLut &wide() {
+		static GammaLut w(65536, 16);
+		return w;
+	}
+
+	// Change the exponent of the curve. The tables are only recomputed
+	// if it actually changes, and are then marked dirty so that GPU
+	// pipelines upload them again. A pipeline running at the time may
+	// see a mix of old and new values, so change it between
+	// realizations.
+	static void set_gamma(float gamma) {
+		shared(256).update(gamma);
+		shared(65536).update(gamma);
+		wide().update(gamma);
+	}
+
+	static float gamma() {
+		return shared(256).exponent;
+	}
+
+	Halide::Image<uint8_t> table;
+	Halide::Image<uint16_t> table16;
+
+private:
+	float exponent = 0;
+
+	GammaLut(int size, int bits = 8) {
+		if (bits == 16) {
+			table16 = Halide::Image<uint16_t>(size, "gamma_lut_16bit");
+		}
+		else {
+			table = Halide::Image<uint8_t>(size, "gamma_lut_" + std::to_string(size));
+		}
+		update(1.2f);
+	}
+
+	void update(float gamma) {
+		if (gamma == exponent) {
+			return;
+		}
+		exponent = gamma;
+		// Values past 255 are past the end of the curve, and clamp
+		// to 255.
+		if (table.defined()) {
+			for (int i = 0; i < table.width(); i++) {
+				float v = powf(i / 255.0f, gamma) * 255.0f;
+				table(i) = (uint8_t)std::min(std::max(v, 0.0f), 255.0f);
+			}
+			table.set_host_dirty();
+		}
+		if (table16.defined()) {
+			for (int i = 0; i < table16.width(); i++) {
+				float v = powf(i / 65535.0f, gamma) * 65535.0f;
+				table16(i) = (uint16_t)std::min(std::max(v, 0.0f), 65535.0f);
+			}
+			table16.set_host_dirty();
+		}
+	}
+};
+
+// The tunable parts of schedule_for_cpu(). The defaults are the
+// hand-picked schedule from the tutorial.
+struct CpuSchedule {
+	int strip_height = 16;
+	int sharpen_vector_width = 8;
+	int padded_vector_width = 16;
+	Placement lut_at = Inline;        // Inline, Root or Strip
+	Placement sharpen_at = Scanline;  // Scanline or Inline
+	Placement padded_at = Strip;      // Strip, Scanline or Inline
+	Placement padded16_at = Inline;   // Inline or Strip
+
+	// The single-pass schedule: padded16 slides down each strip in a
+	// rolling window of rows, feeding sharpen and the LUT inlined into
+	// curved. See schedule_for_cpu().
+	static CpuSchedule sliding_window() {
+		CpuSchedule s;
+		s.padded16_at = Strip;
+		s.sharpen_at = Inline;
+		s.padded_at = Inline;
+		return s;
+	}
+
+	// A "key=value ..." form, for the schedule database in autotune.h.
+	std::string to_string() const {
+		std::ostringstream s;
+		s << "strip_height=" << strip_height
+			<< " sharpen_vector_width=" << sharpen_vector_width
+			<< " padded_vector_width=" << padded_vector_width
+			<< " lut_at=" << placement_name(lut_at)
+			<< " sharpen_at=" << placement_name(sharpen_at)
+			<< " padded_at=" << placement_name(padded_at)
+			<< " padded16_at=" << placement_name(padded16_at);
+		return s.str();
+	}
+
+	bool from_string(const std::string &str) {
+		std::istringstream s(str);
+		std::string field;
+		while (s >> field) {
+			size_t eq = field.find('=');
+			if (eq == std::string::npos) return false;
+			std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+			bool ok = true;
+			if (key == "strip_height") strip_height = atoi(value.c_str());
+			else if (key == "sharpen_vector_width") sharpen_vector_width = atoi(value.c_str());
+			else if (key == "padded_vector_width") padded_vector_width = atoi(value.c_str());
+			else if (key == "lut_at") ok = parse_placement(value, &lut_at);
+			else if (key == "sharpen_at") ok = parse_placement(value, &sharpen_at);
+			else if (key == "padded_at") ok = parse_placement(value, &padded_at);
+			else if (key == "padded16_at") ok = parse_placement(value, &padded16_at);
+			else ok = false;
+			if (!ok) return false;
+		}
+		return true;
+	}
+};
+
+// The tunable parts of schedule_for_gpu().
+struct GpuSchedule {
+	int tile_x = 8, tile_y = 8;
+	Placement lut_at = Inline;    // Inline or Root
+	Placement padded_at = Block;  // Block or Inline
+
+	std::string to_string() const {
+		std::ostringstream s;
+		s << "tile_x=" << tile_x
+			<< " tile_y=" << tile_y
+			<< " lut_at=" << placement_name(lut_at)
+			<< " padded_at=" << placement_name(padded_at);
+		return s.str();
+	}
+
+	bool from_string(const std::string &str) {
+		std::istringstream s(str);
+		std::string field;
+		while (s >> field) {
+			size_t eq = field.find('=');
+			if (eq == std::string::npos) return false;
+			std::string key = field.substr(0, eq), value = field.substr(eq + 1);
+			bool ok = true;
+			if (key == "tile_x") tile_x = atoi(value.c_str());
+			else if (key == "tile_y") tile_y = atoi(value.c_str());
+			else if (key == "lut_at") ok = parse_placement(value, &lut_at);
+			else if (key == "padded_at") ok = parse_placement(value, &padded_at);
+			else ok = false;
+			if (!ok) return false;
+		}
+		return true;
+	}
+};
+
+// We're going to want to schedule a pipeline in several ways, so we
+// define the pipeline in a class so that we can recreate it several
+// times with different schedules.
+class MyPipeline {
+public:
+	// Everything is explicitly named so that the lowered pipeline is
+	// the same from one process to the next. jit_cache.h relies on
+	// that to recognize a pipeline it has compiled before.
+	Halide::Var x{ "x" }, y{ "y" }, c{ "c" }, i{ "i" };
+	Halide::Func lut{ "lut" }, padded{ "padded" }, padded16{ "padded16" },
+		sharpen{ "sharpen" }, curved{ "curved" };
+	Halide::ImageParam input;
+
+	// Whether input is a four-dimensional batch of same-sized images,
+	// with the image index outermost. The batch dimension is carried
+	// through every Func as the implicit argument _0, so the
+	// definitions below are the same in both cases; n names it for
+	// the schedules.
+	bool batched;
+	Halide::Var n;
+
+	// Whether the input and output store the channels of each pixel
+	// next to each other, as PNG does, rather than as separate planes.
+	bool interleaved;
+
+	LutMode lut_mode;
+
+	// The number of channels: 1 for gray, 3 for RGB or 4 for RGBA,
+	// whose alpha passes through unchanged. And whether the values are
+	// uint16 rather than uint8, the type of in; the output's match.
+	int channels;
+	bool wide;
+
+	// With gamma_param, the shared GammaLut table, bound to this input
+	// when the pipeline is constructed. It's only an argument of the
+	// pipeline with gamma_param.
+	bool gamma_param;
+	Halide::ImageParam gamma_table;
+
+	// Whether the boundary condition marks its coordinates likely(),
+	// below. Only turned off to measure what it's worth.
+	bool likely_interior;
+
+	MyPipeline(Halide::ImageParam in, bool interleaved = false, LutMode lut_mode = GatherLut,
+	           bool gamma_param = false, int channels = 3, bool likely_interior = true)
+		: input(in), batched(in.dimensions() == 4), n(Halide::_0),
+		  interleaved(interleaved), lut_mode(lut_mode), channels(channels),
+		  wide(in.type() == Halide::UInt(16)), gamma_param(gamma_param),
+		  gamma_table(wide ? Halide::UInt(16) : Halide::UInt(8), 1, "gamma_table"),
+		  likely_interior(likely_interior) {
+		using namespace Halide;
+
+		// For this lesson, we'll use a two-stage pipeline that sharpens
+		// and then applies a look-up-table (LUT).
+
+		// First we'll define the LUT. It will be a gamma curve, as in
+		// the tutorial:
+		//
+		//   lut(i) = cast<uint8_t>(clamp(pow(i / 255.0f, 1.2f) * 255.0f, 0, 255));
+		//
+		// but rather than computing it as part of the pipeline, it's
+		// read from a table computed once on the host; see GammaLut.
+		// 16-bit images use the table from uint16 to uint16.
+		if (gamma_param && wide) {
+			gamma_table.set(GammaLut::wide().table16);
+			lut(i) = gamma_table(i);
+		}
+		else if (gamma_param) {
+			gamma_table.set(GammaLut::for_mode(lut_mode).table);
+			lut(i) = gamma_table(i);
+		}
+		else if (wide) {
+			lut(i) = GammaLut::wide().table16(i);
+		}
+		else {
+			lut(i) = GammaLut::for_mode(lut_mode).table(i);
+		}
+
+		// Augment the input with a boundary condition. Clamping to
+		// the edges of the input buffer, wherever it starts, rather
+		// than to [0, width), lets the pipeline run over a band of a
+		// larger image as well as a whole one (see streaming.h).
+		//
+		// Only the one-pixel border actually needs the clamps. Marking
+		// the coordinates likely(), as BoundaryConditions::repeat_edge
+		// does, tells Halide the unclamped value is the common case,
+		// so it splits every loop over x or y that reaches here --
+		// each vector loop along a scanline, and the strips and
+		// scanlines of the CPU schedule -- into a prologue, a
+		// clamp-free steady state and an epilogue. Interior strips and
+		// the middle of every row then load the input directly, in
+		// dense vectors rather than a gather of clamped indices.
+		Expr px = likely_interior ? likely(x) : Expr(x);
+		Expr py = likely_interior ? likely(y) : Expr(y);
+		padded(x, y, c, _) = input(clamp(px, input.left(), input.right()),
+			clamp(py, input.top(), input.bottom()), c, _);
+
+		// Cast it to 16-bit to do the math. 16-bit images do theirs in
+		// signed 32-bit; see below.
+		padded16(x, y, c, _) = cast(wide ? Int(32) : UInt(16), padded(x, y, c, _));
+
+		// Next we sharpen it with a five-tap filter.
+		sharpen(x, y, c, _) = (padded16(x, y, c, _) * 2 -
+			(padded16(x - 1, y, c, _) +
+				padded16(x, y - 1, c, _) +
+				padded16(x + 1, y, c, _) +
+				padded16(x, y + 1, c, _)) / 4);
+
+		// Then apply the LUT. sharpen is a uint16, so as written in
+		// the tutorial the table covers all 65536 values it could
+		// take, though everything past 255 maps to 255. Clamping the
+		// index first gives the same result from a table of 256
+		// entries, small enough to stay in L1 while a vector of
+		// lookups gathers from it. Or skip the table and evaluate a
+		// fast polynomial approximation of the curve, which
+		// vectorizes like any other arithmetic.
+		//
+		// Where sharpen goes below zero, the tutorial's uint16 math
+		// wraps around, and past the end of the table to white. That's
+		// kept for 8-bit images, so their output stays the tutorial's,
+		// but 16-bit ones clamp in signed math instead, so those pixels
+		// go to black, and the index into their table of 65536 entries
+		// is always clamped.
+		Expr s = sharpen(x, y, c, _);
+		Expr value;
+		if (wide && lut_mode == PolynomialLut) {
+			value = cast<uint16_t>(clamp(fast_pow(cast<float>(clamp(s, 0, 65535)) / 65535.0f, GammaLut::gamma()) * 65535.0f, 0, 65535));
+		}
+		else if (wide) {
+			value = lut(clamp(s, 0, 65535));
+		}
+		else {
+			switch (lut_mode) {
+			case TableLut:
+				value = lut(s);
+				break;
+			case GatherLut:
+				value = lut(clamp(s, 0, 255));
+				break;
+			case PolynomialLut:
+				value = cast<uint8_t>(clamp(fast_pow(cast<float>(min(s, 255)) / 255.0f, GammaLut::gamma()) * 255.0f, 0, 255));
+				break;
+			}
+		}
+
+		// Alpha isn't a color, so it's copied as it is. The channels
+		// are unrolled, so each one only computes its own side of the
+		// select.
+		if (channels == 4) {
+			value = select(c == 3, padded(x, y, c, _), value);
+		}
+		curved(x, y, c, _) = value;
+
+		// For the interleaved layout, promise Halide that x has a
+		// stride of the number of channels and c a stride of 1 in both
+		// buffers. With that known at compile time, the channels of a
+		// vector of pixels become one dense interleaved store instead
+		// of one strided store each.
+		if (interleaved) {
+			input.set_stride(0, channels)
+				.set_stride(2, 1)
+				.set_bounds(2, 0, channels);
+			curved.output_buffer()
+				.set_stride(0, channels)
+				.set_stride(2, 1)
+				.set_bounds(2, 0, channels);
+		}
+	}
+
+	// Now we define methods that give our pipeline several different
+	// schedules.
+	void schedule_for_cpu(const CpuSchedule &s = CpuSchedule()) {
+		using namespace Halide;
+
+		// Compute color channels innermost. Promise that there will
+		// be channels of them and unroll across them.
+		curved.reorder(c, x, y)
+			.bound(c, 0, channels)
+			.unroll(c);
+
+		// Parallelize curved in slices of scanlines (16 by default).
+		Var yo("yo"), yi("yi");
+		curved.split(y, yo, yi, s.strip_height);
+
+		// For a batch, the parallel tasks are the strips of every
+		// image, so that small images still keep all the cores busy.
+		Var strip = yo;
+		if (batched) {
+			strip = Var("strip");
+			curved.fuse(yo, n, strip);
+		}
+		curved.parallel(strip);
+
+		// By default curved reads the shared table directly. It can
+		// also be copied, ahead of time or once per strip so that
+		// each thread has its own copy.
+		if (lut_mode != PolynomialLut) {
+			if (s.lut_at == Strip) {
+				lut.compute_at(curved, strip);
+			}
+			else if (s.lut_at == Root) {
+				lut.compute_root();
+			}
+		}
+
+		// Lookups into the full table don't vectorize well, but the
+		// 256-entry one does: a vector of indices turns into a gather
+		// (vpgatherdd with AVX2) or a handful of loads that all hit
+		// L1, and the rest of curved runs on whole vectors. With
+		// interleaved buffers curved is vectorized whatever the
+		// table, since the unrolled channels of each vector of pixels
+		// are stored together as one dense vector. 16-bit images clamp
+		// their index into the table whatever the mode, so they're
+		// vectorized too.
+		if (lut_mode != TableLut || interleaved || wide) {
+			curved.vectorize(x, s.sharpen_vector_width);
+		}
+
+		// Compute sharpen as needed per scanline of curved.
+		if (s.sharpen_at == Scanline) {
+			sharpen.compute_at(curved, yi);
+
+			// Vectorize the sharpen. It's 16-bit so by default we'll
+			// vectorize it 8-wide.
+			sharpen.vectorize(x, s.sharpen_vector_width);
+
+			// Give it the same layout as the buffers, so that curved
+			// reads it densely too.
+			if (interleaved) {
+				sharpen.reorder_storage(c, x, y)
+					.reorder(c, x, y)
+					.unroll(c);
+			}
+		}
+
+		// Compute the padded input as needed per scanline of curved,
+		// reusing previous values computed within the same strip of
+		// scanlines.
+		if (s.padded_at == Strip) {
+			padded.store_at(curved, strip)
+				.compute_at(curved, yi);
+		}
+		else if (s.padded_at == Scanline) {
+			padded.compute_at(curved, yi);
+		}
+
+		// Also vectorize the padding. It's 8-bit, so by default we'll
+		// vectorize 16-wide.
+		if (s.padded_at != Inline) {
+			padded.vectorize(x, s.padded_vector_width);
+			if (interleaved) {
+				padded.reorder_storage(c, x, y)
+					.reorder(c, x, y)
+					.unroll(c);
+			}
+		}
+
+		// Inlined, padded16 is widened again for each of sharpen's
+		// five taps. Instead it can be computed a scanline at a time
+		// and kept for the strip, like padded above. Each scanline of
+		// curved then only widens one new row, and sharpen reads the
+		// row above and below from what's already there. Folding the
+		// storage to four rows makes it a ring buffer that stays in L1,
+		// however tall the strip. With sharpen and the LUT inlined,
+		// that's a single pass over the input per strip.
+		if (s.padded16_at == Strip) {
+			padded16.store_at(curved, strip)
+				.compute_at(curved, yi)
+				.fold_storage(y, 4)
+				.vectorize(x, s.sharpen_vector_width);
+			if (interleaved) {
+				padded16.reorder_storage(c, x, y)
+					.reorder(c, x, y)
+					.unroll(c);
+			}
+		}
+	}
+
+	// Now a schedule that uses CUDA or OpenCL.
+	void schedule_for_gpu(const GpuSchedule &s = GpuSchedule()) {
+		using namespace Halide;
+
+		// We make the decision about whether to use the GPU for each
+		// Func independently. If you have one Func computed on the
+		// CPU, and the next computed on the GPU, Halide will do the
+		// copy-to-gpu under the hood. For this pipeline, there's no
+		// reason to use the CPU for any of the stages. Halide will
+		// copy the input image to the GPU the first time we run the
+		// pipeline, and leave it there to reuse on subsequent runs.
+
+		// The shared table is an input buffer like any other, so Halide
+		// copies it to the GPU on the first run and leaves it there,
+		// and curved reads it directly. The tutorial instead computes
+		// the LUT once at the start of every run, which lut_at = Root
+		// still does, now as a copy of the table.
+		if (s.lut_at == Root && lut_mode != PolynomialLut) {
+			lut.compute_root();
+
+			// Let's compute the look-up-table using the GPU in 16-wide
+			// one-dimensional thread blocks. First we split the index
+			// into blocks of size 16:
+			Var block("block"), thread("thread");
+			lut.split(i, block, thread, 16);
+			// Then we tell cuda that our Vars 'block' and 'thread'
+			// correspond to CUDA's notions of blocks and threads, or
+			// OpenCL's notions of thread groups and threads.
+			lut.gpu_blocks(block)
+				.gpu_threads(thread);
+		}
+
+		// This is a very common scheduling pattern on the GPU, so
+		// there's a shorthand for it:
+
+		// lut.gpu_tile(i, 16);
+
+		// Func::gpu_tile method is similar to Func::tile, except that
+		// it also specifies that the tile coordinates correspond to
+		// GPU blocks, and the coordinates within each tile correspond
+		// to GPU threads.
+
+		// Compute color channels innermost. Promise that there will
+		// be channels of them and unroll across them.
+		curved.reorder(c, x, y)
+			.bound(c, 0, channels)
+			.unroll(c);
+
+		// Compute curved in 2D tiles (8x8 by default) using the GPU.
+		curved.gpu_tile(x, y, s.tile_x, s.tile_y);
+
+		// Run the whole batch as a single kernel launch, with the
+		// image index as the third block dimension.
+		if (batched) {
+			curved.gpu_blocks(n);
+		}
+
+		// This is equivalent to:
+		// curved.tile(x, y, xo, yo, xi, yi, 8, 8)
+		//       .gpu_blocks(xo, yo)
+		//       .gpu_threads(xi, yi);
+
+		// We'll leave sharpen as inlined into curved.
+
+		// Compute the padded input as needed per GPU block, storing the
+		// intermediate result in shared memory. Halide can't split
+		// the block and thread loops the way it does the CPU loops for
+		// the boundary condition, but staged like this each pixel of
+		// the tile and its halo is clamped once, as it's loaded, and
+		// sharpen's five taps read shared memory with no clamps at
+		// all. Inlined, every tap would clamp. Var::gpu_blocks, and
+		// Var::gpu_threads exist to help you schedule producers within
+		// GPU threads and blocks.
+		if (s.padded_at == Block) {
+			padded.compute_at(curved, Var::gpu_blocks());
+
+			// Use the GPU threads for the x and y coordinates of the
+			// padded input.
+			padded.gpu_threads(x, y);
+		}
+	}
+};
+
+#endif
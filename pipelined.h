@@ -0,0 +1,175 @@
+// Pipelined batch mode: overlap decoding, computing and encoding.
+//
+// Run serially, every image is loaded, then processed, then saved,
+// and the PNG decode and encode each run on a single thread while the
+// rest of the machine waits. Here they're separate stages connected
+// by bounded queues instead:
+//
+//   decode threads -> [decoded] -> compute thread -> [computed] -> encode threads
+//
+// so while Halide works on image N, other threads are decoding image
+// N+1 and encoding image N-1. The compute stage is a single thread
+// because the pipeline is already parallel inside. The queues are
+// bounded so a fast decoder can't run ahead and load the whole
+// directory into memory.
+
+#ifndef PIPELINED_H
+#define PIPELINED_H
+
+#include "batch.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// A queue with a maximum size, for handing work from one stage to the
+// next. push() blocks while the queue is full and pop() blocks while
+// it's empty. Once every producer has called close(), pop() returns
+// false when the queue runs dry.
+template<typename T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity, int producers = 1) :
+		capacity(capacity), producers(producers) {}
+
+	void push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [&]() { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+	}
+
+	bool pop(T *item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [&]() { return !items.empty() || producers == 0; });
+		if (items.empty()) {
+			return false;
+		}
+		*item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		producers--;
+		not_empty.notify_all();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable not_empty, not_full;
+	std::deque<T> items;
+	size_t capacity;
+	int producers;
+};
+
+struct PipelinedConfig {
+	// Threads decoding input images, and threads encoding results.
+	int decode_threads = 2;
+	int encode_threads = 2;
+
+	// Images allowed to wait between two stages.
+	int queue_depth = 4;
+};
+
+// Run every image in source through the variant and save the results
+// to out_dir, as process_batch() does, but with the stages above
+// overlapped.
+inline int process_pipelined(const AotVariant &variant, const std::string &source,
+                             const std::string &out_dir,
+                             const PipelinedConfig &config = PipelinedConfig()) {
+	using Halide::Image;
+
+	struct Item {
+		std::string filename;
+		Image<uint8_t> image;
+	};
+
+	std::vector<std::string> files = list_images(source);
+	printf("Processing %d images from %s with %d decode and %d encode threads, with the %s variant\n",
+		(int)files.size(), source.c_str(), config.decode_threads, config.encode_threads, variant.name);
+
+	BoundedQueue<Item> decoded(config.queue_depth, config.decode_threads);
+	BoundedQueue<Item> computed(config.queue_depth);
+	std::atomic<int> next_file(0), processed(0), failed(0);
+	std::atomic<long long> total_pixels(0);
+	double compute_ms = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> decoders;
+	for (int t = 0; t < config.decode_threads; t++) {
+		decoders.emplace_back([&]() {
+			for (int i = next_file++; i < (int)files.size(); i = next_file++) {
+				Item item;
+				item.filename = files[i];
+				if (!load_rgb(item.filename, &item.image) ||
+				    item.image.dimensions() != 3 || item.image.channels() != 3) {
+					printf("Skipping %s: not an RGB image\n", item.filename.c_str());
+					failed++;
+					continue;
+				}
+				decoded.push(std::move(item));
+			}
+			decoded.close();
+		});
+	}
+
+	std::thread compute([&]() {
+		Item item;
+		while (decoded.pop(&item)) {
+			Image<uint8_t> output(item.image.width(), item.image.height(), 3);
+			auto t0 = std::chrono::steady_clock::now();
+			int result = run_variant(variant, item.image.raw_buffer(), output.raw_buffer());
+			compute_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+			if (result != 0) {
+				printf("%s: %s variant failed\n", item.filename.c_str(), variant.name);
+				failed++;
+				continue;
+			}
+			item.image = output;
+			computed.push(std::move(item));
+		}
+		computed.close();
+	});
+
+	std::vector<std::thread> encoders;
+	for (int t = 0; t < config.encode_threads; t++) {
+		encoders.emplace_back([&]() {
+			Item item;
+			while (computed.pop(&item)) {
+				std::string out = output_path(out_dir, item.filename);
+				if (!save_rgb(item.image, out)) {
+					printf("Could not save %s\n", out.c_str());
+					failed++;
+					continue;
+				}
+				processed++;
+				total_pixels += (long long)item.image.width() * item.image.height();
+			}
+		});
+	}
+
+	for (std::thread &t : decoders) {
+		t.join();
+	}
+	compute.join();
+	for (std::thread &t : encoders) {
+		t.join();
+	}
+
+	double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Processed %d images (%1.1f megapixels) in %1.1f ms, %1.1f ms of it computing: "
+	       "%1.1f images/second, %d failed\n",
+	       (int)processed, total_pixels / 1e6, total_ms, compute_ms,
+	       processed / (total_ms / 1000.0), (int)failed);
+	if (variant.on_gpu) {
+		DevicePool::instance().print_stats();
+	}
+	return failed ? -1 : 0;
+}
+
+#endif
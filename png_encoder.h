@@ -0,0 +1,333 @@
+// A parallel PNG encoder.
+//
+// libpng filters and deflates an image one row after another on a
+// single thread, which makes saving the slowest step of processing an
+// image. Here the rows are cut into chunks and each chunk is handled by
+// its own thread in two passes:
+//
+//   1. filter: apply the PNG row filter to every row of the chunk. A
+//      filter only looks at the row above, which is in the image, so
+//      chunks don't depend on each other.
+//   2. deflate: compress the filtered chunk as a raw deflate stream,
+//      primed with the last 32 KB of the chunk before it, so matches
+//      can still reach back across the boundary. Every chunk but the
+//      last ends with a sync flush, which pads to a byte boundary
+//      without ending the stream.
+//
+// Concatenated, the chunks are one valid deflate stream. It goes out
+// as one IDAT chunk per thread's chunk, after a zlib header and
+// followed by the Adler-32 of the whole stream, which is combined from
+// the per-chunk checksums. This is how pigz parallelizes gzip.
+//
+// The compression level (0 to 9), the row filter and the zlib strategy
+// are all exposed, to trade file size for speed per job.
+
+#ifndef PNG_ENCODER_H
+#define PNG_ENCODER_H
+
+#include "HalideRuntime.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The PNG row filters, plus Adaptive, which picks the best of them for
+// each row with the usual minimum-sum-of-absolute-differences rule, as
+// libpng does by default.
+enum PngFilter {
+	PngFilterNone,
+	PngFilterSub,
+	PngFilterUp,
+	PngFilterAverage,
+	PngFilterPaeth,
+	PngFilterAdaptive
+};
+
+inline const char *png_filter_name(PngFilter f) {
+	static const char *names[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+	return names[f];
+}
+
+inline bool parse_png_filter(const std::string &name, PngFilter *f) {
+	for (int i = PngFilterNone; i <= PngFilterAdaptive; i++) {
+		if (name == png_filter_name((PngFilter)i)) {
+			*f = (PngFilter)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// The zlib strategies, by name.
+inline bool parse_zlib_strategy(const std::string &name, int *strategy) {
+	if (name == "default") *strategy = Z_DEFAULT_STRATEGY;
+	else if (name == "filtered") *strategy = Z_FILTERED;
+	else if (name == "huffman") *strategy = Z_HUFFMAN_ONLY;
+	else if (name == "rle") *strategy = Z_RLE;
+	else return false;
+	return true;
+}
+
+struct PngEncodeConfig {
+	// zlib compression level, from 0 (store) to 9 (smallest).
+	int level = 6;
+
+	PngFilter filter = PngFilterAdaptive;
+
+	// A zlib strategy: Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE or
+	// Z_HUFFMAN_ONLY. Z_RLE is much faster than the default on
+	// filtered photographs and usually not much bigger.
+	int strategy = Z_DEFAULT_STRATEGY;
+
+	// Threads, and so chunks. Zero means one per core; small images
+	// use fewer, so each chunk is at least min_chunk_rows tall.
+	int threads = 0;
+	int min_chunk_rows = 16;
+};
+
+// The settings save_rgb() and save_interleaved() use for PNGs.
+inline PngEncodeConfig &png_encode_config() {
+	static PngEncodeConfig config;
+	return config;
+}
+
+namespace png_encoder_internal {
+
+inline void put_u32(std::vector<uint8_t> &out, uint32_t v) {
+	out.push_back((uint8_t)(v >> 24));
+	out.push_back((uint8_t)(v >> 16));
+	out.push_back((uint8_t)(v >> 8));
+	out.push_back((uint8_t)v);
+}
+
+inline void put_chunk(std::vector<uint8_t> &out, const char *type, const uint8_t *data, size_t size) {
+	put_u32(out, (uint32_t)size);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	put_u32(out, (uint32_t)crc32(0, out.data() + start, (uInt)(out.size() - start)));
+}
+
+inline uint8_t paeth(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return (uint8_t)a;
+	if (pb <= pc) return (uint8_t)b;
+	return (uint8_t)c;
+}
+
+// Filter row (row_bytes long, bpp bytes per pixel) with filter f, given
+// the row above (or zeros at the top), writing the filter type and the
+// filtered bytes to out.
+inline void filter_row(PngFilter f, const uint8_t *row, const uint8_t *prev,
+                       int row_bytes, int bpp, uint8_t *out) {
+	out[0] = (uint8_t)f;
+	uint8_t *o = out + 1;
+	for (int i = 0; i < row_bytes; i++) {
+		int a = i >= bpp ? row[i - bpp] : 0;
+		int b = prev[i];
+		int c = i >= bpp ? prev[i - bpp] : 0;
+		int pred = 0;
+		switch (f) {
+		case PngFilterSub: pred = a; break;
+		case PngFilterUp: pred = b; break;
+		case PngFilterAverage: pred = (a + b) / 2; break;
+		case PngFilterPaeth: pred = paeth(a, b, c); break;
+		default: break;
+		}
+		o[i] = (uint8_t)(row[i] - pred);
+	}
+}
+
+// The filtered row that's cheapest to compress, by the sum of its bytes
+// taken as signed values.
+inline void filter_row_adaptive(const uint8_t *row, const uint8_t *prev,
+                                int row_bytes, int bpp, uint8_t *out, std::vector<uint8_t> &scratch) {
+	scratch.resize(row_bytes + 1);
+	long best = -1;
+	for (int f = PngFilterNone; f <= PngFilterPaeth; f++) {
+		filter_row((PngFilter)f, row, prev, row_bytes, bpp, scratch.data());
+		long sum = 0;
+		for (int i = 1; i <= row_bytes; i++) {
+			sum += abs((int8_t)scratch[i]);
+		}
+		if (best < 0 || sum < best) {
+			best = sum;
+			memcpy(out, scratch.data(), row_bytes + 1);
+		}
+	}
+}
+
+// Row y of buf, an 8-bit image of 1 to 4 channels in any layout, as
+// interleaved bytes.
+inline void gather_row(const buffer_t *buf, int y, uint8_t *out) {
+	int channels = buf->extent[2] ? buf->extent[2] : 1;
+	const uint8_t *src = buf->host + y * buf->stride[1];
+	if (buf->stride[0] == channels && (channels == 1 || buf->stride[2] == 1)) {
+		memcpy(out, src, (size_t)buf->extent[0] * channels);
+		return;
+	}
+	for (int x = 0; x < buf->extent[0]; x++) {
+		for (int c = 0; c < channels; c++) {
+			*out++ = src[x * buf->stride[0] + c * buf->stride[2]];
+		}
+	}
+}
+
+struct Chunk {
+	int y0, y1;
+	std::vector<uint8_t> filtered, compressed;
+	uLong adler = 1;
+	bool ok = true;
+};
+
+}  // namespace png_encoder_internal
+
+// Encode buf, an 8-bit image with 1 (gray), 2 (gray and alpha), 3
+// (RGB) or 4 (RGBA) channels, as a PNG in out.
+inline bool encode_png(const buffer_t *buf, std::vector<uint8_t> *out,
+                       const PngEncodeConfig &config = png_encode_config()) {
+	using namespace png_encoder_internal;
+	int width = buf->extent[0], height = buf->extent[1];
+	int channels = buf->extent[2] ? buf->extent[2] : 1;
+	if (buf->elem_size != 1 || channels > 4 || width <= 0 || height <= 0) {
+		return false;
+	}
+	int row_bytes = width * channels;
+	int level = std::min(std::max(config.level, 0), 9);
+
+	int threads = config.threads > 0 ? config.threads : (int)std::max(1u, std::thread::hardware_concurrency());
+	int count = std::max(1, std::min(threads, height / std::max(1, config.min_chunk_rows)));
+	std::vector<Chunk> chunks(count);
+	for (int i = 0; i < count; i++) {
+		chunks[i].y0 = (int)((long long)height * i / count);
+		chunks[i].y1 = (int)((long long)height * (i + 1) / count);
+	}
+
+	auto filter_chunk = [&](Chunk &ch) {
+		std::vector<uint8_t> row(row_bytes), prev(row_bytes, 0), scratch;
+		if (ch.y0 > 0) {
+			gather_row(buf, ch.y0 - 1, prev.data());
+		}
+		ch.filtered.resize((size_t)(ch.y1 - ch.y0) * (row_bytes + 1));
+		uint8_t *o = ch.filtered.data();
+		for (int y = ch.y0; y < ch.y1; y++, o += row_bytes + 1) {
+			gather_row(buf, y, row.data());
+			if (config.filter == PngFilterAdaptive) {
+				filter_row_adaptive(row.data(), prev.data(), row_bytes, channels, o, scratch);
+			}
+			else {
+				filter_row(config.filter, row.data(), prev.data(), row_bytes, channels, o);
+			}
+			std::swap(row, prev);
+		}
+		ch.adler = adler32(1, ch.filtered.data(), (uInt)ch.filtered.size());
+	};
+
+	auto deflate_chunk = [&](int i) {
+		Chunk &ch = chunks[i];
+		z_stream z = {};
+		// Negative window bits: a raw deflate stream, no zlib header.
+		if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, config.strategy) != Z_OK) {
+			ch.ok = false;
+			return;
+		}
+		if (i > 0) {
+			const std::vector<uint8_t> &before = chunks[i - 1].filtered;
+			size_t dict = std::min(before.size(), (size_t)32768);
+			deflateSetDictionary(&z, before.data() + before.size() - dict, (uInt)dict);
+		}
+		bool last = i == count - 1;
+		ch.compressed.resize(deflateBound(&z, (uLong)ch.filtered.size()) + 16);
+		z.next_in = ch.filtered.data();
+		z.avail_in = (uInt)ch.filtered.size();
+		z.next_out = ch.compressed.data();
+		z.avail_out = (uInt)ch.compressed.size();
+		int result = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+		ch.ok = last ? result == Z_STREAM_END : (result == Z_OK && z.avail_in == 0);
+		ch.compressed.resize(z.total_out);
+		deflateEnd(&z);
+	};
+
+	// Each pass runs every chunk on its own thread, the first one on
+	// this thread.
+	auto run = [&](const std::function<void(int)> &f) {
+		std::vector<std::thread> workers;
+		for (int i = 1; i < count; i++) {
+			workers.emplace_back(f, i);
+		}
+		f(0);
+		for (auto &t : workers) {
+			t.join();
+		}
+	};
+	run([&](int i) { filter_chunk(chunks[i]); });
+	run(deflate_chunk);
+
+	out->clear();
+	static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	out->insert(out->end(), signature, signature + 8);
+
+	static const uint8_t color_types[] = { 0, 4, 2, 6 };
+	uint8_t ihdr[13] = {};
+	for (int i = 0; i < 4; i++) {
+		ihdr[i] = (uint8_t)(width >> (24 - 8 * i));
+		ihdr[4 + i] = (uint8_t)(height >> (24 - 8 * i));
+	}
+	ihdr[8] = 8;  // bit depth
+	ihdr[9] = color_types[channels - 1];
+	put_chunk(*out, "IHDR", ihdr, sizeof(ihdr));
+
+	// The zlib header: deflate with a 32 KB window, the level, and a
+	// check value making the pair a multiple of 31.
+	uint8_t cmf = 0x78;
+	uint8_t flg = (uint8_t)((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+	flg += 31 - ((cmf * 256 + flg) % 31);
+
+	uLong adler = 1;
+	for (int i = 0; i < count; i++) {
+		Chunk &ch = chunks[i];
+		if (!ch.ok) {
+			return false;
+		}
+		adler = adler32_combine(adler, ch.adler, (z_off_t)ch.filtered.size());
+		std::vector<uint8_t> data;
+		if (i == 0) {
+			data.push_back(cmf);
+			data.push_back(flg);
+		}
+		data.insert(data.end(), ch.compressed.begin(), ch.compressed.end());
+		if (i == count - 1) {
+			put_u32(data, (uint32_t)adler);
+		}
+		put_chunk(*out, "IDAT", data.data(), data.size());
+	}
+	put_chunk(*out, "IEND", NULL, 0);
+	return true;
+}
+
+inline bool save_png_parallel(const buffer_t *buf, const std::string &filename,
+                              const PngEncodeConfig &config = png_encode_config()) {
+	std::vector<uint8_t> png;
+	if (!encode_png(buf, &png, config)) {
+		printf("Could not encode %s\n", filename.c_str());
+		return false;
+	}
+	FILE *f = fopen(filename.c_str(), "wb");
+	if (!f) {
+		printf("File %s could not be opened for writing\n", filename.c_str());
+		return false;
+	}
+	bool ok = fwrite(png.data(), 1, png.size(), f) == png.size();
+	return fclose(f) == 0 && ok;
+}
+
+#endif
@@ -0,0 +1,328 @@
+// A stage-by-stage profile of MyPipeline, for halide_test --profile.
+//
+// The benchmarks only say how long a whole realization takes. To see
+// whether padded, sharpen or the LUT gather is the bottleneck, the
+// pipeline is compiled with trace_realizations() on every Func and
+// PipelineTracer::trace as its trace handler. Halide then calls the
+// handler when each Func's realization begins and ends, and when it
+// starts producing and starts being consumed, on whichever thread is
+// doing it, so the time between produce and consume is how long that
+// Func took. PipelineTracer::do_par_for stands in front of the thread
+// pool, so each parallel task is timed too, and attributed to the
+// Func whose loop it is.
+//
+// Spans nest on each thread (a task inside curved's loop contains the
+// production of its strip of padded), and each Func is charged only
+// for its own time, not its children's. That's what the summary table
+// reports, along with how busy the threads were, the scratch each
+// Func's realizations need and, with trace_stores(), how many values
+// each one stores. Every span also goes into a Chrome trace, which
+// chrome://tracing or https://ui.perfetto.dev will show as a timeline
+// per thread.
+//
+// Tracing can't run inside GPU kernels, so on the GPU only the host
+// side is timed: uploading the input, running the kernels and
+// downloading the output; see add_span.
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "HalideRuntime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+class PipelineTracer {
+public:
+	// A finished span, in microseconds since reset().
+	struct Span {
+		std::string name;
+		const char *category;
+		int thread;
+		double start_us, duration_us;
+	};
+
+	// Totals for one Func over every run since reset().
+	struct FuncStats {
+		// Time spent producing it, and doing its parallel tasks, not
+		// counting the Funcs computed inside them.
+		double self_us = 0;
+		// Time its parallel loops spent waiting for other threads.
+		double wait_us = 0;
+		long long realizations = 0;
+		// Bytes of every realization, from its bounds.
+		long long scratch_bytes = 0;
+		// Values stored, if it was traced with trace_stores().
+		long long stores = 0;
+	};
+
+	static PipelineTracer &instance() {
+		static PipelineTracer tracer;
+		return tracer;
+	}
+
+	// The thread pool the traced do_par_for hands tasks to. Set it to
+	// work_stealing_do_par_for to profile with thread_pool.h's pool.
+	halide_do_par_for_t next_do_par_for = halide_do_par_for;
+
+	// Forget everything recorded so far and restart the clock, so a
+	// warm-up realization doesn't count. The output Func is named so
+	// its realization isn't counted as scratch.
+	void reset(const std::string &output_name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		spans.clear();
+		funcs.clear();
+		gpu_spans.clear();
+		output = output_name;
+		runs = 0;
+		pipeline_us = 0;
+		origin = std::chrono::steady_clock::now();
+	}
+
+	// Pass to Func::set_custom_trace on the output Func.
+	static int trace(void *, const halide_trace_event *e) {
+		PipelineTracer &t = instance();
+		switch (e->event) {
+		case halide_trace_begin_pipeline:
+			t.open(e->func, "pipeline");
+			break;
+		case halide_trace_end_pipeline:
+			t.close("pipeline");
+			break;
+		case halide_trace_begin_realization:
+			t.count_realization(e);
+			break;
+		case halide_trace_produce:
+			t.open(e->func, "produce");
+			break;
+		case halide_trace_consume:
+			t.close("produce");
+			break;
+		case halide_trace_store:
+			t.count_store(e);
+			break;
+		default:
+			break;
+		}
+		// Events that begin something return an ID for the events
+		// they contain to refer to through parent_id.
+		return ++t.next_id;
+	}
+
+	// Pass to Func::set_custom_do_par_for on the output Func.
+	static int do_par_for(void *user_context, halide_task_t task, int min, int size, uint8_t *closure) {
+		PipelineTracer &t = instance();
+		std::vector<Open> &stack = thread_stack();
+		TracedLoop loop = { task, closure, stack.empty() ? std::string("pipeline") : stack.back().name };
+		t.open(loop.owner, "par_for");
+		int result = t.next_do_par_for(user_context, traced_task, min, size, (uint8_t *)&loop);
+		t.close("par_for");
+		return result;
+	}
+
+	// Record a span timed outside the pipeline, such as a GPU copy, on
+	// a timeline of its own called track.
+	void add_span(const std::string &name, const std::string &track,
+	              std::chrono::steady_clock::time_point start,
+	              std::chrono::steady_clock::time_point end) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Span s = { name, "gpu", track_thread(track), micros(start), micros(end) - micros(start) };
+		gpu_spans.push_back(s);
+	}
+
+	// Print a table of where the time went, per run.
+	void print_summary() {
+		std::lock_guard<std::mutex> lock(mutex);
+		int n = std::max(runs, 1);
+		double busy_us = 0, wait_us = 0;
+		for (auto &f : funcs) {
+			busy_us += f.second.self_us;
+			wait_us += f.second.wait_us;
+		}
+		std::set<int> seen;
+		for (const Span &s : spans) {
+			seen.insert(s.thread);
+		}
+		int threads = (int)seen.size();
+		double wall_us = pipeline_us > 0 ? pipeline_us : busy_us;
+		printf("Profile over %d runs: %.3f ms per run on %d threads, %.0f%% busy\n",
+			runs, wall_us / n / 1000, threads,
+			threads && wall_us > 0 ? 100 * busy_us / (wall_us * threads) : 0.0);
+		printf("  %-10s %10s %7s %10s %14s %12s\n",
+			"Func", "ms/run", "time", "realized", "scratch KB", "stores");
+		for (auto &f : funcs) {
+			const FuncStats &s = f.second;
+			printf("  %-10s %10.3f %6.1f%% %10.1f %14.1f %12.0f\n",
+				f.first.c_str(), s.self_us / n / 1000,
+				busy_us > 0 ? 100 * s.self_us / busy_us : 0.0,
+				(double)s.realizations / n, s.scratch_bytes / 1024.0 / n, (double)s.stores / n);
+		}
+		printf("  Waiting in parallel loops: %.3f ms per run, over all threads\n", wait_us / n / 1000);
+
+		// The GPU spans come in named groups; report the mean of each.
+		std::map<std::string, std::pair<double, int> > gpu;
+		for (const Span &s : gpu_spans) {
+			gpu[s.name].first += s.duration_us;
+			gpu[s.name].second++;
+		}
+		for (auto &g : gpu) {
+			printf("  GPU %-20s %.3f ms\n", g.first.c_str(), g.second.first / g.second.second / 1000);
+		}
+	}
+
+	// Write every span in Chrome's trace event format.
+	bool write_chrome_trace(const std::string &filename) {
+		std::lock_guard<std::mutex> lock(mutex);
+		FILE *f = fopen(filename.c_str(), "w");
+		if (!f) {
+			return false;
+		}
+		fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+		bool first = true;
+		for (const std::vector<Span> *list : { &spans, &gpu_spans }) {
+			for (const Span &s : *list) {
+				fprintf(f, "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+				        "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+				        first ? "" : ",", s.name.c_str(), s.category, s.thread, s.start_us, s.duration_us);
+				first = false;
+			}
+		}
+		for (auto &t : tracks) {
+			fprintf(f, "%s\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+			        "\"args\": {\"name\": \"%s\"}}", first ? "" : ",", t.second, t.first.c_str());
+			first = false;
+		}
+		fprintf(f, "\n]}\n");
+		return fclose(f) == 0;
+	}
+
+	const std::map<std::string, FuncStats> &func_stats() const { return funcs; }
+
+private:
+	// A span that has begun on this thread and not yet ended.
+	struct Open {
+		std::string name;
+		const char *category;
+		std::chrono::steady_clock::time_point start;
+		double children_us;
+	};
+
+	struct TracedLoop {
+		halide_task_t task;
+		uint8_t *closure;
+		std::string owner;
+	};
+
+	std::mutex mutex;
+	std::vector<Span> spans, gpu_spans;
+	std::map<std::string, FuncStats> funcs;
+	std::map<std::string, int> tracks;
+	std::string output;
+	int runs = 0;
+	double pipeline_us = 0;
+	std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	std::atomic<int> next_id{ 0 };
+	std::atomic<int> next_thread{ 0 };
+
+	// Spans begin and end in order on any one thread, so each thread
+	// keeps its open ones on a stack.
+	static std::vector<Open> &thread_stack() {
+		static thread_local std::vector<Open> stack;
+		return stack;
+	}
+
+	// Threads are numbered in the order they first do something.
+	int thread_index() {
+		static thread_local int index = -1;
+		if (index < 0) {
+			index = next_thread++;
+		}
+		return index;
+	}
+
+	// Timelines added with add_span are numbered after the threads.
+	int track_thread(const std::string &track) {
+		auto it = tracks.find(track);
+		if (it == tracks.end()) {
+			it = tracks.insert(std::make_pair(track, 1000 + (int)tracks.size())).first;
+		}
+		return it->second;
+	}
+
+	double micros(std::chrono::steady_clock::time_point t) const {
+		return std::chrono::duration<double, std::micro>(t - origin).count();
+	}
+
+	static int traced_task(void *user_context, int index, uint8_t *closure) {
+		TracedLoop *loop = (TracedLoop *)closure;
+		PipelineTracer &t = instance();
+		t.open(loop->owner, "task");
+		int result = loop->task(user_context, index, loop->closure);
+		t.close("task");
+		return result;
+	}
+
+	void open(const std::string &name, const char *category) {
+		Open o = { name, category, std::chrono::steady_clock::now(), 0 };
+		thread_stack().push_back(o);
+	}
+
+	void close(const char *category) {
+		std::vector<Open> &stack = thread_stack();
+		if (stack.empty() || strcmp(stack.back().category, category) != 0) {
+			return;
+		}
+		Open o = stack.back();
+		stack.pop_back();
+		auto end = std::chrono::steady_clock::now();
+		double duration_us = std::chrono::duration<double, std::micro>(end - o.start).count();
+		double self_us = duration_us - o.children_us;
+		if (!stack.empty()) {
+			stack.back().children_us += duration_us;
+		}
+
+		Span s = { o.name, o.category, thread_index(), micros(o.start), duration_us };
+		std::lock_guard<std::mutex> lock(mutex);
+		spans.push_back(s);
+		if (strcmp(category, "pipeline") == 0) {
+			runs++;
+			pipeline_us += duration_us;
+		}
+		else if (strcmp(category, "par_for") == 0) {
+			funcs[o.name].wait_us += self_us;
+		}
+		else {
+			funcs[o.name].self_us += self_us;
+		}
+	}
+
+	void count_realization(const halide_trace_event *e) {
+		// The coordinates are the min and extent of each dimension.
+		long long bytes = (e->type.bits + 7) / 8;
+		for (int d = 1; d < e->dimensions; d += 2) {
+			bytes *= e->coordinates[d];
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		FuncStats &s = funcs[e->func];
+		s.realizations++;
+		if (output != e->func) {
+			s.scratch_bytes += bytes;
+		}
+	}
+
+	void count_store(const halide_trace_event *e) {
+		std::lock_guard<std::mutex> lock(mutex);
+		funcs[e->func].stores += e->type.lanes;
+	}
+};
+
+#endif
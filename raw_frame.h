@@ -0,0 +1,310 @@
+// Raw frames: uncompressed images in a memory-mapped container.
+//
+// Decoding and encoding PNGs can take longer than the pipeline itself,
+// which is wasted work for frames that are only passed from one
+// processing step to the next. A .raw file is a small header followed
+// by the pixels exactly as a buffer_t describes them, starting on a
+// page boundary. Opening one maps the file and points a buffer_t at
+// the mapped pages, so the pipeline reads its input straight from the
+// page cache, and creating one lets the pipeline write its output
+// straight into the file. Nothing is decoded, encoded or copied.
+//
+// The header records the type, extents and strides, so frames can be
+// planar or interleaved; halide_test writes them in whichever layout
+// the pipeline it ran used.
+
+#ifndef RAW_FRAME_H
+#define RAW_FRAME_H
+
+#include "HalideRuntime.h"
+
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct RawFrameHeader {
+	char magic[8];           // "HTRAW01" and a NUL
+	uint32_t header_bytes;   // Where the pixels start
+	uint32_t type_code;      // A halide_type_code_t
+	uint32_t type_bits;
+	uint32_t dimensions;
+	int32_t extent[4];
+	int32_t stride[4];       // In elements
+	uint64_t data_bytes;
+};
+
+static const char raw_frame_magic[8] = "HTRAW01";
+
+// The pixels start a page in, so they're aligned for any vector load.
+static const uint32_t raw_frame_header_bytes = 4096;
+
+// A whole file mapped into memory, unmapped when the last copy of the
+// shared_ptr holding it goes away.
+class MappedFile {
+public:
+	~MappedFile() {
+#ifdef _WIN32
+		if (data) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+#else
+		if (data) {
+			munmap(data, size);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+#endif
+	}
+
+	// Map an existing file. Pages are copy-on-write, so writing to
+	// them doesn't change the file.
+	bool open(const std::string &filename) {
+#ifdef _WIN32
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		                   OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		LARGE_INTEGER bytes;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &bytes) || bytes.QuadPart == 0) {
+			return false;
+		}
+		size = (size_t)bytes.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		data = mapping ? (uint8_t *)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+		return data != NULL;
+#else
+		fd = ::open(filename.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+			return false;
+		}
+		size = (size_t)st.st_size;
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			return false;
+		}
+		data = (uint8_t *)p;
+		madvise(data, size, MADV_SEQUENTIAL);
+		return true;
+#endif
+	}
+
+	// Create (or replace) a file of the given size and map it for
+	// writing.
+	bool create(const std::string &filename, size_t bytes) {
+		size = bytes;
+#ifdef _WIN32
+		file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		                   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE,
+		                             (DWORD)((uint64_t)bytes >> 32), (DWORD)bytes, NULL);
+		data = mapping ? (uint8_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+		return data != NULL;
+#else
+		fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, (off_t)bytes) != 0) {
+			return false;
+		}
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			return false;
+		}
+		data = (uint8_t *)p;
+		return true;
+#endif
+	}
+
+	// Write dirty pages back to the file.
+	bool flush() {
+#ifdef _WIN32
+		return FlushViewOfFile(data, 0) != 0;
+#else
+		return msync(data, size, MS_SYNC) == 0;
+#endif
+	}
+
+	uint8_t *data = NULL;
+	size_t size = 0;
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// A raw frame, mapped. raw_buffer() describes its pixels to Halide
+// and stays valid as long as the frame, or a copy of it, is alive.
+class RawFrame {
+public:
+	RawFrame() : buf() {}
+
+	// Map the frame in filename. Returns false, after printing why, if
+	// it isn't a raw frame.
+	bool open(const std::string &filename) {
+		std::shared_ptr<MappedFile> f(new MappedFile);
+		if (!f->open(filename)) {
+			printf("File %s could not be mapped for reading\n", filename.c_str());
+			return false;
+		}
+		const RawFrameHeader *h = (const RawFrameHeader *)f->data;
+		if (f->size < sizeof(RawFrameHeader) || memcmp(h->magic, raw_frame_magic, 8) != 0 ||
+		    h->dimensions < 1 || h->dimensions > 4 || h->type_bits % 8 != 0 ||
+		    h->header_bytes < sizeof(RawFrameHeader) ||
+		    h->header_bytes + h->data_bytes > f->size) {
+			printf("%s is not a raw frame\n", filename.c_str());
+			return false;
+		}
+		buf = buffer_t();
+		for (uint32_t d = 0; d < h->dimensions; d++) {
+			if (h->extent[d] <= 0 || h->stride[d] < 0) {
+				printf("%s has a bad dimension %d\n", filename.c_str(), (int)d);
+				return false;
+			}
+			buf.extent[d] = h->extent[d];
+			buf.stride[d] = h->stride[d];
+		}
+		buf.elem_size = h->type_bits / 8;
+		if (footprint(buf) > h->data_bytes) {
+			printf("%s is truncated\n", filename.c_str());
+			return false;
+		}
+		buf.host = f->data + h->header_bytes;
+		buf.host_dirty = true;
+		header = *h;
+		file = f;
+		return true;
+	}
+
+	// Create filename as a frame of 8-bit pixels with the given size,
+	// for a pipeline to write into. Interleaved frames store the
+	// channels of each pixel together.
+	bool create(const std::string &filename, int width, int height, int channels, bool interleaved) {
+		buffer_t b = buffer_t();
+		b.extent[0] = width;
+		b.extent[1] = height;
+		b.extent[2] = channels;
+		if (interleaved) {
+			b.stride[0] = channels;
+			b.stride[1] = channels * width;
+			b.stride[2] = 1;
+		}
+		else {
+			b.stride[0] = 1;
+			b.stride[1] = width;
+			b.stride[2] = width * height;
+		}
+		b.elem_size = 1;
+
+		RawFrameHeader h = RawFrameHeader();
+		memcpy(h.magic, raw_frame_magic, 8);
+		h.header_bytes = raw_frame_header_bytes;
+		h.type_code = halide_type_uint;
+		h.type_bits = 8;
+		h.dimensions = 3;
+		for (int d = 0; d < 3; d++) {
+			h.extent[d] = b.extent[d];
+			h.stride[d] = b.stride[d];
+		}
+		h.data_bytes = footprint(b);
+
+		std::shared_ptr<MappedFile> f(new MappedFile);
+		if (!f->create(filename, h.header_bytes + (size_t)h.data_bytes)) {
+			printf("File %s could not be created\n", filename.c_str());
+			return false;
+		}
+		memcpy(f->data, &h, sizeof(h));
+		b.host = f->data + h.header_bytes;
+		buf = b;
+		header = h;
+		file = f;
+		return true;
+	}
+
+	// Make sure everything written so far is in the file. Unmapping
+	// writes it back eventually regardless.
+	bool flush() {
+		return file && file->flush();
+	}
+
+	int width() const { return buf.extent[0]; }
+	int height() const { return buf.extent[1]; }
+	int channels() const { return buf.extent[2]; }
+	int dimensions() const { return header.dimensions; }
+	bool is_uint8() const { return header.type_code == halide_type_uint && header.type_bits == 8; }
+	bool is_interleaved() const { return buf.stride[2] == 1 && buf.stride[0] == buf.extent[2]; }
+
+	buffer_t *raw_buffer() { return &buf; }
+
+	// The number of bytes spanned by the pixels of b.
+	static uint64_t footprint(const buffer_t &b) {
+		uint64_t bytes = 1;
+		for (int d = 0; d < 4 && b.extent[d]; d++) {
+			bytes += (uint64_t)(b.extent[d] - 1) * b.stride[d];
+		}
+		return bytes * b.elem_size;
+	}
+
+private:
+	std::shared_ptr<MappedFile> file;
+	RawFrameHeader header = RawFrameHeader();
+	buffer_t buf;
+};
+
+// Copy the pixels of one three-dimensional 8-bit buffer into another
+// of the same size, whatever their layouts.
+inline void copy_pixels(const buffer_t *src, buffer_t *dst) {
+	int channels = src->extent[2] ? src->extent[2] : 1;
+	for (int c = 0; c < channels; c++) {
+		for (int y = 0; y < src->extent[1]; y++) {
+			const uint8_t *s = src->host + y * src->stride[1] + c * src->stride[2];
+			uint8_t *d = dst->host + y * dst->stride[1] + c * dst->stride[2];
+			if (src->stride[0] == 1 && dst->stride[0] == 1) {
+				memcpy(d, s, src->extent[0]);
+			}
+			else {
+				for (int x = 0; x < src->extent[0]; x++) {
+					d[x * dst->stride[0]] = s[x * src->stride[0]];
+				}
+			}
+		}
+	}
+}
+
+// Write the pixels of buf, an 8-bit image, to a new raw frame in the
+// same layout.
+inline bool save_raw_frame(const buffer_t *buf, const std::string &filename) {
+	bool interleaved = buf->stride[2] == 1 && buf->stride[0] == buf->extent[2];
+	RawFrame frame;
+	if (!frame.create(filename, buf->extent[0], buf->extent[1], buf->extent[2] ? buf->extent[2] : 1, interleaved)) {
+		return false;
+	}
+	copy_pixels(buf, frame.raw_buffer());
+	return frame.flush();
+}
+
+#endif
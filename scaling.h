@@ -0,0 +1,172 @@
+// The scaling suite: MyPipeline across image sizes, thread counts and
+// targets.
+//
+// One run on one image says little about how the pipeline scales. The
+// suite (halide_test --scaling) runs every implementation, ahead of time
+// and JIT-compiled, on the CPU and each GPU API, over square images
+// from 256x256 up to 16k x 16k, both synthetic ones and the input
+// image tiled to size. On the CPU each size is also run with 1, 2,
+// 4... threads up to one per core, for strong scaling (the same image
+// with more threads), and a row of weak_size x weak_size tiles per
+// thread, for weak scaling (the image grows with the threads).
+//
+// Sharpen and the gamma lookup do little arithmetic per byte, so at
+// large sizes the pipeline is bound by memory. Each point is reported
+// with the bandwidth it achieved, counting only the least traffic
+// possible (reading the input once and writing the output once),
+// as a fraction of the peak measured for the machine by copying a
+// large buffer on every core.
+//
+// Every point is an ordinary BenchmarkResult, named for its
+// implementation, input, size and threads, so --bench-csv saves the
+// whole suite and --baseline compares it with an earlier run.
+
+#ifndef SCALING_H
+#define SCALING_H
+
+#include "Halide.h"
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fewer and shorter samples than the other benchmarks: there are a lot
+// of points, and the big images take a while each.
+inline BenchmarkConfig scaling_benchmark_config() {
+	BenchmarkConfig config;
+	config.samples = 5;
+	config.warmup_ms = 20;
+	return config;
+}
+
+struct ScalingConfig {
+	// Square images from min_size to max_size on a side, doubling.
+	int min_size = 256, max_size = 16384;
+
+	// CPU threads from 1 to max_threads, doubling, and max_threads
+	// itself; 0 for one per core.
+	int max_threads = 0;
+
+	// For weak scaling, each thread's share of the image.
+	int weak_size = 1024;
+
+	BenchmarkConfig bench = scaling_benchmark_config();
+
+	// A point whose median time is this much (a fraction) slower than
+	// the baseline's is a regression.
+	double regression_threshold = 0.1;
+};
+
+// lo, 2 lo, 4 lo... up to hi, and hi itself.
+inline std::vector<int> doubling(int lo, int hi) {
+	std::vector<int> values;
+	for (int v = lo; v < hi; v *= 2) {
+		values.push_back(v);
+	}
+	values.push_back(hi);
+	return values;
+}
+
+inline int scaling_max_threads(const ScalingConfig &config) {
+	return config.max_threads > 0 ? config.max_threads : (int)std::max(1u, std::thread::hardware_concurrency());
+}
+
+// A width x height RGB image of smooth gradients with noise on top, so
+// the gamma lookup sees every value rather than a few cached ones.
+inline Halide::Image<uint8_t> synthetic_image(int width, int height) {
+	Halide::Image<uint8_t> im(width, height, 3);
+	for (int c = 0; c < 3; c++) {
+		for (int y = 0; y < height; y++) {
+			uint8_t *row = im.data() + (size_t)c * im.stride(2) + (size_t)y * im.stride(1);
+			uint32_t state = (uint32_t)(y * 3 + c) * 2654435761u + 1;
+			for (int x = 0; x < width; x++) {
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+				row[x] = (uint8_t)(((x + y) * 255 / (width + height) + (state & 63)) & 255);
+			}
+		}
+	}
+	im.set_host_dirty();
+	return im;
+}
+
+// src repeated across a width x height image.
+inline Halide::Image<uint8_t> tiled_image(Halide::Image<uint8_t> src, int width, int height) {
+	Halide::Image<uint8_t> im(width, height, src.channels());
+	for (int c = 0; c < src.channels(); c++) {
+		for (int y = 0; y < height; y++) {
+			const uint8_t *from = (const uint8_t *)src.data() + (size_t)c * src.stride(2) +
+			                      (size_t)(y % src.height()) * src.stride(1);
+			uint8_t *row = im.data() + (size_t)c * im.stride(2) + (size_t)y * im.stride(1);
+			for (int x = 0; x < width; x += src.width()) {
+				memcpy(row + x, from, std::min(src.width(), width - x));
+			}
+		}
+	}
+	im.set_host_dirty();
+	return im;
+}
+
+// The machine's memory bandwidth in GB/s, counting the bytes both read
+// and written: the best of a few copies of a buffer much bigger than
+// any cache, split between one thread per core.
+inline double peak_bandwidth_gbps() {
+	const size_t bytes = (size_t)256 << 20;
+	std::vector<uint8_t> src(bytes, 1), dst(bytes, 0);
+	int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+	double best = 0;
+	for (int run = 0; run < 5; run++) {
+		auto t0 = std::chrono::steady_clock::now();
+		std::vector<std::thread> workers;
+		for (int t = 0; t < threads; t++) {
+			workers.emplace_back([&, t]() {
+				size_t begin = bytes * t / threads, end = bytes * (t + 1) / threads;
+				memcpy(dst.data() + begin, src.data() + begin, end - begin);
+			});
+		}
+		for (std::thread &w : workers) {
+			w.join();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		best = std::max(best, 2.0 * bytes / seconds / 1e9);
+	}
+	return best;
+}
+
+// The bandwidth a point achieved, in GB/s: a byte read and a byte
+// written per value.
+inline double achieved_gbps(const BenchmarkResult &r, int channels = 3) {
+	return 2.0 * channels * r.megapixels * 1e6 / (r.median_ms / 1000.0) / 1e9;
+}
+
+// Print a scaling curve: points[i] ran on threads[i] threads. For
+// strong scaling the speedup is over the first point; for weak scaling
+// the image grew with the threads, so the efficiency is the first
+// point's time over each one's.
+inline void print_scaling(const char *kind, const std::string &name, const std::vector<int> &threads,
+                          const std::vector<BenchmarkResult> &points, bool weak, double peak_gbps) {
+	if (points.empty()) {
+		return;
+	}
+	printf("%s scaling of %s:\n", kind, name.c_str());
+	printf("  threads   median ms   speedup   efficiency    GB/s   of peak\n");
+	const BenchmarkResult &first = points[0];
+	for (size_t i = 0; i < points.size(); i++) {
+		const BenchmarkResult &r = points[i];
+		double relative = threads[i] / (double)threads[0];
+		double speedup = weak ? relative * first.median_ms / r.median_ms : first.median_ms / r.median_ms;
+		double gbps = achieved_gbps(r);
+		printf("  %7d   %9.3f   %6.2fx   %9.1f%%   %5.1f   %6.1f%%\n",
+			threads[i], r.median_ms, speedup, 100 * speedup / relative, gbps,
+			peak_gbps > 0 ? 100 * gbps / peak_gbps : 0.0);
+	}
+}
+
+#endif
@@ -0,0 +1,232 @@
+// Sequence mode: the frames of a video through one set of buffers.
+//
+// Calling the pipeline once per frame, with a fresh output Image every
+// time, allocates (and on the GPU, uploads and downloads) everything
+// again for every frame, although every frame of a video is the same
+// size. A FrameSequence instead owns a ring of depth input and output
+// buffers, allocated once, with device memory from the DevicePool that
+// they keep for the life of the sequence. The caller writes each frame
+// into next_input() and calls process(), and the frame's output stays
+// valid for the next depth - 1 frames, so an encoder can still be
+// reading one while later ones are computed.
+//
+// Frames that repeat the one before (a paused or static scene) aren't
+// processed at all: process() hands back the last output again, with
+// nothing uploaded or computed. It notices by comparing the frame with
+// the last one processed, which is still in its slot of the ring, or,
+// if compare_frames is off, by whether the caller marked the frame as
+// new with set_host_dirty(). The gamma table needs no reuploading
+// either way: the ahead-of-time variants embed it as a constant, which
+// the runtime copies to the device with the first frame and keeps.
+//
+// With fps set, process() keeps the sequence to that frame rate,
+// waiting out the rest of each frame's period, and counts the frames
+// that took longer than a period. The latency of every frame, from
+// process() being called to its output being back on the host, goes
+// into a histogram.
+
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+// For Histogram. It comes first because on Windows its winsock2.h has
+// to come before anything includes windows.h.
+#include "service.h"
+#include "gpu_async.h"
+
+#include <chrono>
+#include <memory>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+struct SequenceConfig {
+	// Frames in the ring. Each frame's output stays valid until depth
+	// - 1 more have been processed. At least 2.
+	int depth = 3;
+
+	// Frames per second to hold the sequence to; 0 runs each frame as
+	// soon as the caller has it.
+	double fps = 0;
+
+	// Compare each frame with the last one processed, to skip repeats.
+	// Off, only frames marked with set_host_dirty() are processed.
+	bool compare_frames = true;
+};
+
+class FrameSequence {
+public:
+	// A sequence of width x height frames with channels channels, for
+	// variant.
+	FrameSequence(const AotVariant &variant, int width, int height, int channels = 3,
+	              const SequenceConfig &config = SequenceConfig()) :
+		variant(variant), config(config), slots(std::max(config.depth, 2)) {
+		for (GpuSlot &slot : slots) {
+			slot.input = Halide::Image<uint8_t>(width, height, channels);
+			slot.output = Halide::Image<uint8_t>(width, height, channels);
+			if (variant.on_gpu) {
+				acquire_slot(slot, variant.device_interface());
+			}
+		}
+		frame_bytes = (size_t)width * height * channels;
+	}
+
+	~FrameSequence() {
+		for (GpuSlot &slot : slots) {
+			release_slot(slot);
+		}
+	}
+
+	FrameSequence(const FrameSequence &) = delete;
+	FrameSequence &operator=(const FrameSequence &) = delete;
+
+	// Where the next frame goes. With compare_frames off, mark it with
+	// set_host_dirty() once it's written, unless it repeats the last.
+	Halide::Image<uint8_t> &next_input() { return slots[next].input; }
+
+	// Process the frame in next_input(), and point *output at the
+	// result.
+	int process(Halide::Image<uint8_t> *output) {
+		auto t0 = std::chrono::steady_clock::now();
+		GpuSlot &slot = slots[next];
+		buffer_t *in = slot.input.raw_buffer();
+		bool repeat;
+		if (last < 0) {
+			repeat = false;
+		}
+		else if (config.compare_frames) {
+			repeat = memcmp(slot.input.data(), slots[last].input.data(), frame_bytes) == 0;
+		}
+		else {
+			repeat = !in->host_dirty;
+		}
+
+		if (repeat) {
+			// The ring doesn't move on, so the next frame is written
+			// over this one, and the last output stays where it is.
+			repeats++;
+		}
+		else {
+			in->host_dirty = true;
+			int result = run_variant(variant, in, slot.output.raw_buffer());
+			if (result != 0) {
+				return result;
+			}
+			// A GPU variant's upload cleans the input; on the CPU it's
+			// left to us.
+			in->host_dirty = false;
+			last = next;
+			next = (next + 1) % (int)slots.size();
+		}
+		*output = slots[last].output;
+
+		auto done = std::chrono::steady_clock::now();
+		latency.record(std::chrono::duration<double, std::micro>(done - t0).count());
+		frames++;
+		pace(done);
+		return 0;
+	}
+
+	void print_stats() const {
+		double seconds = frames ? std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count() : 0.0;
+		printf("Sequence of %lld frames on the %s variant, %lld of them repeats, at %1.1f frames/second",
+			frames, variant.name, repeats, seconds > 0 ? frames / seconds : 0.0);
+		if (config.fps > 0) {
+			printf(" (target %1.1f, %lld late)", config.fps, late);
+		}
+		printf("\nFrame latency: %s\n", latency.summary("us").c_str());
+	}
+
+private:
+	AotVariant variant;
+	SequenceConfig config;
+	std::vector<GpuSlot> slots;
+	size_t frame_bytes;
+
+	// The slot the next frame goes in, and the one holding the last
+	// frame processed, or -1 before there is one.
+	int next = 0, last = -1;
+
+	long long frames = 0, repeats = 0, late = 0;
+	Histogram latency;
+
+	// When the first frame was due, and the next one is.
+	std::chrono::steady_clock::time_point start, deadline;
+
+	// Wait until this frame's period is over. A frame that overran its
+	// period by more than another whole one starts the schedule again
+	// from now, rather than the sequence racing to catch up.
+	void pace(std::chrono::steady_clock::time_point done) {
+		if (frames == 1) {
+			start = deadline = done;
+		}
+		if (config.fps <= 0) {
+			return;
+		}
+		auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1.0 / config.fps));
+		deadline += period;
+		if (done > deadline) {
+			late++;
+			if (done > deadline + period) {
+				deadline = done;
+			}
+			return;
+		}
+		std::this_thread::sleep_until(deadline);
+	}
+};
+
+// Run the images in source through the variant as the frames of one
+// sequence, in name order, saving the results to out_dir if it's
+// given. Frames of a different size from the first are skipped.
+inline int process_sequence(const AotVariant &variant, const std::string &source,
+                            const std::string &out_dir, const SequenceConfig &config = SequenceConfig()) {
+	using Halide::Image;
+
+	std::vector<std::string> files = list_images(source);
+	printf("Processing %d frames from %s as a sequence on the %s variant\n",
+		(int)files.size(), source.c_str(), variant.name);
+
+	std::unique_ptr<FrameSequence> sequence;
+	int failed = 0;
+	for (const std::string &file : files) {
+		Image<uint8_t> frame;
+		if (!load_rgb(file, &frame) || frame.dimensions() != 3 || frame.channels() != 3) {
+			printf("Skipping %s: not an RGB image\n", file.c_str());
+			failed++;
+			continue;
+		}
+		if (!sequence) {
+			sequence.reset(new FrameSequence(variant, frame.width(), frame.height(), 3, config));
+		}
+		Image<uint8_t> &input = sequence->next_input();
+		if (input.width() != frame.width() || input.height() != frame.height()) {
+			printf("Skipping %s: not the size of the first frame\n", file.c_str());
+			failed++;
+			continue;
+		}
+		memcpy(input.data(), frame.data(), (size_t)frame.width() * frame.height() * 3);
+		input.set_host_dirty();
+
+		Image<uint8_t> output;
+		if (sequence->process(&output) != 0) {
+			printf("%s: %s variant failed\n", file.c_str(), variant.name);
+			failed++;
+			continue;
+		}
+		if (!out_dir.empty()) {
+			std::string out = output_path(out_dir, file);
+			if (!save_rgb(output, out)) {
+				printf("Could not save %s\n", out.c_str());
+				failed++;
+			}
+		}
+	}
+	if (sequence) {
+		sequence->print_stats();
+	}
+	return failed ? -1 : 0;
+}
+
+#endif
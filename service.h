@@ -0,0 +1,511 @@
+// Service mode: a resident process that keeps the pipelines warm and
+// processes images as requests arrive, for running behind an RPC
+// front end.
+//
+// Every other mode pays its setup once per run: the GPU context is
+// created, the thread pool started and device memory allocated, and
+// then the process exits. A PipelineService does that once, and then
+// takes requests from any number of threads through submit(), or over
+// a socket through serve_socket(). Requests wait in one queue, and
+// each worker -- one per variant, so usually one on the CPU and one
+// on the GPU -- takes the next one as soon as it's free.
+//
+// Small images are mostly fixed cost, so a worker that takes a request
+// also takes every other request of the same size that's waiting, up
+// to max_batch, and runs them as one realization of the batch
+// pipeline. If nothing else is waiting, it waits up to batch_window_us
+// for company before running the request alone; under load there's
+// always something waiting, and batches form without any delay. The
+// batch pipeline is 8-bit RGB only, so requests in other formats (gray
+// or RGBA) always run alone, through the pipeline for their format.
+//
+// The service keeps histograms of the latency of every request, from
+// submit() to completion, and of the queue depth and batch size each
+// time a worker takes work, to check p99 latency against a target.
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "HalideRuntime.h"
+#include "raw_frame.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET service_socket_t;
+#define SERVICE_CLOSE_SOCKET closesocket
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int service_socket_t;
+#define INVALID_SOCKET (-1)
+#define SERVICE_CLOSE_SOCKET close
+#endif
+
+struct ServiceConfig {
+	// The most requests run as one batch.
+	int max_batch = 8;
+
+	// How long a request waits for others of its size to share a
+	// batch with, when there are none waiting already, in
+	// microseconds. 0 never waits.
+	int batch_window_us = 500;
+
+	// submit() turns requests away once this many are waiting, rather
+	// than letting latency grow without bound.
+	int max_queue = 256;
+};
+
+// A histogram of positive values with buckets a quarter of a power of
+// two apart, so percentiles are accurate to within 19% over any range.
+// record() is lock-free, so every thread can record into one.
+class Histogram {
+public:
+	Histogram() {
+		for (auto &c : counts) {
+			c = 0;
+		}
+	}
+
+	void record(double value) {
+		counts[bucket(value)]++;
+		total++;
+		long long v = (long long)value;
+		sum += v;
+		long long m = max_value.load();
+		while (v > m && !max_value.compare_exchange_weak(m, v)) {
+		}
+	}
+
+	long long count() const { return total; }
+	double mean() const { return total ? (double)sum / total : 0.0; }
+	double max() const { return (double)max_value; }
+
+	// The upper bound of the bucket holding the p-th percentile.
+	double percentile(double p) const {
+		long long target = (long long)ceil(total * p / 100.0), seen = 0;
+		for (int b = 0; b < num_buckets; b++) {
+			seen += counts[b];
+			if (seen >= target && seen > 0) {
+				return std::min(upper_bound(b), max());
+			}
+		}
+		return max();
+	}
+
+	std::string summary(const char *unit) const {
+		char line[256];
+		snprintf(line, sizeof(line), "n=%lld mean=%.1f%s p50=%.1f%s p90=%.1f%s p99=%.1f%s p99.9=%.1f%s max=%.1f%s",
+			count(), mean(), unit, percentile(50), unit, percentile(90), unit,
+			percentile(99), unit, percentile(99.9), unit, max(), unit);
+		return line;
+	}
+
+private:
+	static const int per_octave = 4, num_buckets = 40 * per_octave;
+	std::atomic<long long> counts[num_buckets];
+	std::atomic<long long> total{ 0 }, sum{ 0 }, max_value{ 0 };
+
+	static int bucket(double value) {
+		if (value < 1) {
+			return 0;
+		}
+		return std::min(num_buckets - 1, 1 + (int)(log2(value) * per_octave));
+	}
+
+	static double upper_bound(int b) {
+		return b == 0 ? 1.0 : pow(2.0, (double)b / per_octave);
+	}
+};
+
+class PipelineService {
+public:
+	// Runs input through the pipeline into output, returning 0 on
+	// success. With batch, both are four-dimensional batches of
+	// same-sized images.
+	typedef std::function<int(buffer_t *input, buffer_t *output, bool batch)> Runner;
+
+	PipelineService(const ServiceConfig &config = ServiceConfig()) : config(config) {}
+
+	~PipelineService() {
+		stop();
+	}
+
+	// Start a worker that runs batches with run. name is for the
+	// statistics.
+	void add_worker(const std::string &name, Runner run) {
+		std::unique_ptr<Worker> w(new Worker);
+		w->name = name;
+		w->run = run;
+		Worker *p = w.get();
+		w->thread = std::thread([this, p]() { worker_loop(p); });
+		workers.push_back(std::move(w));
+	}
+
+	// Queue input to be processed into output, which must be
+	// three-dimensional 8-bit images of the same size, with 1 to 4
+	// channels, in any layout.
+	// They stay the caller's, and must stay alive until the result is
+	// ready: 0 on success, or an error code, or -1 if the queue was
+	// full.
+	std::future<int> submit(const buffer_t *input, buffer_t *output) {
+		Request r;
+		r.input = input;
+		r.output = output;
+		r.arrival = std::chrono::steady_clock::now();
+		std::future<int> result = r.done.get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping || (int)queue.size() >= config.max_queue) {
+				rejected++;
+				r.done.set_value(-1);
+				return result;
+			}
+			queue.push_back(std::move(r));
+		}
+		ready.notify_one();
+		return result;
+	}
+
+	// Finish the requests already queued, then stop the workers.
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready.notify_all();
+		for (auto &w : workers) {
+			if (w->thread.joinable()) {
+				w->thread.join();
+			}
+		}
+	}
+
+	std::string stats() const {
+		std::string s;
+		s += "Latency:     " + latency.summary("us") + "\n";
+		s += "Queue depth: " + queue_depth.summary("") + "\n";
+		s += "Batch size:  " + batch_size.summary("") + "\n";
+		for (auto &w : workers) {
+			char line[256];
+			snprintf(line, sizeof(line), "%-12s %lld requests in %lld batches, %lld failed\n",
+				(w->name + ":").c_str(), (long long)w->requests, (long long)w->batches, (long long)w->failures);
+			s += line;
+		}
+		if (rejected) {
+			s += "Rejected:    " + std::to_string((long long)rejected) + " requests, with the queue full\n";
+		}
+		return s;
+	}
+
+	void print_stats() const {
+		printf("%s", stats().c_str());
+	}
+
+private:
+	struct Request {
+		const buffer_t *input;
+		buffer_t *output;
+		std::promise<int> done;
+		std::chrono::steady_clock::time_point arrival;
+	};
+
+	struct Worker {
+		std::string name;
+		Runner run;
+		std::thread thread;
+		std::atomic<long long> requests{ 0 }, batches{ 0 }, failures{ 0 };
+	};
+
+	ServiceConfig config;
+	std::vector<std::unique_ptr<Worker> > workers;
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<Request> queue;
+	bool stopping = false;
+	std::atomic<long long> rejected{ 0 };
+
+	// Latency is in microseconds.
+	Histogram latency, queue_depth, batch_size;
+
+	static bool same_size(const buffer_t *a, const buffer_t *b) {
+		return a->elem_size == b->elem_size && a->extent[0] == b->extent[0] &&
+		       a->extent[1] == b->extent[1] && a->extent[2] == b->extent[2];
+	}
+
+	// Whether requests like this one can share a batch: the batch
+	// pipeline only takes 8-bit RGB.
+	static bool batchable(const buffer_t *b) {
+		return b->elem_size == 1 && b->extent[2] == 3;
+	}
+
+	// Take the next request, and if it can be batched, every other
+	// waiting request of its size up to max_batch. Returns false once
+	// the service is stopping and the queue is empty.
+	bool take(std::vector<Request> *group) {
+		std::unique_lock<std::mutex> lock(mutex);
+		ready.wait(lock, [&]() { return stopping || !queue.empty(); });
+		if (queue.empty()) {
+			return false;
+		}
+		queue_depth.record((double)queue.size());
+		group->clear();
+		group->push_back(std::move(queue.front()));
+		queue.pop_front();
+		const buffer_t *first = group->front().input;
+		auto deadline = group->front().arrival + std::chrono::microseconds(config.batch_window_us);
+		while (batchable(first)) {
+			for (auto it = queue.begin(); it != queue.end() && (int)group->size() < config.max_batch;) {
+				if (same_size(it->input, first)) {
+					group->push_back(std::move(*it));
+					it = queue.erase(it);
+				}
+				else {
+					++it;
+				}
+			}
+			if ((int)group->size() >= config.max_batch || stopping ||
+			    std::chrono::steady_clock::now() >= deadline) {
+				break;
+			}
+			ready.wait_until(lock, deadline);
+		}
+		// Others may be waiting on requests of other sizes.
+		if (!queue.empty()) {
+			ready.notify_one();
+		}
+		return true;
+	}
+
+	void worker_loop(Worker *w) {
+		std::vector<Request> group;
+		std::vector<uint8_t> batch_input, batch_output;
+		while (take(&group)) {
+			batch_size.record((double)group.size());
+			int result;
+			if (group.size() == 1) {
+				// Copies of the descriptors, so the caller's aren't
+				// touched if a GPU variant borrows device memory for
+				// them.
+				buffer_t in = *group[0].input, out = *group[0].output;
+				in.host_dirty = true;
+				result = w->run(&in, &out, false);
+			}
+			else {
+				result = run_batch(w, group, &batch_input, &batch_output);
+			}
+			w->batches++;
+			auto now = std::chrono::steady_clock::now();
+			for (Request &r : group) {
+				w->requests++;
+				if (result != 0) {
+					w->failures++;
+				}
+				latency.record(std::chrono::duration<double, std::micro>(now - r.arrival).count());
+				r.done.set_value(result);
+			}
+		}
+	}
+
+	// Stack the group's inputs into one planar batch, run it, and copy
+	// each image of the result back out. The batch buffers are reused
+	// from one batch to the next.
+	int run_batch(Worker *w, std::vector<Request> &group,
+	              std::vector<uint8_t> *input_data, std::vector<uint8_t> *output_data) {
+		const buffer_t *first = group[0].input;
+		int width = first->extent[0], height = first->extent[1];
+		int channels = first->extent[2] ? first->extent[2] : 1;
+		int count = (int)group.size();
+		size_t image_bytes = (size_t)width * height * channels;
+		input_data->resize(image_bytes * count);
+		output_data->resize(image_bytes * count);
+
+		buffer_t in = buffer_t(), out;
+		in.extent[0] = width;
+		in.extent[1] = height;
+		in.extent[2] = channels;
+		in.extent[3] = count;
+		in.stride[0] = 1;
+		in.stride[1] = width;
+		in.stride[2] = width * height;
+		in.stride[3] = (int32_t)image_bytes;
+		in.elem_size = 1;
+		out = in;
+		in.host = input_data->data();
+		out.host = output_data->data();
+		in.host_dirty = true;
+
+		for (int n = 0; n < count; n++) {
+			buffer_t slice = slice_of(in, n);
+			copy_pixels(group[n].input, &slice);
+		}
+		int result = w->run(&in, &out, true);
+		if (result != 0) {
+			return result;
+		}
+		for (int n = 0; n < count; n++) {
+			buffer_t slice = slice_of(out, n);
+			copy_pixels(&slice, group[n].output);
+		}
+		return 0;
+	}
+
+	static buffer_t slice_of(const buffer_t &batch, int n) {
+		buffer_t slice = batch;
+		slice.host += (size_t)n * batch.stride[3];
+		slice.extent[3] = 0;
+		slice.stride[3] = 0;
+		slice.dev = 0;
+		return slice;
+	}
+};
+
+// The wire protocol of serve_socket(). Every message starts with a
+// ServiceHeader, in the server's byte order.
+//
+//   "HTRQ" width height channels, then width * height * channels bytes
+//          of planar 8-bit pixels: process an image. The reply is
+//          "HTRS" status width height, then the pixels if status is 0.
+//   "HTST" 0 0 0: the reply is "HTST" length 0 0, then length bytes of
+//          PipelineService::stats().
+//
+// A connection can send any number of requests, one after another.
+// Connections are served concurrently, so requests from different
+// clients are batched together.
+struct ServiceHeader {
+	char magic[4];
+	int32_t a, b, c;
+};
+
+inline bool service_read(service_socket_t s, void *data, size_t bytes) {
+	char *p = (char *)data;
+	while (bytes) {
+		int n = recv(s, p, (int)std::min(bytes, (size_t)1 << 30), 0);
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		bytes -= n;
+	}
+	return true;
+}
+
+inline bool service_write(service_socket_t s, const void *data, size_t bytes) {
+	const char *p = (const char *)data;
+	while (bytes) {
+		int n = send(s, p, (int)std::min(bytes, (size_t)1 << 30), 0);
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		bytes -= n;
+	}
+	return true;
+}
+
+inline void serve_connection(PipelineService *service, service_socket_t s) {
+	int one = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+	std::vector<uint8_t> input, output;
+	ServiceHeader h;
+	while (service_read(s, &h, sizeof(h))) {
+		if (memcmp(h.magic, "HTST", 4) == 0) {
+			std::string text = service->stats();
+			ServiceHeader reply = { { 'H', 'T', 'S', 'T' }, (int32_t)text.size(), 0, 0 };
+			if (!service_write(s, &reply, sizeof(reply)) || !service_write(s, text.data(), text.size())) {
+				break;
+			}
+			continue;
+		}
+		int width = h.a, height = h.b, channels = h.c;
+		if (memcmp(h.magic, "HTRQ", 4) != 0 || width <= 0 || height <= 0 ||
+		    channels < 1 || channels > 4 || (long long)width * height > (1 << 28)) {
+			break;
+		}
+		size_t bytes = (size_t)width * height * channels;
+		input.resize(bytes);
+		output.resize(bytes);
+		if (!service_read(s, input.data(), bytes)) {
+			break;
+		}
+		buffer_t in = buffer_t();
+		in.extent[0] = width;
+		in.extent[1] = height;
+		in.extent[2] = channels;
+		in.stride[0] = 1;
+		in.stride[1] = width;
+		in.stride[2] = width * height;
+		in.elem_size = 1;
+		buffer_t out = in;
+		in.host = input.data();
+		out.host = output.data();
+
+		int status = service->submit(&in, &out).get();
+		ServiceHeader reply = { { 'H', 'T', 'R', 'S' }, status, width, height };
+		if (!service_write(s, &reply, sizeof(reply)) ||
+		    (status == 0 && !service_write(s, output.data(), bytes))) {
+			break;
+		}
+	}
+	SERVICE_CLOSE_SOCKET(s);
+}
+
+// Accept connections on port, serving each one on its own thread,
+// until accepting fails. Returns false if the port can't be opened.
+inline bool serve_socket(PipelineService &service, int port) {
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		return false;
+	}
+#endif
+	service_socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET) {
+		return false;
+	}
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+	sockaddr_in addr = sockaddr_in();
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((uint16_t)port);
+	if (bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+		SERVICE_CLOSE_SOCKET(listener);
+		return false;
+	}
+	printf("Serving on port %d\n", port);
+	for (;;) {
+		service_socket_t s = accept(listener, NULL, NULL);
+		if (s == INVALID_SOCKET) {
+			break;
+		}
+		std::thread(serve_connection, &service, s).detach();
+	}
+	SERVICE_CLOSE_SOCKET(listener);
+	return true;
+}
+
+#endif
@@ -0,0 +1,367 @@
+// Streaming mode: process images too big to hold in memory.
+//
+// The input is read a band of scanlines at a time, each band is run
+// through the interleaved variant of the pipeline, and the output rows
+// are written as soon as they're computed, so the memory used depends
+// on the width of the image and the band height but not on the height
+// of the image.
+//
+// sharpen reads one row above and one below each output pixel, so the
+// input buffer for a band holds that halo too. MyPipeline clamps to
+// the edges of its input buffer, so at the top and bottom of the image
+// -- where there's no halo -- the band gets the same boundary
+// condition as the whole image would.
+//
+// The schedules split y into strips of 16 rows on the CPU and tiles of
+// 8 on the GPU, and Halide needs every output band to be at least as
+// tall as the split, so bands are at least streaming_min_band rows,
+// and a short tail at the bottom of the image is folded into the band
+// before it rather than run on its own.
+//
+// PNG and binary PPM are supported, for 8-bit RGB images only.
+
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include "halide_image_io.h"
+#include "aot_variants.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Reads an image one interleaved RGB row at a time, top to bottom.
+class RowReader {
+public:
+	virtual ~RowReader() {}
+	virtual bool read_row(uint8_t *row) = 0;
+	int width = 0, height = 0;
+};
+
+// Writes an image one interleaved RGB row at a time, top to bottom.
+class RowWriter {
+public:
+	virtual ~RowWriter() {}
+	virtual bool write_row(const uint8_t *row) = 0;
+	virtual bool finish() = 0;
+};
+
+#ifndef HALIDE_NOPNG
+class PngRowReader : public RowReader {
+public:
+	~PngRowReader() {
+		if (png_ptr) {
+			png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+		}
+		if (f) {
+			fclose(f);
+		}
+	}
+
+	bool open(const std::string &filename) {
+		f = fopen(filename.c_str(), "rb");
+		png_byte header[8];
+		if (!f || fread(header, 1, 8, f) != 8 || png_sig_cmp(header, 0, 8)) {
+			printf("%s is not a readable PNG file\n", filename.c_str());
+			return false;
+		}
+		png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+		if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+			return false;
+		}
+		png_init_io(png_ptr, f);
+		png_set_sig_bytes(png_ptr, 8);
+		png_read_info(png_ptr, info_ptr);
+		if (png_get_color_type(png_ptr, info_ptr) != PNG_COLOR_TYPE_RGB ||
+		    png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+		    png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+			printf("%s: only non-interlaced 8-bit RGB PNGs can be streamed\n", filename.c_str());
+			return false;
+		}
+		width = png_get_image_width(png_ptr, info_ptr);
+		height = png_get_image_height(png_ptr, info_ptr);
+		return true;
+	}
+
+	bool read_row(uint8_t *row) override {
+		if (setjmp(png_jmpbuf(png_ptr))) {
+			return false;
+		}
+		png_read_row(png_ptr, row, NULL);
+		return true;
+	}
+
+private:
+	FILE *f = NULL;
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+};
+
+class PngRowWriter : public RowWriter {
+public:
+	~PngRowWriter() {
+		if (png_ptr) {
+			png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : NULL);
+		}
+		if (f) {
+			fclose(f);
+		}
+	}
+
+	bool open(const std::string &filename, int width, int height) {
+		f = fopen(filename.c_str(), "wb");
+		if (!f) {
+			printf("File %s could not be opened for writing\n", filename.c_str());
+			return false;
+		}
+		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+		if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+			return false;
+		}
+		png_init_io(png_ptr, f);
+		png_set_IHDR(png_ptr, info_ptr, width, height,
+		             8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		             PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_write_info(png_ptr, info_ptr);
+		return true;
+	}
+
+	bool write_row(const uint8_t *row) override {
+		if (setjmp(png_jmpbuf(png_ptr))) {
+			return false;
+		}
+		png_write_row(png_ptr, (png_bytep)row);
+		return true;
+	}
+
+	bool finish() override {
+		if (setjmp(png_jmpbuf(png_ptr))) {
+			return false;
+		}
+		png_write_end(png_ptr, NULL);
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		png_ptr = NULL;
+		bool ok = fclose(f) == 0;
+		f = NULL;
+		return ok;
+	}
+
+private:
+	FILE *f = NULL;
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+};
+#endif
+
+class PpmRowReader : public RowReader {
+public:
+	~PpmRowReader() {
+		if (f) {
+			fclose(f);
+		}
+	}
+
+	bool open(const std::string &filename) {
+		f = fopen(filename.c_str(), "rb");
+		char magic[3] = {};
+		int maxval = 0;
+		if (!f || fscanf(f, "%2s %d %d %d", magic, &width, &height, &maxval) != 4 ||
+		    strcmp(magic, "P6") != 0 || maxval != 255 || fgetc(f) == EOF) {
+			printf("%s: only binary 8-bit PPMs can be streamed\n", filename.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	bool read_row(uint8_t *row) override {
+		return fread(row, 3, width, f) == (size_t)width;
+	}
+
+private:
+	FILE *f = NULL;
+};
+
+class PpmRowWriter : public RowWriter {
+public:
+	~PpmRowWriter() {
+		if (f) {
+			fclose(f);
+		}
+	}
+
+	bool open(const std::string &filename, int w, int height) {
+		width = w;
+		f = fopen(filename.c_str(), "wb");
+		if (!f) {
+			printf("File %s could not be opened for writing\n", filename.c_str());
+			return false;
+		}
+		fprintf(f, "P6\n%d %d\n255\n", width, height);
+		return true;
+	}
+
+	bool write_row(const uint8_t *row) override {
+		return fwrite(row, 3, width, f) == (size_t)width;
+	}
+
+	bool finish() override {
+		bool ok = fclose(f) == 0;
+		f = NULL;
+		return ok;
+	}
+
+private:
+	FILE *f = NULL;
+	int width = 0;
+};
+
+// Pick a reader or writer from the file extension, as
+// Halide::Tools::load and save do.
+inline std::unique_ptr<RowReader> open_row_reader(const std::string &filename) {
+	using Halide::Tools::Internal::ends_with_ignore_case;
+#ifndef HALIDE_NOPNG
+	if (ends_with_ignore_case(filename, ".png")) {
+		std::unique_ptr<PngRowReader> r(new PngRowReader);
+		return r->open(filename) ? std::move(r) : nullptr;
+	}
+#endif
+	if (ends_with_ignore_case(filename, ".ppm")) {
+		std::unique_ptr<PpmRowReader> r(new PpmRowReader);
+		return r->open(filename) ? std::move(r) : nullptr;
+	}
+	printf("Can't stream %s: not a PNG or PPM file\n", filename.c_str());
+	return nullptr;
+}
+
+inline std::unique_ptr<RowWriter> open_row_writer(const std::string &filename, int width, int height) {
+	using Halide::Tools::Internal::ends_with_ignore_case;
+#ifndef HALIDE_NOPNG
+	if (ends_with_ignore_case(filename, ".png")) {
+		std::unique_ptr<PngRowWriter> w(new PngRowWriter);
+		return w->open(filename, width, height) ? std::move(w) : nullptr;
+	}
+#endif
+	if (ends_with_ignore_case(filename, ".ppm")) {
+		std::unique_ptr<PpmRowWriter> w(new PpmRowWriter);
+		return w->open(filename, width, height) ? std::move(w) : nullptr;
+	}
+	printf("Can't stream to %s: not a PNG or PPM file\n", filename.c_str());
+	return nullptr;
+}
+
+// The shortest band the interleaved variant's schedules can run.
+static const int streaming_min_band = 16;
+
+// An interleaved buffer_t over rows [min_y, min_y + rows) of an image
+// of the given width, stored in data.
+inline buffer_t band_buffer(uint8_t *data, int width, int min_y, int rows) {
+	buffer_t buf = {};
+	buf.host = data;
+	buf.extent[0] = width;
+	buf.extent[1] = rows;
+	buf.extent[2] = 3;
+	buf.stride[0] = 3;
+	buf.stride[1] = 3 * width;
+	buf.stride[2] = 1;
+	buf.min[1] = min_y;
+	buf.elem_size = 1;
+	buf.host_dirty = true;
+	return buf;
+}
+
+// Run input_filename through the interleaved variant band_height rows
+// at a time, writing output_filename as it goes. band_height is rounded
+// up to streaming_min_band.
+inline int process_streaming(const AotVariant &variant, const std::string &input_filename,
+                             const std::string &output_filename, int band_height) {
+	std::unique_ptr<RowReader> reader = open_row_reader(input_filename);
+	if (!reader) {
+		return -1;
+	}
+	int width = reader->width, height = reader->height;
+	std::unique_ptr<RowWriter> writer = open_row_writer(output_filename, width, height);
+	if (!writer) {
+		return -1;
+	}
+	if (band_height < streaming_min_band) {
+		printf("Bands must be at least %d rows, so using %d\n", streaming_min_band, streaming_min_band);
+		band_height = streaming_min_band;
+	}
+	printf("Streaming %dx%d image in bands of %d rows with the %s variant\n",
+		width, height, band_height, variant.name);
+
+	size_t row_bytes = 3 * (size_t)width;
+	// The input band, with a row of halo above and below, and the
+	// output band. The last band can take up to streaming_min_band - 1
+	// extra rows.
+	int max_rows = band_height + streaming_min_band - 1;
+	std::vector<uint8_t> in_rows((max_rows + 2) * row_bytes), out_rows(max_rows * row_bytes);
+
+	// Input rows [in_min, in_min + in_count) are in in_rows.
+	int in_min = 0, in_count = 0;
+	double compute_ms = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int y0 = 0, rows = 0; y0 < height; y0 += rows) {
+		rows = std::min(band_height, height - y0);
+		if (height - y0 - rows < streaming_min_band) {
+			// Too few rows would be left for a band of their own.
+			rows = height - y0;
+		}
+
+		// The band needs input rows [y0 - 1, y0 + rows], clipped to
+		// the image. Keep the ones the last band already read, and
+		// read the rest.
+		int need_min = std::max(0, y0 - 1);
+		int need_max = std::min(height - 1, y0 + rows);
+		int keep = std::max(0, in_min + in_count - need_min);
+		memmove(in_rows.data(), in_rows.data() + (need_min - in_min) * row_bytes, keep * row_bytes);
+		in_min = need_min;
+		in_count = keep;
+		while (in_min + in_count <= need_max) {
+			if (!reader->read_row(in_rows.data() + in_count * row_bytes)) {
+				printf("Error reading %s at row %d\n", input_filename.c_str(), in_min + in_count);
+				return -1;
+			}
+			in_count++;
+		}
+
+		buffer_t in = band_buffer(in_rows.data(), width, in_min, in_count);
+		buffer_t out = band_buffer(out_rows.data(), width, y0, rows);
+		auto t0 = std::chrono::steady_clock::now();
+		if (run_variant(variant, variant.interleaved_pipeline, &in, &out) != 0) {
+			printf("%s variant failed on rows %d to %d\n", variant.name, y0, y0 + rows - 1);
+			return -1;
+		}
+		compute_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		for (int y = 0; y < rows; y++) {
+			if (!writer->write_row(out_rows.data() + y * row_bytes)) {
+				printf("Error writing %s at row %d\n", output_filename.c_str(), y0 + y);
+				return -1;
+			}
+		}
+	}
+	if (!writer->finish()) {
+		printf("Error writing %s\n", output_filename.c_str());
+		return -1;
+	}
+
+	double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("Streamed %1.1f megapixels in %1.1f ms, %1.1f ms of it computing, using %1.1f MB of buffers\n",
+		width * (double)height / 1e6, total_ms, compute_ms,
+		(in_rows.size() + out_rows.size()) / 1e6);
+	if (variant.on_gpu) {
+		DevicePool::instance().print_stats();
+	}
+	return 0;
+}
+
+#endif
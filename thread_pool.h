@@ -0,0 +1,404 @@
+// A work-stealing thread pool to run Halide's parallel loops.
+//
+// The strips of curved.split(y, yo, yi, 16).parallel(yo) normally run
+// on Halide's own thread pool, which starts one thread per core and
+// knows nothing about the other threads in the process. Two pipelines
+// realized at once (the pipelined and asynchronous modes do that) each
+// expect the whole machine. Once installed with install_thread_pool(),
+// halide_do_par_for comes here instead. The pool has a fixed number of
+// worker threads shared by every realization, so concurrent pipelines
+// split the cores between them rather than oversubscribing them.
+//
+// Each worker has its own queue of ranges of loop iterations. A
+// parallel loop is cut into one contiguous range per worker, so
+// neighbouring strips run on the same thread. A worker takes
+// iterations from the front of its own queue, and when that's empty it
+// steals the back half of the last range in someone else's. The
+// thread that started the loop helps too, rather than just waiting,
+// which is also what keeps nested parallel loops from deadlocking.
+//
+// Optionally each worker is pinned to a core. Cores are numbered node
+// by node on NUMA machines, so consecutive workers -- and with them
+// consecutive ranges of strips -- share a node, and the memory a strip
+// first touches stays local to the cores that use it.
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "HalideRuntime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct ThreadPoolConfig {
+	// Worker threads. Zero means one per core.
+	int threads = 0;
+
+	// Pin each worker to its own core.
+	bool pin = false;
+};
+
+// The processors of each NUMA node, in node order. On machines without
+// NUMA, or where that can't be found out, there's one node with every
+// processor.
+inline std::vector<std::vector<int>> numa_nodes() {
+	std::vector<std::vector<int>> nodes;
+#ifdef _WIN32
+	ULONG highest = 0;
+	if (GetNumaHighestNodeNumber(&highest)) {
+		for (USHORT node = 0; node <= highest; node++) {
+			ULONGLONG mask = 0;
+			if (!GetNumaNodeProcessorMask((UCHAR)node, &mask) || !mask) {
+				continue;
+			}
+			std::vector<int> cpus;
+			for (int cpu = 0; cpu < 64; cpu++) {
+				if (mask & (1ULL << cpu)) {
+					cpus.push_back(cpu);
+				}
+			}
+			nodes.push_back(cpus);
+		}
+	}
+#else
+	// Each /sys/devices/system/node/nodeN/cpulist reads like "0-7,16-23".
+	std::vector<int> ids;
+	if (DIR *dir = opendir("/sys/devices/system/node")) {
+		while (struct dirent *entry = readdir(dir)) {
+			int id;
+			if (sscanf(entry->d_name, "node%d", &id) == 1) {
+				ids.push_back(id);
+			}
+		}
+		closedir(dir);
+	}
+	std::sort(ids.begin(), ids.end());
+	for (int id : ids) {
+		std::string path = "/sys/devices/system/node/node" + std::to_string(id) + "/cpulist";
+		FILE *f = fopen(path.c_str(), "r");
+		if (!f) {
+			continue;
+		}
+		std::vector<int> cpus;
+		int first, last;
+		while (fscanf(f, "%d", &first) == 1) {
+			last = first;
+			int c = fgetc(f);
+			if (c == '-' && fscanf(f, "%d", &last) == 1) {
+				c = fgetc(f);
+			}
+			for (int cpu = first; cpu <= last; cpu++) {
+				cpus.push_back(cpu);
+			}
+			if (c != ',') {
+				break;
+			}
+		}
+		fclose(f);
+		if (!cpus.empty()) {
+			nodes.push_back(cpus);
+		}
+	}
+#endif
+	if (nodes.empty()) {
+		std::vector<int> cpus;
+		for (int cpu = 0; cpu < (int)std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+			cpus.push_back(cpu);
+		}
+		nodes.push_back(cpus);
+	}
+	return nodes;
+}
+
+inline bool pin_thread(std::thread &t, int cpu) {
+#ifdef _WIN32
+	return cpu < 64 && SetThreadAffinityMask(t.native_handle(), 1ULL << cpu) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) == 0;
+#endif
+}
+
+class WorkStealingPool {
+public:
+	// The pool, once start() has been called, or NULL.
+	static WorkStealingPool *instance() {
+		return pool();
+	}
+
+	// Start the workers. The pool is never shut down, as Halide's own
+	// isn't: its threads sleep when there's nothing to do.
+	static WorkStealingPool *start(const ThreadPoolConfig &config) {
+		if (!pool()) {
+			pool() = new WorkStealingPool(config);
+		}
+		return pool();
+	}
+
+	// Run task for every index in [min, min + size), as
+	// halide_do_par_for does, and return once they've all finished.
+	int par_for(void *user_context, halide_task_t task, int min, int size, uint8_t *closure) {
+		if (size <= 0) {
+			return 0;
+		}
+		Job job;
+		job.user_context = user_context;
+		job.task = task;
+		job.closure = closure;
+		job.remaining = size;
+
+		// One contiguous range per worker, starting with this thread's
+		// own queue if it's a worker, so a nested loop stays local.
+		int n = (int)workers.size();
+		int first = std::max(self(), 0);
+		int ranges = std::min(n, size);
+		for (int r = 0; r < ranges; r++) {
+			Worker &w = *workers[(first + r) % n];
+			std::lock_guard<std::mutex> lock(w.mutex);
+			w.queue.push_back(Range{ &job, min + (int)((long long)size * r / ranges),
+			                         min + (int)((long long)size * (r + 1) / ranges) });
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			queued += ranges;
+		}
+		wake.notify_all();
+
+		// Help until every iteration has finished, not just been taken.
+		while (job.remaining.load(std::memory_order_acquire) > 0) {
+			if (!run_one()) {
+				std::unique_lock<std::mutex> lock(sleep_mutex);
+				wake.wait(lock, [&]() {
+					return queued > 0 || job.remaining.load(std::memory_order_acquire) == 0;
+				});
+			}
+		}
+		return job.exit_status;
+	}
+
+	int num_threads() const {
+		return (int)workers.size();
+	}
+
+	void print_stats() {
+		long long tasks = 0, steals = 0;
+		for (auto &w : workers) {
+			tasks += w->tasks;
+			steals += w->steals;
+		}
+		std::string placement = pinned ? " pinned across " + std::to_string(num_nodes) + " NUMA node(s)" : "";
+		printf("Thread pool: %d workers%s, %lld tasks, %lld stolen (%1.1f%%)\n",
+			num_threads(), placement.c_str(), tasks, steals, tasks ? 100.0 * steals / tasks : 0.0);
+	}
+
+private:
+	struct Job {
+		void *user_context;
+		halide_task_t task;
+		uint8_t *closure;
+		std::atomic<int> remaining;
+		std::atomic<int> exit_status{ 0 };
+	};
+
+	// Iterations [begin, end) of job.
+	struct Range {
+		Job *job;
+		int begin, end;
+	};
+
+	struct Worker {
+		std::mutex mutex;
+		std::deque<Range> queue;
+		std::thread thread;
+		// Tasks run on this thread, and how many of them were stolen.
+		std::atomic<long long> tasks{ 0 }, steals{ 0 };
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	bool pinned = false;
+	int num_nodes = 1;
+
+	// Workers with nothing to do sleep on wake until queued, the
+	// number of ranges in all the queues, is nonzero.
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	int queued = 0;
+
+	static WorkStealingPool *&pool() {
+		static WorkStealingPool *p = NULL;
+		return p;
+	}
+
+	// The index of the calling thread's worker, or -1 for threads that
+	// aren't the pool's own.
+	static int &self() {
+		static thread_local int index = -1;
+		return index;
+	}
+
+	WorkStealingPool(const ThreadPoolConfig &config) {
+		std::vector<std::vector<int>> nodes = numa_nodes();
+		std::vector<int> cpus;
+		for (auto &node : nodes) {
+			cpus.insert(cpus.end(), node.begin(), node.end());
+		}
+		int n = config.threads > 0 ? config.threads : (int)cpus.size();
+		num_nodes = (int)nodes.size();
+
+		for (int i = 0; i < n; i++) {
+			workers.emplace_back(new Worker);
+		}
+		pinned = config.pin;
+		for (int i = 0; i < n; i++) {
+			workers[i]->thread = std::thread([this, i]() { work(i); });
+			if (config.pin && !pin_thread(workers[i]->thread, cpus[i % cpus.size()])) {
+				printf("Could not pin worker %d to processor %d\n", i, cpus[i % cpus.size()]);
+				pinned = false;
+			}
+			workers[i]->thread.detach();
+		}
+	}
+
+	void work(int index) {
+		self() = index;
+		while (true) {
+			if (!run_one()) {
+				std::unique_lock<std::mutex> lock(sleep_mutex);
+				wake.wait(lock, [&]() { return queued > 0; });
+			}
+		}
+	}
+
+	// Take one iteration, from this thread's own queue or else stolen
+	// from another, and run it. Returns false if there was nothing to
+	// take.
+	bool run_one() {
+		int n = (int)workers.size();
+		int me = self();
+		Job *job = NULL;
+		int index = 0;
+		bool stolen = false;
+
+		if (me >= 0) {
+			Worker &w = *workers[me];
+			std::lock_guard<std::mutex> lock(w.mutex);
+			if (!w.queue.empty()) {
+				Range &r = w.queue.front();
+				job = r.job;
+				index = r.begin++;
+				if (r.begin == r.end) {
+					w.queue.pop_front();
+					range_done();
+				}
+			}
+		}
+		// Steal from the next workers along first, which are on the
+		// same node if there's any stealing to be done there.
+		Range mine{ NULL, 0, 0 };
+		for (int k = 1; !job && k <= n; k++) {
+			int victim = ((me >= 0 ? me : 0) + k) % n;
+			if (victim == me) {
+				continue;
+			}
+			Worker &v = *workers[victim];
+			std::lock_guard<std::mutex> lock(v.mutex);
+			if (v.queue.empty()) {
+				continue;
+			}
+			Range &r = v.queue.back();
+			job = r.job;
+			stolen = true;
+			int count = r.end - r.begin;
+			if (count > 1 && me >= 0) {
+				// Take the back half and run the first of it. The rest
+				// goes on this thread's queue to work through.
+				int split = r.begin + count / 2;
+				index = split;
+				mine = Range{ r.job, split + 1, r.end };
+				r.end = split;
+			}
+			else {
+				// Threads that aren't workers have no queue, so they only
+				// take one iteration at a time.
+				index = --r.end;
+				if (r.begin == r.end) {
+					v.queue.pop_back();
+					range_done();
+				}
+			}
+		}
+		// Only one queue is locked at a time, so two workers stealing
+		// from each other can't deadlock.
+		if (mine.begin < mine.end) {
+			Worker &w = *workers[me];
+			{
+				std::lock_guard<std::mutex> lock(w.mutex);
+				w.queue.push_back(mine);
+			}
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			queued++;
+		}
+		if (!job) {
+			return false;
+		}
+
+		if (me >= 0) {
+			workers[me]->tasks++;
+			if (stolen) {
+				workers[me]->steals++;
+			}
+		}
+		int result = halide_do_task(job->user_context, job->task, index, job->closure);
+		if (result != 0) {
+			job->exit_status = result;
+		}
+		if (job->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			// Wake the thread waiting for this job.
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			wake.notify_all();
+		}
+		return true;
+	}
+
+	void range_done() {
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		queued--;
+	}
+};
+
+inline int work_stealing_do_par_for(void *user_context, halide_task_t task,
+                                    int min, int size, uint8_t *closure) {
+	return WorkStealingPool::instance()->par_for(user_context, task, min, size, closure);
+}
+
+// Start the pool and have the AOT runtime's parallel loops run on it.
+// JIT-compiled pipelines take work_stealing_do_par_for through
+// Func::set_custom_do_par_for. Each iteration still goes through
+// halide_do_task, so a custom halide_set_custom_do_task keeps working.
+inline void install_thread_pool(const ThreadPoolConfig &config) {
+	WorkStealingPool::start(config);
+	halide_set_custom_do_par_for(work_stealing_do_par_for);
+}
+
+#endif
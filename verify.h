@@ -0,0 +1,264 @@
+// Comparing a pipeline's output with a reference.
+//
+// Checking each pixel through Image::operator() one at a time, and
+// stopping at the first difference, is slower than the pipeline on a
+// large image, and says nothing about how wrong the output is. Here
+// the rows are split between threads and compared 16 bytes at a time
+// with SSE2, which every x86-64 CPU has. A comparison counts every
+// value that differs by more than the tolerance, and reports the
+// largest difference and the bounding box of the pixels that differ,
+// which is usually enough to tell a boundary bug (a thin frame around
+// the edge) from a precision bug (scattered off-by-ones everywhere).
+//
+// The buffers can be planar or interleaved, or one of each; the fast
+// path is for rows whose bytes are contiguous in both. 16-bit buffers
+// are compared a value at a time.
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "HalideRuntime.h"
+
+#include <algorithm>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VERIFY_SSE2
+#endif
+
+struct VerifyConfig {
+	// Values may differ by this much and still match.
+	int tolerance = 0;
+
+	// Threads to compare with; 0 for one per core. Each gets at least
+	// min_rows rows.
+	int threads = 0;
+	int min_rows = 64;
+};
+
+struct VerifyResult {
+	long long compared = 0, mismatches = 0;
+	int max_error = 0;
+
+	// The pixels with a mismatch in any channel, inclusive. Empty
+	// (min > max) if there are none.
+	int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+
+	// The buffers weren't the same size or type, or weren't 8 or 16-bit.
+	bool incompatible = false;
+
+	bool ok() const { return !incompatible && mismatches == 0; }
+
+	void merge(const VerifyResult &r) {
+		compared += r.compared;
+		mismatches += r.mismatches;
+		max_error = std::max(max_error, r.max_error);
+		min_x = std::min(min_x, r.min_x);
+		min_y = std::min(min_y, r.min_y);
+		max_x = std::max(max_x, r.max_x);
+		max_y = std::max(max_y, r.max_y);
+		incompatible = incompatible || r.incompatible;
+	}
+
+	void add_row(int y, int x0, int x1) {
+		min_x = std::min(min_x, x0);
+		max_x = std::max(max_x, x1);
+		min_y = std::min(min_y, y);
+		max_y = std::max(max_y, y);
+	}
+};
+
+// Compare n contiguous bytes. Returns how many differ by more than
+// tolerance, and raises *max_error to the largest difference.
+inline long long compare_bytes(const uint8_t *a, const uint8_t *b, int n, int tolerance, int *max_error) {
+	long long count = 0;
+	int i = 0;
+#ifdef VERIFY_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i tol = _mm_set1_epi8((char)tolerance);
+	__m128i max_v = zero;
+	while (i + 16 <= n) {
+		// A per-byte counter can take 255 more before it overflows;
+		// then it's summed into count.
+		__m128i counts = zero;
+		int end = std::min(n - 15, i + 255 * 16);
+		for (; i < end; i += 16) {
+			__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+			__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+			__m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+			max_v = _mm_max_epu8(max_v, diff);
+			// Bytes within the tolerance saturate to zero, and compare
+			// equal to it (-1); the others add one.
+			__m128i within = _mm_cmpeq_epi8(_mm_subs_epu8(diff, tol), zero);
+			counts = _mm_sub_epi8(counts, _mm_andnot_si128(within, _mm_set1_epi8(-1)));
+		}
+		__m128i sums = _mm_sad_epu8(counts, zero);
+		count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+	}
+	uint8_t lanes[16];
+	_mm_storeu_si128((__m128i *)lanes, max_v);
+	for (int j = 0; j < 16; j++) {
+		*max_error = std::max(*max_error, (int)lanes[j]);
+	}
+#endif
+	for (; i < n; i++) {
+		int diff = abs(a[i] - b[i]);
+		*max_error = std::max(*max_error, diff);
+		count += diff > tolerance;
+	}
+	return count;
+}
+
+// The first and last of n contiguous bytes (every step-th byte is a
+// new pixel) that differ by more than tolerance, as pixel indices.
+inline void mismatch_range(const uint8_t *a, const uint8_t *b, int n, int step, int tolerance, int *x0, int *x1) {
+	int i = 0, j = n - 1;
+	while (abs(a[i] - b[i]) <= tolerance) {
+		i++;
+	}
+	while (abs(a[j] - b[j]) <= tolerance) {
+		j--;
+	}
+	*x0 = i / step;
+	*x1 = j / step;
+}
+
+// Compare rows [y0, y1) of two 8-bit buffers of the same size.
+inline VerifyResult compare_rows(const buffer_t *out, const buffer_t *ref, int y0, int y1, int tolerance) {
+	VerifyResult r;
+	int width = out->extent[0];
+	int channels = out->extent[2] ? out->extent[2] : 1;
+	bool planar = out->stride[0] == 1 && ref->stride[0] == 1;
+	bool interleaved = out->stride[0] == channels && ref->stride[0] == channels &&
+	                   out->stride[2] == 1 && ref->stride[2] == 1;
+	for (int y = y0; y < y1; y++) {
+		const uint8_t *a = out->host + (int64_t)y * out->stride[1];
+		const uint8_t *b = ref->host + (int64_t)y * ref->stride[1];
+		if (interleaved && channels > 1) {
+			// All the channels of a row at once.
+			long long n = compare_bytes(a, b, width * channels, tolerance, &r.max_error);
+			if (n) {
+				int x0, x1;
+				mismatch_range(a, b, width * channels, channels, tolerance, &x0, &x1);
+				r.mismatches += n;
+				r.add_row(y, x0, x1);
+			}
+			continue;
+		}
+		for (int c = 0; c < channels; c++) {
+			const uint8_t *ac = a + (int64_t)c * out->stride[2];
+			const uint8_t *bc = b + (int64_t)c * ref->stride[2];
+			if (planar) {
+				long long n = compare_bytes(ac, bc, width, tolerance, &r.max_error);
+				if (n) {
+					int x0, x1;
+					mismatch_range(ac, bc, width, 1, tolerance, &x0, &x1);
+					r.mismatches += n;
+					r.add_row(y, x0, x1);
+				}
+				continue;
+			}
+			// Different layouts: a value at a time.
+			for (int x = 0; x < width; x++) {
+				int diff = abs(ac[x * out->stride[0]] - bc[x * ref->stride[0]]);
+				r.max_error = std::max(r.max_error, diff);
+				if (diff > tolerance) {
+					r.mismatches++;
+					r.add_row(y, x, x);
+				}
+			}
+		}
+	}
+	r.compared = (long long)(y1 - y0) * width * channels;
+	return r;
+}
+
+// Compare rows [y0, y1) of two 16-bit buffers of the same size.
+inline VerifyResult compare_rows16(const buffer_t *out, const buffer_t *ref, int y0, int y1, int tolerance) {
+	VerifyResult r;
+	int width = out->extent[0];
+	int channels = out->extent[2] ? out->extent[2] : 1;
+	const uint16_t *a = (const uint16_t *)out->host, *b = (const uint16_t *)ref->host;
+	for (int y = y0; y < y1; y++) {
+		for (int c = 0; c < channels; c++) {
+			for (int x = 0; x < width; x++) {
+				int diff = abs(a[(int64_t)x * out->stride[0] + (int64_t)y * out->stride[1] + (int64_t)c * out->stride[2]] -
+				               b[(int64_t)x * ref->stride[0] + (int64_t)y * ref->stride[1] + (int64_t)c * ref->stride[2]]);
+				r.max_error = std::max(r.max_error, diff);
+				if (diff > tolerance) {
+					r.mismatches++;
+					r.add_row(y, x, x);
+				}
+			}
+		}
+	}
+	r.compared = (long long)(y1 - y0) * width * channels;
+	return r;
+}
+
+// Compare output with reference, which must be 8-bit or 16-bit
+// buffers of the same type and extents, in parallel.
+inline VerifyResult compare_buffers(const buffer_t *out, const buffer_t *ref,
+                                    const VerifyConfig &config = VerifyConfig()) {
+	VerifyResult result;
+	for (int d = 0; d < 4; d++) {
+		if (out->extent[d] != ref->extent[d]) {
+			result.incompatible = true;
+		}
+	}
+	if (result.incompatible || out->elem_size != ref->elem_size ||
+	    (out->elem_size != 1 && out->elem_size != 2)) {
+		result.incompatible = true;
+		return result;
+	}
+
+	int height = out->extent[1] ? out->extent[1] : 1;
+	bool wide = out->elem_size == 2;
+	int tolerance = std::min(std::max(config.tolerance, 0), wide ? 65535 : 255);
+	int threads = config.threads > 0 ? config.threads : (int)std::max(1u, std::thread::hardware_concurrency());
+	int count = std::max(1, std::min(threads, height / std::max(1, config.min_rows)));
+
+	std::vector<VerifyResult> parts(count);
+	auto run = [&](int i) {
+		int y0 = (int)((long long)height * i / count);
+		int y1 = (int)((long long)height * (i + 1) / count);
+		parts[i] = wide ? compare_rows16(out, ref, y0, y1, tolerance) :
+		                  compare_rows(out, ref, y0, y1, tolerance);
+	};
+	std::vector<std::thread> workers;
+	for (int i = 1; i < count; i++) {
+		workers.emplace_back(run, i);
+	}
+	run(0);
+	for (auto &t : workers) {
+		t.join();
+	}
+	for (const VerifyResult &p : parts) {
+		result.merge(p);
+	}
+	return result;
+}
+
+// Print a one-line summary of a comparison.
+inline void print_verify_result(const char *name, const VerifyResult &r, int tolerance) {
+	if (r.incompatible) {
+		printf("%s: output and reference differ in size or type\n", name);
+	}
+	else if (r.ok()) {
+		printf("%s: matches the reference (tolerance %d, max error %d)\n", name, tolerance, r.max_error);
+	}
+	else {
+		printf("%s: %lld of %lld values (%.4f%%) differ by more than %d, max error %d, "
+			"in x %d..%d, y %d..%d\n",
+			name, r.mismatches, r.compared, 100.0 * r.mismatches / r.compared, tolerance,
+			r.max_error, r.min_x, r.max_x, r.min_y, r.max_y);
+	}
+}
+
+#endif